@@ -0,0 +1,179 @@
+/* measures FLAC encode throughput as a multiple of real time for each
+ * compression level and thread count, and checks that the parallel encoder's
+ * output decodes back to the input.
+ *
+ * usage: flac_bench [seconds | file.raw]
+ *
+ * file.raw is 44100/16/2 little endian PCM, e.g. from
+ *     sox take.flac -t raw -e signed -b 16 -c 2 -r 44100 take.raw
+ * otherwise a synthetic piano-ish signal of the given length (default 60s) is used.
+ */
+#include "flacpar.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SAMPLE_RATE     (44100)
+#define CHANNELS        (2)
+#define FEED_FRAMES     (4410)      // what the encoder thread hands over per buffer
+#define OUT_FILENAME    "flac_bench.flac.tmp"
+
+static FLAC__int32 *input;
+static unsigned     input_frames;
+static diskwriter_t writer;         // what the recorder writes flacpar's output through
+
+static void load_synthetic(double seconds) {
+    input_frames = (unsigned)(seconds * SAMPLE_RATE);
+    input = malloc(sizeof(FLAC__int32) * input_frames * CHANNELS);
+    srand(1);
+    unsigned i;
+    double note_freq = 220.0, note_start = 0.0;
+    for (i = 0; i < input_frames; i++) {
+        double t = (double)i / SAMPLE_RATE;
+        if (t - note_start > 0.5) {
+            note_start = t;
+            note_freq  = 110.0 * pow(2.0, (rand() % 48) / 12.0);
+        }
+        double dt  = t - note_start;
+        double env = exp(-dt * 3.0);
+        double s   = env * (0.5 * sin(2 * M_PI * note_freq * t) +
+                            0.25 * sin(2 * M_PI * note_freq * 2 * t) +
+                            0.12 * sin(2 * M_PI * note_freq * 3 * t));
+        double noise = ((rand() % 200) - 100) / 32768.0;
+        input[i * 2]     = (FLAC__int32)((s * 0.6 + noise) * 32767.0);
+        input[i * 2 + 1] = (FLAC__int32)((s * 0.55 + noise) * 32767.0);
+    }
+}
+
+static void load_raw(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) perrorf("fopen", "couldn't open %s", path);
+    struct stat st;
+    fstat(fileno(f), &st);
+    input_frames = (unsigned)(st.st_size / (2 * CHANNELS));
+    short *raw = malloc(st.st_size);
+    if (fread(raw, 1, st.st_size, f) != (size_t)st.st_size) failf("short read on %s", path);
+    fclose(f);
+    input = malloc(sizeof(FLAC__int32) * input_frames * CHANNELS);
+    unsigned i;
+    for (i = 0; i < input_frames * CHANNELS; i++) input[i] = raw[i];
+    free(raw);
+}
+
+typedef struct {
+    unsigned long long  pos;
+    bool                mismatch;
+} verify_state_t;
+
+static FLAC__StreamDecoderWriteStatus verify_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+                                                   const FLAC__int32 * const buffer[], void *client_data) {
+    verify_state_t *st = (verify_state_t*)client_data;
+    unsigned i, ch;
+    for (i = 0; i < frame->header.blocksize; i++, st->pos++) {
+        for (ch = 0; ch < CHANNELS; ch++) {
+            if (st->pos >= input_frames || buffer[ch][i] != input[st->pos * CHANNELS + ch]) {
+                st->mismatch = true;
+                return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+            }
+        }
+    }
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void verify_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+    ((verify_state_t*)client_data)->mismatch = true;
+}
+
+static bool verify(const char *path) {
+    verify_state_t st = {0,};
+    FLAC__StreamDecoder *dec = FLAC__stream_decoder_new();
+    if (FLAC__stream_decoder_init_file(dec, path, verify_write, NULL, verify_error, &st) != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+        FLAC__stream_decoder_delete(dec);
+        return false;
+    }
+    while (!st.mismatch && FLAC__stream_decoder_get_state(dec) != FLAC__STREAM_DECODER_END_OF_STREAM) {
+        if (!FLAC__stream_decoder_process_single(dec)) break;
+    }
+    FLAC__stream_decoder_finish(dec);
+    FLAC__stream_decoder_delete(dec);
+    return !st.mismatch && st.pos == input_frames;
+}
+
+static long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+// threads == 0 means a plain single threaded libflac encoder, for reference
+static void run_one(int threads, int level) {
+    long long start = now_us();
+    unsigned done;
+    bool ok = true;
+    if (threads == 0) {
+        FILE *file = fopen(OUT_FILENAME, "wb");
+        if (file == NULL) perrorf("fopen", "couldn't open " OUT_FILENAME);
+        FLAC__StreamEncoder *enc = FLAC__stream_encoder_new();
+        FLAC__stream_encoder_set_channels(enc, CHANNELS);
+        FLAC__stream_encoder_set_bits_per_sample(enc, 16);
+        FLAC__stream_encoder_set_sample_rate(enc, SAMPLE_RATE);
+        FLAC__stream_encoder_set_compression_level(enc, level);
+        if (FLAC__stream_encoder_init_FILE(enc, file, NULL, NULL) != FLAC__STREAM_ENCODER_INIT_STATUS_OK) failf("init failed");
+        for (done = 0; done < input_frames && ok; done += FEED_FRAMES) {
+            unsigned n = input_frames - done < FEED_FRAMES ? input_frames - done : FEED_FRAMES;
+            ok = FLAC__stream_encoder_process_interleaved(enc, input + (size_t)done * CHANNELS, n);
+        }
+        ok = FLAC__stream_encoder_finish(enc) && ok;
+        FLAC__stream_encoder_delete(enc);
+    } else {
+        diskfile_t *file = diskwriter_open(&writer, OUT_FILENAME);
+        if (file == NULL) failf("couldn't open " OUT_FILENAME);
+        flacpar_t *par = flacpar_new(CHANNELS, SAMPLE_RATE, level, 4096, NULL, 16);
+        if (!flacpar_init_diskfile(par, file)) failf("init failed");
+        for (done = 0; done < input_frames && ok; done += FEED_FRAMES) {
+            unsigned n = input_frames - done < FEED_FRAMES ? input_frames - done : FEED_FRAMES;
+            ok = flacpar_process_interleaved(par, input + (size_t)done * CHANNELS, n);
+        }
+        ok = flacpar_finish(par) && ok;
+        flacpar_delete(par);
+    }
+    long long elapsed = now_us() - start;
+
+    double    seconds  = (double)input_frames / SAMPLE_RATE;
+    long long size     = file_size(OUT_FILENAME);
+    double    ratio    = (double)size / ((double)input_frames * CHANNELS * 2);
+    bool      verified = ok && verify(OUT_FILENAME);
+
+    printf("%-8s %5d %10.1fx realtime %12lld bytes %6.1f%% %s\n",
+           threads == 0 ? "libflac" : "flacpar", level, seconds / (elapsed / 1e6), size, ratio * 100.0,
+           verified ? "ok" : "FAILED");
+    unlink(OUT_FILENAME);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strstr(argv[1], ".raw") != NULL) {
+        load_raw(argv[1]);
+    } else {
+        load_synthetic(argc > 1 ? atof(argv[1]) : 60.0);
+    }
+    diskwriter_init(&writer, 32, 256 * 1024, false);
+    printf("%.1fs of audio, %ld cpus\n", (double)input_frames / SAMPLE_RATE, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %5s %21s %18s %7s\n", "encoder", "level", "speed", "size", "ratio");
+
+    static const int levels[]  = { 0, 5, 8 };
+    static const int threads[] = { 1, 2, 4 };
+    int l, t;
+    for (l = 0; l < 3; l++) run_one(0, levels[l]);
+
+    // the pool only grows, so walk the thread counts upward
+    for (t = 0; t < 3; t++) {
+        flacpar_pool_init(threads[t] - flacpar_pool_threads());
+        printf("-- %d threads\n", flacpar_pool_threads());
+        for (l = 0; l < 3; l++) run_one(threads[t], levels[l]);
+    }
+    return 0;
+}
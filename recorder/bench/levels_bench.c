@@ -0,0 +1,99 @@
+/* compares the per-buffer level analysis that run() used to do with the
+ * levels_t kernels, on FRAMES_PER_BUFFER sized stereo buffers.
+ *
+ * usage: levels_bench [iterations]
+ */
+#include "levels.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define FRAMES_PER_BUFFER (4410)
+#define CHANNELS          (2)
+#define SAMPLE_RATE       (44100)
+#define NSAMPLES          (FRAMES_PER_BUFFER * CHANNELS)
+
+static volatile double sink;
+
+// the loop run() used before the levels kernel: widen to int32, then double math
+static void analyze_legacy(const short *rawsamples, int *samples, double *rms, int *clip) {
+    int i;
+    for (i = 0; i < NSAMPLES; i++) {
+        samples[i] = rawsamples[i];
+    }
+    double accum = 0;
+    int frame, ch;
+    *clip = 0;
+    for (frame = 0; frame < FRAMES_PER_BUFFER; frame++) {
+        for (ch = 0; ch < CHANNELS; ch++) {
+            double sample = (double)samples[frame*CHANNELS + ch] / 32768.0;
+            accum += sample*sample;
+            if (sample > 0.99) (*clip)++;
+        }
+    }
+    *rms = sqrt(accum / NSAMPLES);
+}
+
+static void report(const char *name, long long elapsed_us, int iterations) {
+    double per_buf_us = (double)elapsed_us / iterations;
+    double realtime   = (1e6 * FRAMES_PER_BUFFER / SAMPLE_RATE) / per_buf_us;
+    printf("%-10s %9.2f us/buffer %12.0fx realtime\n", name, per_buf_us, realtime);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+
+    short *raw     = malloc(sizeof(short) * NSAMPLES);
+    int   *samples = malloc(sizeof(int) * NSAMPLES);
+    int i;
+    srand(1);
+    for (i = 0; i < NSAMPLES; i++) {
+        raw[i] = (short)(sin(i * 0.001) * 30000.0 + (rand() % 8192) - 4096);
+    }
+    raw[10] = 32767; raw[11] = -32768; raw[12] = -32767;
+
+    // check the kernels against each other before timing them
+    levels_t ref, fast;
+    levels_reset(&ref, CHANNELS);
+    levels_reset(&fast, CHANNELS);
+    levels_accumulate_scalar(&ref, raw, NSAMPLES);
+    levels_accumulate(&fast, raw, NSAMPLES);
+    if (memcmp(&ref, &fast, sizeof(ref)) != 0) {
+        failf("%s kernel disagrees with scalar: sum %lld/%lld clip +%d-%d/+%d-%d peak %d,%d/%d,%d",
+              levels_impl_name(), fast.sum_squares, ref.sum_squares, fast.clip_pos, fast.clip_neg,
+              ref.clip_pos, ref.clip_neg, fast.peak[0], fast.peak[1], ref.peak[0], ref.peak[1]);
+    }
+    double legacy_rms;
+    int    legacy_clip;
+    analyze_legacy(raw, samples, &legacy_rms, &legacy_clip);
+    printf("rms legacy=%f levels=%f; clips legacy=%d (positive only) levels=+%d/-%d\n",
+           legacy_rms, levels_rms(&fast), legacy_clip, fast.clip_pos, fast.clip_neg);
+
+    long long start = now_us();
+    for (i = 0; i < iterations; i++) {
+        analyze_legacy(raw, samples, &legacy_rms, &legacy_clip);
+        sink += legacy_rms;
+    }
+    report("legacy", now_us() - start, iterations);
+
+    start = now_us();
+    for (i = 0; i < iterations; i++) {
+        levels_reset(&ref, CHANNELS);
+        levels_accumulate_scalar(&ref, raw, NSAMPLES);
+        sink += levels_rms(&ref);
+    }
+    report("scalar", now_us() - start, iterations);
+
+    start = now_us();
+    for (i = 0; i < iterations; i++) {
+        levels_reset(&fast, CHANNELS);
+        levels_accumulate(&fast, raw, NSAMPLES);
+        sink += levels_rms(&fast);
+    }
+    report(levels_impl_name(), now_us() - start, iterations);
+
+    return 0;
+}
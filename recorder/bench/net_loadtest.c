@@ -0,0 +1,206 @@
+/* opens hundreds of status clients against a running recorder and measures
+ * how long each broadcast takes to reach all of them.
+ *
+ * usage: net_loadtest [-n clients] [-s seconds] [-S] [host] [port]
+ *
+ * every client reads the level updates the recorder sends each buffer. an
+ * update's fan-out latency for a client is how long after the first client
+ * it arrived there, so the tail shows what the last client in line waits.
+ * a client that reads them in a different order than the first is counted
+ * as out of step instead.
+ * with -S the clients "subscribe 0 level" instead of taking the legacy
+ * per-field lines. (a slower subscription rate is timed per client, so
+ * their frames wouldn't line up.) the recorder has to be producing levels, e.g.
+ *     recordthepiano -i session.wav
+ */
+#include "histo.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS      (256)
+#define SETTLE_US       (500000)    // lets updates from while clients were connecting drain
+
+typedef struct {
+    int     sock;
+    char    line[256];
+    int     line_len;
+    int     seq;            // updates had since measuring started
+    int     mismatched;
+} client_t;
+
+// every client gets the same updates in the same order, so the n'th one a
+// client reads is matched up with the n'th one any client read
+typedef struct {
+    char        text[256];
+    long long   first_us;
+} update_t;
+
+static update_t *updates;
+static int       nupdates;
+static int       updates_cap;
+static bool      measuring;
+static histo_t   fanout;
+
+static void got_update(client_t *c, const char *text) {
+    long long now = now_us();
+    int seq = c->seq++;
+    if (seq == nupdates) {
+        if (nupdates == updates_cap) {
+            updates_cap = updates_cap > 0 ? updates_cap * 2 : 256;
+            updates = realloc(updates, sizeof(update_t) * updates_cap);
+            if (updates == NULL) failf("out of memory");
+        }
+        snprintf(updates[seq].text, sizeof(updates[seq].text), "%s", text);
+        updates[seq].first_us = now;
+        nupdates++;
+        histo_record(&fanout, 0);
+    } else if (strcmp(updates[seq].text, text) == 0) {
+        histo_record(&fanout, now - updates[seq].first_us);
+    } else {
+        // this client missed one or got an extra one in flight at the start
+        c->mismatched++;
+    }
+}
+
+static void got_line(client_t *c, char *line, bool subscribed) {
+    const char *prefix = subscribed ? "status level " : "level ";
+    if (measuring && strncmp(line, prefix, strlen(prefix)) == 0) got_update(c, line);
+}
+
+// returns false once the server has closed the connection
+static bool read_client(client_t *c, bool subscribed) {
+    for (;;) {
+        char buf[4096];
+        int n = recv(c->sock, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (n <= 0) return false;
+        int i;
+        for (i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                c->line[c->line_len] = 0;
+                got_line(c, c->line, subscribed);
+                c->line_len = 0;
+            } else if (c->line_len < (int)sizeof(c->line) - 1) {
+                c->line[c->line_len++] = buf[i];
+            }
+        }
+    }
+}
+
+// reads whatever arrives until the deadline
+static void pump(int epollfd, long long end, bool subscribed, int *open) {
+    long long now;
+    while (*open > 0 && (now = now_us()) < end) {
+        struct epoll_event events[MAX_EVENTS];
+        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, (int)((end - now) / 1000) + 1);
+        if (nfds == -1 && errno != EINTR) perrorf("epoll_wait", "failed to epoll_wait");
+        int n;
+        for (n = 0; n < nfds; n++) {
+            client_t *c = (client_t*)events[n].data.ptr;
+            if (c->sock >= 0 && !read_client(c, subscribed)) {
+                close(c->sock);
+                c->sock = -1;
+                (*open)--;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int         nclients = 500;
+    double      seconds  = 10.0;
+    bool        subscribed = false;
+    const char *host     = "127.0.0.1";
+    int         port     = 10123;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:S")) != -1) {
+        switch (opt) {
+            case 'n': nclients = atoi(optarg); break;
+            case 's': seconds  = atof(optarg); break;
+            case 'S': subscribed = true;   break;
+            default:
+                fprintf(stderr, "usage: %s [-n clients] [-s seconds] [-S] [host] [port]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) host = argv[optind++];
+    if (optind < argc) port = atoi(argv[optind++]);
+
+    // a few hundred sockets is past the usual soft limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nclients + 16) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)nclients + 16 ? rl.rlim_max : (rlim_t)nclients + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    histo_init(&fanout, "fanout");
+    histo_t connect_latency;
+    histo_init(&connect_latency, "connect");
+
+    struct sockaddr_in addr = {0,};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons((short)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) failf("bad address %s", host);
+
+    int epollfd = epoll_create(10);
+    if (epollfd == -1) perrorf("epoll_create", "failed to epoll_create");
+
+    client_t *clients = calloc(nclients, sizeof(client_t));
+    int i, one = 1;
+    const char *subscribe = "subscribe 0 level\n";
+    for (i = 0; i < nclients; i++) {
+        client_t *c = &clients[i];
+        long long start = now_us();
+        c->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (c->sock < 0) perrorf("socket", "failed to open client %d", i);
+        if (connect(c->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) perrorf("connect", "client %d failed to connect", i);
+        histo_record(&connect_latency, now_us() - start);
+        setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+        if (subscribed && send(c->sock, subscribe, strlen(subscribe), 0) != (int)strlen(subscribe)) {
+            perrorf("send", "client %d failed to subscribe", i);
+        }
+        if (0 != ioctl(c->sock, FIONBIO, (void*)&one)) perrorf("ioctl", "failed to set non-blocking");
+
+        struct epoll_event ev;
+        ev.events   = EPOLLIN | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, c->sock, &ev) == -1) perrorf("epoll_ctl", "epoll_ctl: client");
+    }
+    printf("%d clients connected to %s:%d%s\n", nclients, host, port, subscribed ? " (subscribed)" : "");
+
+    int open = nclients;
+    pump(epollfd, now_us() + SETTLE_US, subscribed, &open);
+    measuring = true;
+    pump(epollfd, now_us() + (long long)(seconds * 1e6), subscribed, &open);
+
+    int least = -1, most = 0, mismatched = 0;
+    for (i = 0; i < nclients; i++) {
+        if (least < 0 || clients[i].seq < least) least = clients[i].seq;
+        if (clients[i].seq > most) most = clients[i].seq;
+        if (clients[i].mismatched > 0) mismatched++;
+    }
+
+    char buf[256];
+    histo_format(&connect_latency, buf, sizeof(buf));
+    printf("%s\n", buf);
+    histo_format(&fanout, buf, sizeof(buf));
+    printf("%s\n", buf);
+    printf("%d updates, %d-%d per client, %d clients out of step, %d of %d clients dropped\n",
+           nupdates, least, most, mismatched, nclients - open, nclients);
+    return 0;
+}
@@ -0,0 +1,275 @@
+/* runs the rms and spectral start/stop detectors over captured sessions and
+ * reports what each would have recorded, how that compares to where the
+ * piano was actually played, and the cpu time each takes per hop.
+ *
+ * usage: onset_bench session.wav|session.flac|session.raw ...
+ *
+ * where the piano was played comes from a label file next to the session,
+ * session.labels for session.wav: one "start end [text]" line per passage,
+ * in seconds, as exported from an audacity label track. without one only
+ * the recordings and cpu are reported. like the recorder, each detector
+ * calibrates on the first BASE_HOPS of the session, which should be quiet.
+ *
+ * per detector:
+ *     hop prec/recall  - of hops the detector found active vs hops inside a label
+ *     covered          - share of labeled time inside a kept recording (preroll included)
+ *     extra            - seconds kept outside any label
+ *     false            - kept recordings that overlap no label
+ *     late             - mean seconds from a passage's start to the recording's start,
+ *                        for passages whose start the preroll didn't cover
+ */
+#include "onset.h"
+#include "levels.h"
+#include "winstats.h"
+#include "noisefloor.h"
+#include "replay.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+// the recorder's tunables, see recorder.c
+#define SAMPLE_RATE         (44100)
+#define CHANNELS            (2)
+#define HOP_FRAMES          (441)
+#define BASE_HOPS           (200)
+#define DETECT_HOPS         (250)
+#define PREROLL_HOPS        (80)        // the recorder queues the last third of its 2.5s preroll...
+#define PREROLL_COUNTED     (250)       // ...but counts all of it toward the minimum length
+#define NOISE_THRESHOLD     (1.3)
+#define SMOOTH_HOPS         (10)
+#define FLOOR_PERCENTILE    (0.5)
+#define FLOOR_RISE_DB       (1.0)
+#define FLOOR_QUIET         (4.0)
+#define FLOOR_PUBLISH_DB    (0.5)
+#define MIN_RECORDING_HOPS  (1500)
+
+#define MAX_SEGMENTS        (1024)
+
+typedef struct {
+    double start, end;
+} segment_t;
+
+typedef struct {
+    const char *name;
+    bool        spectral;
+    onset_t     onset;
+    winstats_t  window;
+    winstats_t  recent_power;
+    noisefloor_t floor;
+    double      base_level;
+    double      base_accum;
+    long long   cpu_us;
+
+    bool        recording;
+    long long   record_start;           // hop
+    segment_t   kept[MAX_SEGMENTS];
+    int         nkept;
+    int         ndiscarded;
+
+    long long   active_hops, active_labeled_hops;
+} detector_t;
+
+static segment_t labels[MAX_SEGMENTS];
+static int       nlabels;
+
+static void load_labels(const char *session) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s", session);
+    char *dot   = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    if (dot != NULL && (slash == NULL || dot > slash)) *dot = 0;
+    strncat(path, ".labels", sizeof(path) - strlen(path) - 1);
+
+    nlabels = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+    char line[256];
+    while (nlabels < MAX_SEGMENTS && fgets(line, sizeof(line), f) != NULL) {
+        segment_t s;
+        if (sscanf(line, "%lf %lf", &s.start, &s.end) == 2 && s.end > s.start) labels[nlabels++] = s;
+    }
+    fclose(f);
+}
+
+static bool labeled(double t) {
+    int i;
+    for (i = 0; i < nlabels; i++) {
+        if (t >= labels[i].start && t < labels[i].end) return true;
+    }
+    return false;
+}
+
+static double overlap(const segment_t *a, const segment_t *b) {
+    double start = a->start > b->start ? a->start : b->start;
+    double end   = a->end   < b->end   ? a->end   : b->end;
+    return end > start ? end - start : 0;
+}
+
+static double hop_seconds(long long hop) {
+    return (double)hop * HOP_FRAMES / SAMPLE_RATE;
+}
+
+static void detector_init(detector_t *d, const char *name, bool spectral) {
+    memset(d, 0, sizeof(*d));
+    d->name     = name;
+    d->spectral = spectral;
+    onset_init(&d->onset, CHANNELS, SAMPLE_RATE, HOP_FRAMES);
+    onset_begin_calibration(&d->onset);
+    winstats_init(&d->window, DETECT_HOPS, 0.0);
+    winstats_init(&d->recent_power, SMOOTH_HOPS, 0.0);
+    noisefloor_init(&d->floor, FLOOR_PERCENTILE, FLOOR_RISE_DB, (double)HOP_FRAMES / SAMPLE_RATE);
+}
+
+static void detector_end_recording(detector_t *d, long long hop) {
+    d->recording = false;
+    if (hop - d->record_start + PREROLL_COUNTED < MIN_RECORDING_HOPS) {
+        d->ndiscarded++;
+    } else if (d->nkept < MAX_SEGMENTS) {
+        long long start = d->record_start > PREROLL_HOPS ? d->record_start - PREROLL_HOPS : 0;
+        d->kept[d->nkept].start = hop_seconds(start);
+        d->kept[d->nkept].end   = hop_seconds(hop);
+        d->nkept++;
+    }
+}
+
+// the recorder's auto mode state machine, minus everything but start + stop
+static void detector_hop(detector_t *d, const short *samples, long long hop) {
+    long long start = thread_cpu_us();
+    levels_t levels;
+    levels_reset(&levels, CHANNELS);
+    levels_accumulate(&levels, samples, HOP_FRAMES * CHANNELS);
+    double rms = levels_rms(&levels);
+    winstats_push(&d->recent_power, rms * rms);
+    double smoothed_rms = sqrt(winstats_mean(&d->recent_power));
+    double activity     = smoothed_rms;
+    if (d->spectral) {
+        onset_process(&d->onset, samples, HOP_FRAMES);
+        activity = onset_active(&d->onset) ? 1.0 : 0.0;
+    }
+
+    if (hop < BASE_HOPS) {
+        d->base_accum += smoothed_rms;
+        d->cpu_us += thread_cpu_us() - start;
+        return;
+    }
+    if (hop == BASE_HOPS) {
+        d->base_level = d->base_accum / BASE_HOPS;
+        noisefloor_reset(&d->floor, d->base_level);
+        if (d->spectral) {
+            onset_end_calibration(&d->onset);
+            winstats_set_threshold(&d->window, 0.5);
+        } else {
+            winstats_set_threshold(&d->window, d->base_level * NOISE_THRESHOLD);
+        }
+    } else if (smoothed_rms < noisefloor_level(&d->floor) * FLOOR_QUIET) {
+        noisefloor_push(&d->floor, smoothed_rms);
+        double level = noisefloor_level(&d->floor);
+        if (fabs(20.0 * log10(level / d->base_level)) >= FLOOR_PUBLISH_DB) {
+            d->base_level = level;
+            if (!d->spectral) winstats_set_threshold(&d->window, level * NOISE_THRESHOLD);
+        }
+        if (d->spectral) onset_follow_floor(&d->onset);
+    }
+    d->cpu_us += thread_cpu_us() - start;
+
+    winstats_push(&d->window, activity);
+    bool active = activity > d->window.threshold;
+    if (active) {
+        d->active_hops++;
+        if (labeled(hop_seconds(hop))) d->active_labeled_hops++;
+    }
+
+    int loud = winstats_loud(&d->window);
+    if (!d->recording && loud > DETECT_HOPS / 4) {
+        d->recording    = true;
+        d->record_start = hop;
+    } else if (d->recording && loud == 0) {
+        detector_end_recording(d, hop);
+    }
+}
+
+static void detector_report(detector_t *d, long long hops, long long labeled_hops) {
+    double secs = hop_seconds(hops);
+    printf("  %-9s %7.1f %6.2f%%", d->name, (double)d->cpu_us / hops, 100.0 * d->cpu_us / (secs * 1e6));
+    if (nlabels > 0) {
+        double labeled_secs = 0, covered = 0, kept_secs = 0, late = 0;
+        int    nfalse = 0, nlate = 0, i, j;
+        for (i = 0; i < nlabels; i++) labeled_secs += labels[i].end - labels[i].start;
+        for (j = 0; j < d->nkept; j++) {
+            double o = 0;
+            for (i = 0; i < nlabels; i++) o += overlap(&d->kept[j], &labels[i]);
+            covered   += o;
+            kept_secs += d->kept[j].end - d->kept[j].start;
+            if (o == 0) nfalse++;
+        }
+        for (i = 0; i < nlabels; i++) {
+            for (j = 0; j < d->nkept; j++) {
+                if (overlap(&d->kept[j], &labels[i]) == 0) continue;
+                if (d->kept[j].start > labels[i].start) {
+                    late += d->kept[j].start - labels[i].start;
+                    nlate++;
+                }
+                break;
+            }
+        }
+        printf(" %8.1f%% %7.1f%% %7.1f%% %7.1fs %6d %7.2fs",
+               d->active_hops > 0 ? 100.0 * d->active_labeled_hops / d->active_hops : 0.0,
+               labeled_hops > 0 ? 100.0 * d->active_labeled_hops / labeled_hops : 0.0,
+               labeled_secs > 0 ? 100.0 * covered / labeled_secs : 0.0,
+               kept_secs - covered, nfalse, nlate > 0 ? late / nlate : 0.0);
+    }
+    printf(" %d kept, %d discarded:", d->nkept, d->ndiscarded);
+    int j;
+    for (j = 0; j < d->nkept; j++) printf(" %.1f-%.1f", d->kept[j].start, d->kept[j].end);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s session.wav|session.flac|session.raw ...\n", argv[0]);
+        return 1;
+    }
+    printf("fft: %s\n", fft_impl_name());
+
+    short *samples = malloc(sizeof(short) * HOP_FRAMES * CHANNELS);
+    int arg;
+    for (arg = 1; arg < argc; arg++) {
+        replay_t replay;
+        if (!replay_open(&replay, argv[arg], CHANNELS, SAMPLE_RATE)) continue;
+        load_labels(argv[arg]);
+
+        detector_t detectors[2];
+        detector_init(&detectors[0], "rms",      false);
+        detector_init(&detectors[1], "spectral", true);
+
+        long long hops = 0, labeled_hops = 0;
+        int d;
+        for (;;) {
+            int got = 0, n;
+            while (got < HOP_FRAMES && (n = replay_read(&replay, samples + got * CHANNELS, HOP_FRAMES - got)) > 0) {
+                got += n;
+            }
+            if (got < HOP_FRAMES) break;
+            for (d = 0; d < 2; d++) detector_hop(&detectors[d], samples, hops);
+            if (hops >= BASE_HOPS && labeled(hop_seconds(hops))) labeled_hops++;
+            hops++;
+        }
+        replay_close(&replay);
+
+        printf("== %s: %.1fs, %d labeled passages\n", argv[arg], hop_seconds(hops), nlabels);
+        printf("  detector   us/hop    cpu%s\n", nlabels > 0 ?
+               "  hop prec  recall covered   extra  false    late" : "");
+        for (d = 0; d < 2; d++) {
+            if (detectors[d].recording) detector_end_recording(&detectors[d], hops);
+            detector_report(&detectors[d], hops, labeled_hops);
+            onset_destroy(&detectors[d].onset);
+            winstats_destroy(&detectors[d].window);
+            winstats_destroy(&detectors[d].recent_power);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# replays captured sessions through detection, the state machine and the
+# encoder as fast as possible, and reports speed, per-stage cpu time and the
+# start/stop decisions made for each.
+#
+# usage: pipeline_bench.sh [-p profile] session.wav|session.flac|session.raw ...
+
+BIN=$(cd "$(dirname "$0")/.." && pwd)/recordthepiano
+
+PROFILE=auto
+if [ "$1" = "-p" ]; then
+    PROFILE=$2
+    shift 2
+fi
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-p profile] session.wav|session.flac|session.raw ..." >&2
+    exit 1
+fi
+
+for session in "$@"; do
+    case "$session" in
+        /*) path=$session ;;
+        *)  path=$(pwd)/$session ;;
+    esac
+
+    # recordings land in the working directory, so give each run its own
+    dir=$(mktemp -d)
+    echo "== $session"
+    (cd "$dir" && "$BIN" -f -p "$PROFILE" -i "$path" 2> log.txt)
+    grep -E "start recording|stop recording|discarding|end of input" "$dir/log.txt" | sed 's/^\[recordthepiano\] /  /'
+    rm -rf "$dir"
+done
@@ -0,0 +1,298 @@
+#include "capture.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// a slot is this header, then a levels_t per hop, then the samples
+typedef struct {
+    bool                overflowed;     // audio was lost right before this buffer
+    long long           captured_us;    // when the last frame came in
+} capture_slot_t;
+
+static levels_t *slot_hops(capture_slot_t *slot) {
+    return (levels_t*)(slot + 1);
+}
+
+static short *slot_samples(const capture_t *self, capture_slot_t *slot) {
+    return (short*)(slot_hops(slot) + self->hops_per_buffer);
+}
+
+const char *capture_mode_to_str(capture_mode_t mode) {
+    switch (mode) {
+        case CAPTURE_MODE_BLOCKING: return "blocking";
+        case CAPTURE_MODE_CALLBACK: return "callback";
+        case CAPTURE_MODE_REPLAY:   return "replay";
+        default:                    return "unknown";
+    }
+}
+
+// runs on portaudio's audio thread: no locks, no allocation, no syscalls
+// other than sem_post. (now_us is answered from the vdso.)
+static int capture_callback(const void *input, void *output, unsigned long frame_count,
+                            const PaStreamCallbackTimeInfo *time_info,
+                            PaStreamCallbackFlags status_flags, void *userdata) {
+    capture_t   *self = (capture_t*)userdata;
+    const short *in   = (const short*)input;
+    int          left = (int)frame_count;
+
+    if (status_flags & paInputOverflow) self->overflow_pending = true;
+
+    while (left > 0) {
+        capture_slot_t *slot = (capture_slot_t*)ringbuf_write_begin(&self->ring);
+        if (slot == NULL) {
+            // reader is too far behind. drop this audio rather than wait.
+            self->overflow_pending = true;
+            break;
+        }
+
+        if (self->fill == 0) {
+            slot->overflowed         = self->overflow_pending;
+            self->overflow_pending   = false;
+        }
+
+        // stop at the end of each hop to hand it over
+        int hop = self->fill / self->hop_frames;
+        int n   = (hop + 1) * self->hop_frames - self->fill;
+        if (n > left) n = left;
+        levels_t *levels = &slot_hops(slot)[hop];
+        if (self->fill % self->hop_frames == 0) levels_reset(levels, self->channels);
+
+        int nsamples = n * self->channels;
+        short *dst = slot_samples(self, slot) + self->fill * self->channels;
+        if (in != NULL) {
+            memcpy(dst, in, sizeof(short) * nsamples);
+            levels_accumulate(levels, dst, nsamples);
+            in += nsamples;
+        } else {
+            memset(dst, 0, sizeof(short) * nsamples);
+            levels->nsamples += nsamples;
+        }
+
+        self->fill += n;
+        left       -= n;
+
+        if (self->fill % self->hop_frames != 0) continue;
+        if (self->fill == self->frames_per_buffer) {
+            self->fill        = 0;
+            slot->captured_us = now_us();
+            ringbuf_write_end(&self->ring);
+        }
+        __atomic_store_n(&self->hops_written, self->hops_written + 1, __ATOMIC_RELEASE);
+        sem_post(&self->ready);
+    }
+
+    return paContinue;
+}
+
+static void capture_init(capture_t *self, capture_mode_t mode, int channels, int sample_rate,
+                         int frames_per_buffer, int hop_frames) {
+    if (hop_frames <= 0 || frames_per_buffer % hop_frames != 0) {
+        failf("analysis hop of %d frames doesn't divide the %d frame buffer", hop_frames, frames_per_buffer);
+    }
+    memset(self, 0, sizeof(*self));
+    self->mode              = mode;
+    self->channels          = channels;
+    self->sample_rate       = sample_rate;
+    self->frames_per_buffer = frames_per_buffer;
+    self->hop_frames        = hop_frames;
+    self->hops_per_buffer   = frames_per_buffer / hop_frames;
+    if (mode != CAPTURE_MODE_CALLBACK) {
+        self->buf        = malloc(sizeof(short) * frames_per_buffer * channels);
+        self->hop_levels = malloc(sizeof(levels_t) * self->hops_per_buffer);
+        if (self->buf == NULL || self->hop_levels == NULL) failf("couldn't allocate capture buffer");
+    }
+}
+
+// what capture_init and capture_open allocated
+static void capture_free(capture_t *self) {
+    if (self->mode == CAPTURE_MODE_CALLBACK) {
+        ringbuf_destroy(&self->ring);
+        sem_destroy(&self->ready);
+    }
+    free(self->buf);
+    free(self->hop_levels);
+}
+
+int capture_open(capture_t *self, int device, capture_mode_t mode,
+                 int channels, int sample_rate, int frames_per_buffer,
+                 int hop_frames, int callback_frames, int nslots) {
+    capture_init(self, mode, channels, sample_rate, frames_per_buffer, hop_frames);
+
+    PaStreamParameters input_params  = {0,};
+    input_params.device                    = device;
+    input_params.channelCount              = channels;
+    input_params.sampleFormat              = paInt16;
+    input_params.hostApiSpecificStreamInfo = NULL;
+
+    int err;
+    if (mode == CAPTURE_MODE_CALLBACK) {
+        int slot_size = sizeof(capture_slot_t) + sizeof(levels_t) * self->hops_per_buffer +
+                        sizeof(short) * frames_per_buffer * channels;
+        ringbuf_init(&self->ring, (slot_size + 7) & ~7, nslots);     // keep the next slot's levels aligned
+        sem_init(&self->ready, 0, 0);
+        input_params.suggestedLatency = Pa_GetDeviceInfo(device)->defaultLowInputLatency;
+        err = Pa_OpenStream(&self->stream,
+                            &input_params,
+                            NULL,
+                            sample_rate,
+                            callback_frames > 0 ? callback_frames : paFramesPerBufferUnspecified,
+                            paNoFlag,
+                            capture_callback, self);
+    } else {
+        input_params.suggestedLatency = Pa_GetDeviceInfo(device)->defaultHighInputLatency;
+        err = Pa_OpenStream(&self->stream,
+                            &input_params,
+                            NULL,
+                            sample_rate,
+                            frames_per_buffer,
+                            paNoFlag,
+                            NULL, NULL);
+    }
+    if (err != paNoError) {
+        tracef("error initializing %s stream: %s", capture_mode_to_str(mode), Pa_GetErrorText(err));
+        capture_free(self);
+        return err;
+    }
+
+    err = Pa_StartStream(self->stream);
+    if (err != paNoError) {
+        tracef("error starting %s stream: %s", capture_mode_to_str(mode), Pa_GetErrorText(err));
+        Pa_CloseStream(self->stream);
+        capture_free(self);
+        return err;
+    }
+
+    tracef("capturing in %s mode", capture_mode_to_str(mode));
+    return paNoError;
+}
+
+int capture_open_replay(capture_t *self, const char *path, bool paced,
+                        int channels, int sample_rate, int frames_per_buffer, int hop_frames) {
+    capture_init(self, CAPTURE_MODE_REPLAY, channels, sample_rate, frames_per_buffer, hop_frames);
+    self->paced = paced;
+
+    if (!replay_open(&self->replay, path, channels, sample_rate)) {
+        return paInvalidDevice;
+    }
+    self->replay_start_us = now_us();
+
+    tracef("replaying %s %s", path, paced ? "in real time" : "as fast as possible");
+    return paNoError;
+}
+
+void capture_close(capture_t *self) {
+    if (self->mode == CAPTURE_MODE_REPLAY) {
+        replay_close(&self->replay);
+    } else {
+        Pa_StopStream(self->stream);
+        Pa_CloseStream(self->stream);
+    }
+    capture_free(self);
+}
+
+// blocking + replay: meters a whole buffer into hops once it has been read
+static void capture_meter_hops(capture_t *self) {
+    int hop;
+    for (hop = 0; hop < self->hops_per_buffer; hop++) {
+        levels_reset(&self->hop_levels[hop], self->channels);
+        levels_accumulate(&self->hop_levels[hop], self->buf + hop * self->hop_frames * self->channels,
+                          self->hop_frames * self->channels);
+    }
+}
+
+static int capture_read_replay(capture_t *self) {
+    int n = replay_read(&self->replay, self->buf, self->frames_per_buffer);
+    if (n == 0) return CAPTURE_END_OF_INPUT;
+
+    // the loop only deals in whole buffers, so pad the last one with silence
+    if (n < self->frames_per_buffer) {
+        memset(self->buf + n * self->channels, 0, sizeof(short) * (self->frames_per_buffer - n) * self->channels);
+    }
+
+    if (self->paced) {
+        long long due = self->replay_start_us + self->replay_frames * 1000000LL / self->sample_rate;
+        long long now = now_us();
+        if (due > now) usleep(due - now);
+    }
+    self->replay_frames += self->frames_per_buffer;
+    self->captured_us    = now_us();
+    return paNoError;
+}
+
+// callback: the hop the reader is up to is in the slot at the ring's tail,
+// whether or not the callback has finished the rest of that slot
+static int capture_read_hop_callback(capture_t *self, const short **samples, levels_t *levels) {
+    while (__atomic_load_n(&self->hops_written, __ATOMIC_ACQUIRE) == self->hops_read) {
+        while (sem_wait(&self->ready) == -1 && errno == EINTR)
+            ;
+    }
+
+    capture_slot_t *slot = (capture_slot_t*)ringbuf_read_peek(&self->ring);
+    if (self->hop == 0 && slot->overflowed && !self->overflow_reported) {
+        self->overflow_reported = true;
+        return paInputOverflowed;
+    }
+
+    *levels  = slot_hops(slot)[self->hop];
+    *samples = slot_samples(self, slot) + self->hop * self->hop_frames * self->channels;
+    self->hops_read++;
+    self->hop++;
+    return paNoError;
+}
+
+int capture_read_hop(capture_t *self, const short **samples, levels_t *levels) {
+    if (self->mode == CAPTURE_MODE_CALLBACK) return capture_read_hop_callback(self, samples, levels);
+
+    if (self->hop == 0) {
+        int err;
+        if (self->mode == CAPTURE_MODE_REPLAY) {
+            err = capture_read_replay(self);
+        } else {
+            err = Pa_ReadStream(self->stream, self->buf, self->frames_per_buffer);
+            self->captured_us = now_us();
+        }
+        if (err != paNoError) return err;
+        capture_meter_hops(self);
+    }
+
+    *levels  = self->hop_levels[self->hop];
+    *samples = self->buf + self->hop * self->hop_frames * self->channels;
+    self->hop++;
+    return paNoError;
+}
+
+void capture_read_begin(capture_t *self, const short **samples, levels_t *levels) {
+    if (self->hop != self->hops_per_buffer) {
+        failf("capture_read_begin after %d of %d hops", self->hop, self->hops_per_buffer);
+    }
+
+    const levels_t *hops = self->hop_levels;
+    if (self->mode == CAPTURE_MODE_CALLBACK) {
+        // every hop is in, so the callback has finished the slot
+        capture_slot_t *slot = (capture_slot_t*)ringbuf_read_begin(&self->ring);
+        hops              = slot_hops(slot);
+        *samples          = slot_samples(self, slot);
+        self->captured_us = slot->captured_us;
+    } else {
+        *samples = self->buf;
+    }
+
+    levels_reset(levels, self->channels);
+    int hop;
+    for (hop = 0; hop < self->hops_per_buffer; hop++) levels_merge(levels, &hops[hop]);
+}
+
+void capture_read_end(capture_t *self) {
+    self->hop = 0;
+    if (self->mode == CAPTURE_MODE_CALLBACK) {
+        self->overflow_reported = false;
+        ringbuf_read_end(&self->ring);
+    }
+}
+
+int capture_hops_per_buffer(const capture_t *self) {
+    return self->hops_per_buffer;
+}
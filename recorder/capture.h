@@ -0,0 +1,104 @@
+#ifndef INCLUDED_CAPTURE_H
+#define INCLUDED_CAPTURE_H
+
+#include <stdbool.h>
+#include <semaphore.h>
+
+#include <portaudio.h>
+
+#include "ringbuf.h"
+#include "levels.h"
+#include "replay.h"
+
+typedef struct capture capture_t;
+
+typedef enum {
+    CAPTURE_MODE_BLOCKING,      // Pa_ReadStream on the calling thread
+    CAPTURE_MODE_CALLBACK,      // portaudio callback feeding a lock-free ring
+    CAPTURE_MODE_REPLAY,        // a captured session read back from a file
+} capture_mode_t;
+
+// not a portaudio error: capture_read_begin's answer when a replay runs out
+#define CAPTURE_END_OF_INPUT (1)
+
+const char *capture_mode_to_str(capture_mode_t mode);
+
+/* opens + starts a 16 bit input stream on device.
+ *
+ * audio is read a buffer of frames_per_buffer at a time, and each buffer is
+ * metered in hops of hop_frames, which must divide it. in callback mode
+ * portaudio delivers callback_frames at a time (or whatever the host picks
+ * if that is 0), and the callback only copies them into frames_per_buffer
+ * sized slots, meters each hop as it completes and queues them. nslots is
+ * the number of slots the reader may fall behind before audio is dropped.
+ *
+ * returns paNoError or a portaudio error code.
+ */
+int capture_open(capture_t *self, int device, capture_mode_t mode,
+                 int channels, int sample_rate, int frames_per_buffer,
+                 int hop_frames, int callback_frames, int nslots);
+
+/* reads a session from path (see replay_open) instead of a device. paced
+ * replay delivers buffers at the rate the device would; otherwise they come
+ * as fast as the reader takes them. returns paNoError or paInvalidDevice if
+ * the file can't be used.
+ */
+int capture_open_replay(capture_t *self, const char *path, bool paced,
+                        int channels, int sample_rate, int frames_per_buffer, int hop_frames);
+
+void capture_close(capture_t *self);
+
+/* waits for the next hop of the buffer being read and returns its samples
+ * and levels, valid until capture_read_end. in callback mode each hop comes
+ * as soon as the device has delivered it, so analysis needn't wait for the
+ * whole buffer; otherwise the first hop waits for the buffer and the rest
+ * follow at once.
+ *
+ * returns paNoError, paInputOverflowed if audio was lost since the last
+ * buffer (call again to get the next hop), CAPTURE_END_OF_INPUT at the end
+ * of a replay, or another portaudio error.
+ */
+int  capture_read_hop(capture_t *self, const short **samples, levels_t *levels);
+
+/* once every hop of the buffer has been read, returns the whole buffer and
+ * its levels, valid until capture_read_end. captured_us says when its last
+ * frame came in.
+ */
+void capture_read_begin(capture_t *self, const short **samples, levels_t *levels);
+void capture_read_end(capture_t *self);
+
+int  capture_hops_per_buffer(const capture_t *self);
+
+struct capture
+{
+    capture_mode_t  mode;
+    PaStream       *stream;
+    int             channels;
+    int             sample_rate;
+    int             frames_per_buffer;
+    int             hop_frames;
+    int             hops_per_buffer;
+    long long       captured_us;        // when the last frame of the buffer being read came in
+    int             hop;                // reader: hops of the current buffer already read
+
+    // blocking + replay mode
+    short          *buf;
+    levels_t       *hop_levels;
+
+    // replay mode
+    replay_t        replay;
+    bool            paced;
+    long long       replay_start_us;
+    long long       replay_frames;      // frames delivered so far
+
+    // callback mode
+    ringbuf_t       ring;
+    sem_t           ready;
+    int             fill;               // callback: frames already in the slot being written
+    bool            overflow_pending;   // callback: audio was lost, flag the next slot
+    bool            overflow_reported;  // reader: already returned paInputOverflowed for this slot
+    unsigned        hops_written;       // callback: hops finished, ever. the reader follows it into the open slot
+    unsigned        hops_read;          // reader
+};
+
+#endif
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include "catalog.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t catalog_bytes(int capacity) {
+    return sizeof(catalog_header_t) + (size_t)capacity * sizeof(catalog_entry_t);
+}
+
+// maps (or remaps) the file as holding capacity entries
+static bool catalog_map(catalog_t *self, int capacity) {
+    size_t len = catalog_bytes(capacity);
+    void  *map = self->header == NULL ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0)
+                                      : mremap(self->header, catalog_bytes(self->capacity), len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        tracef("couldn't map catalog %s: %s", self->path, strerror(errno));
+        return false;
+    }
+    self->header   = (catalog_header_t*)map;
+    self->entries  = (catalog_entry_t*)(self->header + 1);
+    self->capacity = capacity;
+    return true;
+}
+
+static bool catalog_grow(catalog_t *self) {
+    int capacity = self->capacity + CATALOG_GROW_ENTRIES;
+    if (ftruncate(self->fd, catalog_bytes(capacity)) != 0) {
+        tracef("couldn't grow catalog %s: %s", self->path, strerror(errno));
+        return false;
+    }
+    return catalog_map(self, capacity);
+}
+
+static bool catalog_valid(catalog_t *self) {
+    catalog_header_t *h = self->header;
+    return memcmp(h->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) == 0 && h->entry_bytes == sizeof(catalog_entry_t) &&
+           h->count <= (uint32_t)self->capacity;
+}
+
+void catalog_init(catalog_t *self, const char *path) {
+    memset(self, 0, sizeof(*self));
+    snprintf(self->path, sizeof(self->path), "%s", path);
+    pthread_mutex_init(&self->lock, NULL);
+
+    self->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (self->fd < 0 || fstat(self->fd, &st) != 0) {
+        tracef("couldn't open catalog %s: %s. takes won't be cataloged", path, strerror(errno));
+        return;
+    }
+
+    if (st.st_size == 0) {
+        if (!catalog_grow(self)) return;
+        memcpy(self->header->magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+        self->header->entry_bytes = sizeof(catalog_entry_t);
+    } else {
+        int capacity = st.st_size >= (off_t)sizeof(catalog_header_t)
+                     ? (st.st_size - sizeof(catalog_header_t)) / sizeof(catalog_entry_t) : 0;
+        if (capacity == 0 || !catalog_map(self, capacity) || !catalog_valid(self)) {
+            // keep it for whoever wants to look, and start over
+            char bad[sizeof(self->path) + 8];
+            snprintf(bad, sizeof(bad), "%s.bad", path);
+            tracef("%s isn't a catalog this recorder can read, moving it to %s", path, bad);
+            if (self->header != NULL) munmap(self->header, catalog_bytes(self->capacity));
+            close(self->fd);
+            if (rename(path, bad) != 0) {
+                tracef("couldn't move %s aside: %s. takes won't be cataloged", path, strerror(errno));
+                memset(self, 0, sizeof(*self));
+                return;
+            }
+            catalog_init(self, path);
+            return;
+        }
+        // a power cut can write back the count without the entries it covers
+        while (self->header->count > 0 && self->entries[self->header->count - 1].name[0] == '\0') {
+            self->header->count--;
+        }
+    }
+    tracef("catalog has %d takes", (int)self->header->count);
+}
+
+int catalog_add(catalog_t *self, const catalog_entry_t *entry) {
+    int id = -1;
+    pthread_mutex_lock(&self->lock);
+    if (self->header != NULL && ((int)self->header->count < self->capacity || catalog_grow(self))) {
+        id = self->header->count;
+        self->entries[id] = *entry;
+        self->entries[id].name[CATALOG_MAX_NAME - 1]           = '\0';
+        self->entries[id].permalink[CATALOG_MAX_PERMALINK - 1] = '\0';
+        self->header->count = id + 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return id;
+}
+
+// called with self->lock held
+static int catalog_find_locked(catalog_t *self, const char *name) {
+    if (self->header == NULL) return -1;
+    int id;
+    for (id = (int)self->header->count - 1; id >= 0; id--) {
+        if (strncmp(self->entries[id].name, name, CATALOG_MAX_NAME) == 0) return id;
+    }
+    return -1;
+}
+
+int catalog_find(catalog_t *self, const char *name) {
+    pthread_mutex_lock(&self->lock);
+    int id = catalog_find_locked(self, name);
+    pthread_mutex_unlock(&self->lock);
+    return id;
+}
+
+void catalog_uploaded(catalog_t *self, const char *name, bool ok, const char *permalink) {
+    pthread_mutex_lock(&self->lock);
+    int id = catalog_find_locked(self, name);
+    if (id >= 0) {
+        catalog_entry_t *e = &self->entries[id];
+        if (ok) {
+            e->upload = CATALOG_UPLOAD_DONE;
+            snprintf(e->permalink, sizeof(e->permalink), "%s", permalink != NULL ? permalink : "");
+        } else {
+            e->upload_failures++;
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+int catalog_count(catalog_t *self) {
+    pthread_mutex_lock(&self->lock);
+    int n = self->header != NULL ? (int)self->header->count : 0;
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+bool catalog_get(catalog_t *self, int id, catalog_entry_t *entry) {
+    pthread_mutex_lock(&self->lock);
+    bool ok = self->header != NULL && id >= 0 && id < (int)self->header->count;
+    if (ok) *entry = self->entries[id];
+    pthread_mutex_unlock(&self->lock);
+    return ok;
+}
+
+const char *catalog_upload_to_str(catalog_upload_t upload) {
+    switch (upload) {
+        case CATALOG_UPLOAD_PENDING: return "pending";
+        case CATALOG_UPLOAD_DONE:    return "done";
+        default:                     return "unknown";
+    }
+}
+
+void catalog_format(const catalog_entry_t *entry, bool detail, char *buf, int len) {
+    double duration = entry->sample_rate > 0 ? (double)entry->frames / entry->sample_rate : 0.0;
+    char levels[128];
+    if (entry->flags & CATALOG_FLAG_RECOVERED) {
+        snprintf(levels, sizeof(levels), "peak - rms - loudness - clip -");
+    } else {
+        snprintf(levels, sizeof(levels), "peak %f rms %f loudness %.1f clip %d", entry->peak, entry->rms,
+                 entry->loudness, entry->clipped);
+    }
+    int off = snprintf(buf, len, "%.*s start %lld duration %.2f %s upload %s", CATALOG_MAX_NAME, entry->name,
+                       (long long)entry->start, duration, levels, catalog_upload_to_str(entry->upload));
+    if (detail && off < len) {
+        snprintf(buf + off, len - off, " failures %d recovered %d permalink %.*s", entry->upload_failures,
+                 (entry->flags & CATALOG_FLAG_RECOVERED) != 0, CATALOG_MAX_PERMALINK,
+                 entry->permalink[0] != '\0' ? entry->permalink : "-");
+    }
+}
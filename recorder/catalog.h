@@ -0,0 +1,101 @@
+#ifndef INCLUDED_CATALOG_H
+#define INCLUDED_CATALOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef struct catalog catalog_t;
+
+typedef enum {
+    CATALOG_UPLOAD_PENDING,
+    CATALOG_UPLOAD_DONE,
+} catalog_upload_t;
+
+#define CATALOG_FLAG_RECOVERED  (1 << 0)    // saved from a crash; the levels weren't measured
+
+#define CATALOG_MAX_NAME        (64)
+#define CATALOG_MAX_PERMALINK   (128)
+
+/* one take, exactly as it is on disk (CATALOG_ENTRY_BYTES, native endian) */
+typedef struct {
+    char        name[CATALOG_MAX_NAME];             // the recording's filename
+    char        permalink[CATALOG_MAX_PERMALINK];   // where it was uploaded to, once it has been
+    int64_t     start;                              // unix seconds
+    int64_t     frames;
+    int32_t     sample_rate;
+    int32_t     clipped;                            // samples
+    float       peak;                               // [0,1]
+    float       rms;                                // [0,1]
+    float       loudness;                           // LUFS
+    uint16_t    upload;                             // catalog_upload_t
+    uint16_t    upload_failures;
+    uint32_t    flags;
+    uint8_t     reserved[20];
+} catalog_entry_t;
+
+/* what's known about every take the recorder has kept, long after the file
+ * itself has been uploaded and deleted.
+ *
+ * the catalog is a header and then fixed size entries, oldest first, in a
+ * file that's memory mapped. a take is appended once, when it's finalized;
+ * after that only its upload state changes, in place. an entry's id is its
+ * index, so any page of the list is a slice of the map: listing and
+ * looking up takes never touches the recordings or the directory.
+ *
+ * the file grows CATALOG_GROW_ENTRIES at a time. entries only count once
+ * the header says so, so a crash mid-append loses that entry and nothing
+ * else. the kernel writes the map back in its own time; a power cut can
+ * lose the last few minutes of changes.
+ *
+ * safe to call from any thread.
+ */
+void catalog_init(catalog_t *self, const char *path);
+
+/* appends a take and returns its id, or -1 if it couldn't */
+int catalog_add(catalog_t *self, const catalog_entry_t *entry);
+
+/* records an upload attempt for the take kept as name. permalink may be
+ * NULL or "". takes that aren't in the catalog are ignored.
+ */
+void catalog_uploaded(catalog_t *self, const char *name, bool ok, const char *permalink);
+
+int  catalog_count(catalog_t *self);
+bool catalog_get(catalog_t *self, int id, catalog_entry_t *entry);
+
+/* the id of the take kept as name, or -1. newest first, so recent takes
+ * are found right away.
+ */
+int  catalog_find(catalog_t *self, const char *name);
+
+/* "<name> start <unix> duration <s> peak <p> rms <r> loudness <lufs> clip <n> upload <pending|done>",
+ * and with detail, " failures <n> recovered <0|1> permalink <url|->" too. a recovered take's
+ * levels are "-".
+ */
+void catalog_format(const catalog_entry_t *entry, bool detail, char *buf, int len);
+
+const char *catalog_upload_to_str(catalog_upload_t upload);
+
+#define CATALOG_MAGIC           "rtpcat1"
+#define CATALOG_ENTRY_BYTES     (256)
+#define CATALOG_GROW_ENTRIES    (1024)
+
+typedef struct {
+    char        magic[8];
+    uint32_t    entry_bytes;
+    uint32_t    count;                  // entries that are complete
+    uint8_t     reserved[CATALOG_ENTRY_BYTES - 16];
+} catalog_header_t;
+
+struct catalog
+{
+    char                path[1024];
+    int                 fd;
+    pthread_mutex_t     lock;
+    catalog_header_t   *header;         // the start of the map, NULL if the catalog couldn't be opened
+    catalog_entry_t    *entries;        // right after it
+    int                 capacity;       // entries the file has room for
+};
+
+#endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+
+#include "diskwriter.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// on top of one write per staging buffer: header rewrites, syncs and closes
+#define DISKWRITER_EXTRA_OPS (16)
+
+static void *diskwriter_thread_main(void *arg);
+
+void diskwriter_init(diskwriter_t *self, int nbuffers, int buffer_bytes, bool direct) {
+    memset(self, 0, sizeof(*self));
+    self->buffer_bytes = (buffer_bytes + DISKWRITER_ALIGN - 1) / DISKWRITER_ALIGN * DISKWRITER_ALIGN;
+    self->nbuffers     = nbuffers;
+    self->direct       = direct;
+    histo_init(&self->write_latency, "write");
+    histo_init(&self->queue_latency, "writeq");
+    histo_init(&self->sync_latency,  "checkpoint");
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wakeup, NULL);
+    pthread_cond_init(&self->done, NULL);
+
+    self->free_buffers = malloc(sizeof(uint8_t*) * nbuffers);
+    if (self->free_buffers == NULL) failf("couldn't allocate disk staging");
+    int i;
+    for (i = 0; i < nbuffers; i++) {
+        void *buf = NULL;
+        if (posix_memalign(&buf, DISKWRITER_ALIGN, self->buffer_bytes) != 0) {
+            failf("couldn't allocate %d disk staging buffers of %d bytes", nbuffers, self->buffer_bytes);
+        }
+        self->free_buffers[self->nfree_buffers++] = buf;
+    }
+
+    int nops = nbuffers + DISKWRITER_EXTRA_OPS;
+    self->ops = calloc(nops, sizeof(diskwriter_op_t));
+    if (self->ops == NULL) failf("couldn't allocate disk writer queue");
+    for (i = 0; i < nops; i++) {
+        self->ops[i].next = self->free_ops;
+        self->free_ops    = &self->ops[i];
+    }
+
+    if (pthread_create(&self->thread, NULL, diskwriter_thread_main, self) != 0) {
+        failf("couldn't start disk writer thread");
+    }
+}
+
+int diskwriter_high_water(diskwriter_t *self) {
+    pthread_mutex_lock(&self->lock);
+    int n = self->high_water;
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+int diskwriter_stalls(diskwriter_t *self) {
+    pthread_mutex_lock(&self->lock);
+    int n = self->stalls;
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+// the rest are called with self->lock held. with wait false they return
+// NULL rather than wait for the writer thread to free one.
+static diskwriter_op_t *diskwriter_op_alloc(diskwriter_t *self, bool wait) {
+    while (self->free_ops == NULL) {
+        if (!wait) return NULL;
+        pthread_cond_wait(&self->done, &self->lock);
+    }
+    diskwriter_op_t *op = self->free_ops;
+    self->free_ops = op->next;
+    memset(op, 0, sizeof(*op));
+    return op;
+}
+
+static uint8_t *diskwriter_buffer_alloc(diskwriter_t *self, bool wait) {
+    if (self->nfree_buffers == 0) {
+        if (!wait) return NULL;
+        // the card is so far behind that the encoder has to wait for it
+        self->stalls++;
+        while (self->nfree_buffers == 0) pthread_cond_wait(&self->done, &self->lock);
+    }
+    uint8_t *buf = self->free_buffers[--self->nfree_buffers];
+    int used = self->nbuffers - self->nfree_buffers;
+    if (used > self->high_water) self->high_water = used;
+    return buf;
+}
+
+static void diskwriter_queue(diskwriter_t *self, diskwriter_op_t *op) {
+    op->queued_us = now_us();
+    op->next      = NULL;
+    if (self->tail) self->tail->next = op;
+    else            self->head = op;
+    self->tail = op;
+    pthread_cond_signal(&self->wakeup);
+}
+
+diskfile_t *diskwriter_open(diskwriter_t *self, const char *path) {
+    int  flags  = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    bool direct = self->direct;
+    int  fd     = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && direct && errno == EINVAL) {
+        tracef("%s can't be opened with O_DIRECT, writing it through the page cache", path);
+        direct = false;
+        fd     = open(path, flags, 0644);
+    }
+    if (fd < 0) {
+        tracef("couldn't open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    diskfile_t *file = calloc(1, sizeof(diskfile_t));
+    if (file == NULL) failf("couldn't allocate %s", path);
+    file->writer = self;
+    file->fd     = fd;
+    file->direct = direct;
+    pthread_mutex_init(&file->lock, NULL);
+    file->allocated = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, DISKWRITER_PREALLOC_BYTES) == 0 ? DISKWRITER_PREALLOC_BYTES : -1;
+    return file;
+}
+
+// hands the first len bytes of the staging buffer to the writer thread and
+// moves whatever is left to the front of next. called with both locks held.
+static void diskfile_submit(diskfile_t *self, diskwriter_op_t *op, uint8_t *next, size_t len) {
+    op->type   = DISKWRITER_OP_WRITE;
+    op->file   = self;
+    op->buf    = self->buf;
+    op->len    = len;
+    op->offset = self->buf_offset;
+    if (next != NULL) memcpy(next, self->buf + len, self->fill - len);
+    self->buf         = next;
+    self->fill       -= len;
+    self->buf_offset += len;
+    diskwriter_queue(self->writer, op);
+}
+
+bool diskfile_write(diskfile_t *self, const void *data, size_t len) {
+    diskwriter_t  *writer = self->writer;
+    const uint8_t *p      = (const uint8_t*)data;
+    pthread_mutex_lock(&self->lock);
+    while (len > 0) {
+        size_t n;
+        if (self->pos < self->buf_offset) {
+            // already with the writer thread, so it's rewritten after the fact
+            n = self->buf_offset - self->pos;
+            if (n > len) n = len;
+            if (n > DISKWRITER_MAX_PATCH) n = DISKWRITER_MAX_PATCH;
+            pthread_mutex_lock(&writer->lock);
+            diskwriter_op_t *op = diskwriter_op_alloc(writer, true);
+            op->type   = DISKWRITER_OP_PATCH;
+            op->file   = self;
+            op->len    = n;
+            op->offset = self->pos;
+            memcpy(op->patch, p, n);
+            diskwriter_queue(writer, op);
+            pthread_mutex_unlock(&writer->lock);
+        } else if (self->pos < self->size) {
+            n = self->size - self->pos;
+            if (n > len) n = len;
+            memcpy(self->buf + (self->pos - self->buf_offset), p, n);
+        } else {
+            if (self->buf == NULL) {
+                pthread_mutex_lock(&writer->lock);
+                self->buf = diskwriter_buffer_alloc(writer, true);
+                pthread_mutex_unlock(&writer->lock);
+            }
+            n = writer->buffer_bytes - self->fill;
+            if (n > len) n = len;
+            memcpy(self->buf + self->fill, p, n);
+            self->fill += n;
+            self->size += n;
+            if (self->fill == (size_t)writer->buffer_bytes) {
+                pthread_mutex_lock(&writer->lock);
+                diskfile_submit(self, diskwriter_op_alloc(writer, true), NULL, self->fill);
+                pthread_mutex_unlock(&writer->lock);
+            }
+        }
+        p         += n;
+        len       -= n;
+        self->pos += n;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return !__atomic_load_n(&self->failed, __ATOMIC_RELAXED);
+}
+
+bool diskfile_seek(diskfile_t *self, long long offset) {
+    pthread_mutex_lock(&self->lock);
+    bool ok = offset >= 0 && offset <= self->size;
+    if (ok) self->pos = offset;
+    pthread_mutex_unlock(&self->lock);
+    return ok;
+}
+
+long long diskfile_tell(diskfile_t *self) {
+    pthread_mutex_lock(&self->lock);
+    long long pos = self->pos;
+    pthread_mutex_unlock(&self->lock);
+    return pos;
+}
+
+// whether n ops can be had without waiting. called with self->lock held.
+static bool diskwriter_ops_free(diskwriter_t *self, int n) {
+    diskwriter_op_t *op;
+    for (op = self->free_ops; op != NULL && n > 0; op = op->next) n--;
+    return n == 0;
+}
+
+bool diskfile_checkpoint(diskfile_t *self, bool sync_dir) {
+    diskwriter_t *writer = self->writer;
+    pthread_mutex_lock(&self->lock);
+    pthread_mutex_lock(&writer->lock);
+
+    // only whole blocks are handed over, so the next staging buffer still
+    // starts on one. through the page cache the partial block is written now
+    // from a copy, and again with the rest of its block later; O_DIRECT can't
+    // write it, so there it waits.
+    size_t   len       = self->fill / DISKWRITER_ALIGN * DISKWRITER_ALIGN;
+    bool     copy_tail = !self->direct && len < self->fill;
+    bool     move_tail = len > 0 && len < self->fill;
+    uint8_t *next      = NULL;
+    uint8_t *copy      = NULL;
+    bool ok = diskwriter_ops_free(writer, (len > 0) + copy_tail + 1) &&
+              writer->nfree_buffers >= move_tail + copy_tail;
+    if (ok) {
+        if (move_tail) next = diskwriter_buffer_alloc(writer, false);
+        if (copy_tail) copy = diskwriter_buffer_alloc(writer, false);
+        if (len > 0) diskfile_submit(self, diskwriter_op_alloc(writer, false), next, len);
+        diskwriter_op_t *op;
+        if (copy_tail) {
+            // what's left is at the front of self->buf, at buf_offset, which stays put
+            memcpy(copy, self->buf, self->fill);
+            op = diskwriter_op_alloc(writer, false);
+            op->type   = DISKWRITER_OP_WRITE;
+            op->file   = self;
+            op->buf    = copy;
+            op->len    = self->fill;
+            op->offset = self->buf_offset;
+            diskwriter_queue(writer, op);
+        }
+        op = diskwriter_op_alloc(writer, false);
+        op->type     = DISKWRITER_OP_SYNC;
+        op->file     = self;
+        op->sync_dir = sync_dir;
+        diskwriter_queue(writer, op);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    pthread_mutex_unlock(&self->lock);
+    return ok;
+}
+
+bool diskfile_close(diskfile_t *self) {
+    diskwriter_t *writer = self->writer;
+    pthread_mutex_lock(&self->lock);
+    pthread_mutex_lock(&writer->lock);
+    diskwriter_op_t *op = diskwriter_op_alloc(writer, true);
+    op->type   = DISKWRITER_OP_CLOSE;
+    op->file   = self;
+    op->buf    = self->buf;
+    op->len    = self->fill;
+    op->offset = self->buf_offset;
+    diskwriter_queue(writer, op);
+    self->buf = NULL;
+    while (!self->closed) pthread_cond_wait(&writer->done, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_mutex_unlock(&self->lock);
+
+    bool ok = !self->failed;
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+    return ok;
+}
+
+// everything below runs on the writer thread
+
+static void diskfile_failed(diskfile_t *self, const char *what) {
+    if (!__atomic_load_n(&self->failed, __ATOMIC_RELAXED)) tracef("couldn't %s a recording: %s", what, strerror(errno));
+    __atomic_store_n(&self->failed, true, __ATOMIC_RELAXED);
+}
+
+static void diskfile_pwrite(diskfile_t *self, const uint8_t *buf, size_t len, long long offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(self->fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            diskfile_failed(self, "write");
+            return;
+        }
+        buf    += n;
+        len    -= n;
+        offset += n;
+    }
+}
+
+// the tail and header rewrites aren't whole blocks
+static void diskfile_buffered(diskfile_t *self) {
+    if (!self->direct || self->buffered) return;
+    int flags = fcntl(self->fd, F_GETFL);
+    if (flags < 0 || fcntl(self->fd, F_SETFL, flags & ~O_DIRECT) != 0) diskfile_failed(self, "stop O_DIRECT on");
+    self->buffered = true;
+}
+
+static void diskfile_preallocate(diskfile_t *self, long long end) {
+    while (self->allocated >= 0 && end > self->allocated) {
+        if (fallocate(self->fd, FALLOC_FL_KEEP_SIZE, self->allocated, DISKWRITER_PREALLOC_BYTES) != 0) {
+            self->allocated = -1;
+            break;
+        }
+        self->allocated += DISKWRITER_PREALLOC_BYTES;
+    }
+}
+
+static void diskwriter_do(diskwriter_t *self, diskwriter_op_t *op) {
+    diskfile_t *file  = op->file;
+    long long   start = now_us();
+    switch (op->type) {
+        case DISKWRITER_OP_WRITE:
+            histo_record(&self->queue_latency, start - op->queued_us);
+            diskfile_preallocate(file, op->offset + op->len);
+            diskfile_pwrite(file, op->buf, op->len, op->offset);
+            histo_record(&self->write_latency, now_us() - start);
+            break;
+
+        case DISKWRITER_OP_PATCH:
+            diskfile_buffered(file);
+            diskfile_pwrite(file, op->patch, op->len, op->offset);
+            break;
+
+        case DISKWRITER_OP_SYNC:
+            if (fdatasync(file->fd) != 0) diskfile_failed(file, "checkpoint");
+            if (op->sync_dir) {
+                int dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (dirfd >= 0) {
+                    fsync(dirfd);
+                    close(dirfd);
+                }
+            }
+            histo_record(&self->sync_latency, now_us() - start);
+            break;
+
+        case DISKWRITER_OP_CLOSE:
+            diskfile_buffered(file);
+            if (op->len > 0) diskfile_pwrite(file, op->buf, op->len, op->offset);
+            // gives back what was preallocated past the end
+            if (file->allocated > 0 && ftruncate(file->fd, op->offset + op->len) != 0) diskfile_failed(file, "truncate");
+            if (close(file->fd) != 0) diskfile_failed(file, "close");
+            break;
+    }
+}
+
+static void *diskwriter_thread_main(void *arg) {
+    diskwriter_t *self = (diskwriter_t*)arg;
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        diskwriter_op_t *op = self->head;
+        if (op == NULL) {
+            pthread_cond_wait(&self->wakeup, &self->lock);
+            continue;
+        }
+        self->head = op->next;
+        if (self->head == NULL) self->tail = NULL;
+        pthread_mutex_unlock(&self->lock);
+
+        diskwriter_do(self, op);
+
+        pthread_mutex_lock(&self->lock);
+        if (op->buf != NULL) self->free_buffers[self->nfree_buffers++] = op->buf;
+        if (op->type == DISKWRITER_OP_CLOSE) op->file->closed = true;
+        op->next       = self->free_ops;
+        self->free_ops = op;
+        pthread_cond_broadcast(&self->done);
+    }
+    return NULL;
+}
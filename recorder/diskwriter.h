@@ -0,0 +1,132 @@
+#ifndef INCLUDED_DISKWRITER_H
+#define INCLUDED_DISKWRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "histo.h"
+
+typedef struct diskwriter diskwriter_t;
+typedef struct diskfile diskfile_t;
+
+/* keeps the SD card out of the encode path.
+ *
+ * whoever encodes a recording appends to a staging buffer in memory. full
+ * buffers (buffer_bytes, a multiple of DISKWRITER_ALIGN) are handed to one
+ * writer thread, which writes each with a single pwrite at an aligned
+ * offset, so the card sees a few large writes instead of a stream of
+ * frame-sized ones, and a write that stalls for a second only holds up the
+ * writer thread. the encoder only waits if all nbuffers are staged at once.
+ *
+ * each file is preallocated DISKWRITER_PREALLOC_BYTES at a time (without
+ * changing its size, so readers still see only what's been written) to
+ * keep it contiguous, and the preallocation past the end is given back
+ * when it's closed. with direct, writes bypass the page cache (O_DIRECT),
+ * except for the final partial block and header rewrites at close.
+ *
+ * a diskfile_t may be used from more than one thread, one call at a time.
+ */
+void diskwriter_init(diskwriter_t *self, int nbuffers, int buffer_bytes, bool direct);
+
+/* creates (or truncates) path. called off the recording path: it allocates
+ * and preallocates. returns NULL on failure.
+ */
+diskfile_t *diskwriter_open(diskwriter_t *self, const char *path);
+
+/* writes at the current position, which is the end unless diskfile_seek
+ * moved it back to rewrite a header. returns false once any write to the
+ * file has failed.
+ */
+bool diskfile_write(diskfile_t *self, const void *buf, size_t len);
+bool diskfile_seek(diskfile_t *self, long long offset);
+long long diskfile_tell(diskfile_t *self);
+
+/* hands over what's staged so far and has the writer thread fdatasync it
+ * (and the directory, with sync_dir), without waiting for either. whole
+ * blocks are handed over as they are, so later writes stay aligned; the
+ * last partial block is written from a copy and again once it's whole, or
+ * under direct, waits for the next one. returns false, having done
+ * nothing, if the writer is too far behind to take it.
+ */
+bool diskfile_checkpoint(diskfile_t *self, bool sync_dir);
+
+/* writes the rest, waits until it's all on its way to disk, and frees the
+ * file. returns false if any write failed.
+ */
+bool diskfile_close(diskfile_t *self);
+
+/* the most staging buffers that have ever been in use at once, and how many
+ * times a write had to wait for one
+ */
+int diskwriter_high_water(diskwriter_t *self);
+int diskwriter_stalls(diskwriter_t *self);
+
+#define DISKWRITER_ALIGN            (4096)                  // O_DIRECT alignment for offsets, lengths and memory
+#define DISKWRITER_PREALLOC_BYTES   (16 * 1024 * 1024)      // ~2 minutes of FLAC
+#define DISKWRITER_MAX_PATCH        (64)                    // bytes per header rewrite op; longer ones are split
+
+typedef enum {
+    DISKWRITER_OP_WRITE,            // buf[0..len) at offset, then hand buf back
+    DISKWRITER_OP_PATCH,            // patch[0..len) at offset
+    DISKWRITER_OP_SYNC,
+    DISKWRITER_OP_CLOSE,            // buf[0..len) at offset, if any, then close
+} diskwriter_op_type_t;
+
+typedef struct diskwriter_op {
+    diskwriter_op_type_t    type;
+    diskfile_t             *file;
+    uint8_t                *buf;
+    size_t                  len;
+    long long               offset;
+    bool                    sync_dir;
+    uint8_t                 patch[DISKWRITER_MAX_PATCH];
+    long long               queued_us;
+    struct diskwriter_op   *next;
+} diskwriter_op_t;
+
+struct diskfile
+{
+    diskwriter_t           *writer;
+    int                     fd;
+    bool                    direct;     // opened with O_DIRECT
+    pthread_mutex_t         lock;       // callers' side
+
+    uint8_t                *buf;        // being filled, NULL until the next write
+    size_t                  fill;
+    long long               buf_offset; // where buf[0] goes in the file
+    long long               pos;
+    long long               size;
+
+    // writer thread
+    bool                    buffered;   // O_DIRECT has been turned off for the tail
+    long long               allocated;  // preallocated up to here, -1 if the filesystem can't
+    bool                    failed;     // any write failed. read by callers
+    bool                    closed;
+};
+
+struct diskwriter
+{
+    int                     buffer_bytes;
+    int                     nbuffers;
+    bool                    direct;
+    histo_t                 write_latency;      // per pwrite
+    histo_t                 queue_latency;      // from staged to written: how far behind the card is
+    histo_t                 sync_latency;       // per checkpoint
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          wakeup;             // an op was queued
+    pthread_cond_t          done;               // a buffer or op was freed, or a file closed
+    uint8_t               **free_buffers;
+    int                     nfree_buffers;
+    int                     high_water;
+    int                     stalls;
+    diskwriter_op_t        *ops;
+    diskwriter_op_t        *free_ops;
+    diskwriter_op_t        *head;
+    diskwriter_op_t        *tail;
+    pthread_t               thread;
+};
+
+#endif
@@ -0,0 +1,727 @@
+#include "encoder.h"
+#include "flacutil.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef enum {
+    ENCODER_MSG_BEGIN,
+    ENCODER_MSG_SAMPLES,
+    ENCODER_MSG_END,
+} encoder_msg_type_t;
+
+typedef struct {
+    encoder_msg_type_t  type;
+    int                 nframes;
+    char                filename[ENCODER_MAX_FILENAME];    // empty on END means discard
+    short               samples[];
+} encoder_msg_t;
+
+// always leave room for BEGIN/END so a full ring can't lose a recording boundary
+#define ENCODER_RESERVED_SLOTS (2)
+
+typedef struct {
+    encoder_stream_t     stream;
+    encoder_take_t       take;
+    overview_t           overview;
+    long long            queued_us;
+    char                 tmpfilename[ENCODER_MAX_FILENAME];
+    char                 filename[ENCODER_MAX_FILENAME];   // empty means discard
+} finalize_job_t;
+
+#define FINALIZE_RING_NJOBS (4)
+
+// libflac only accepts blocks up to this size for subset streams at <= 48kHz
+#define ENCODER_MAX_BLOCKSIZE (4608)
+
+#define ENCODER_PROFILE_DELIMS " \t\r\n"
+
+bool encoder_profile_parse(encoder_profile_t *profile, const char *str) {
+    encoder_profile_t parsed = *profile;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", str);
+
+    char *save = NULL;
+    char *tok;
+    for (tok = strtok_r(buf, ENCODER_PROFILE_DELIMS, &save); tok != NULL; tok = strtok_r(NULL, ENCODER_PROFILE_DELIMS, &save)) {
+        if (strcmp(tok, "auto") == 0) {
+            parsed.compression_level = ENCODER_LEVEL_AUTO;
+        } else if (isdigit(tok[0]) && tok[0] <= '8' && tok[1] == '\0') {
+            parsed.compression_level = tok[0] - '0';
+        } else if (strcmp(tok, "blocksize") == 0) {
+            char *arg = strtok_r(NULL, ENCODER_PROFILE_DELIMS, &save);
+            if (arg == NULL) return false;
+            if (strcmp(arg, "default") == 0) {
+                parsed.blocksize = 0;
+            } else {
+                char *end;
+                long n = strtol(arg, &end, 10);
+                if (*end != '\0' || n < 16 || n > ENCODER_MAX_BLOCKSIZE) return false;
+                parsed.blocksize = (int)n;
+            }
+        } else if (strcmp(tok, "apodization") == 0) {
+            char *arg = strtok_r(NULL, ENCODER_PROFILE_DELIMS, &save);
+            if (arg == NULL || strlen(arg) >= sizeof(parsed.apodization)) return false;
+            // strncpy zero fills, so equal profiles compare equal with memcmp
+            strncpy(parsed.apodization, strcmp(arg, "default") == 0 ? "" : arg, sizeof(parsed.apodization));
+        } else {
+            return false;
+        }
+    }
+    *profile = parsed;
+    return true;
+}
+
+void encoder_profile_format(const encoder_profile_t *profile, char *buf, int len) {
+    char level[16], blocksize[16];
+    if (profile->compression_level == ENCODER_LEVEL_AUTO) {
+        strcpy(level, "auto");
+    } else {
+        snprintf(level, sizeof(level), "%d", profile->compression_level);
+    }
+    if (profile->blocksize == 0) {
+        strcpy(blocksize, "default");
+    } else {
+        snprintf(blocksize, sizeof(blocksize), "%d", profile->blocksize);
+    }
+    snprintf(buf, len, "%s blocksize %s apodization %s", level, blocksize,
+             profile->apodization[0] != '\0' ? profile->apodization : "default");
+}
+
+static bool encoder_stream_active(encoder_stream_t *stream) {
+    return stream->flac != NULL || stream->par != NULL;
+}
+
+static bool encoder_stream_process(encoder_stream_t *stream, const FLAC__int32 *samples, int nframes) {
+    if (stream->par != NULL) return flacpar_process_interleaved(stream->par, samples, nframes);
+    return FLAC__stream_encoder_process_interleaved(stream->flac, samples, nframes);
+}
+
+// flushes, closes the file and frees the encoder
+static bool encoder_stream_finish(encoder_stream_t *stream) {
+    bool ok;
+    if (stream->par != NULL) {
+        ok = flacpar_finish(stream->par);
+        flacpar_delete(stream->par);
+    } else {
+        ok = FLAC__stream_encoder_finish(stream->flac);
+        FLAC__stream_encoder_delete(stream->flac);
+        if (!diskfile_close(stream->file)) ok = false;
+    }
+    stream->flac = NULL;
+    stream->par  = NULL;
+    stream->file = NULL;
+    return ok;
+}
+
+// libflac's output, which it also seeks back into to rewrite STREAMINFO when it finishes
+static FLAC__StreamEncoderWriteStatus encoder_write_cb(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[],
+                                                       size_t bytes, unsigned samples, unsigned current_frame,
+                                                       void *client_data) {
+    return diskfile_write((diskfile_t*)client_data, buffer, bytes) ? FLAC__STREAM_ENCODER_WRITE_STATUS_OK
+                                                                    : FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+}
+
+static FLAC__StreamEncoderSeekStatus encoder_seek_cb(const FLAC__StreamEncoder *encoder, FLAC__uint64 offset,
+                                                     void *client_data) {
+    return diskfile_seek((diskfile_t*)client_data, offset) ? FLAC__STREAM_ENCODER_SEEK_STATUS_OK
+                                                            : FLAC__STREAM_ENCODER_SEEK_STATUS_ERROR;
+}
+
+static FLAC__StreamEncoderTellStatus encoder_tell_cb(const FLAC__StreamEncoder *encoder, FLAC__uint64 *offset,
+                                                     void *client_data) {
+    *offset = diskfile_tell((diskfile_t*)client_data);
+    return FLAC__STREAM_ENCODER_TELL_STATUS_OK;
+}
+
+// opens the prewarm file and gets an encoder ready to write into it,
+// so that starting a recording doesn't have to.
+static void encoder_prepare(encoder_t *self) {
+    long long prepare_start = now_us();
+
+    pthread_mutex_lock(&self->profile_lock);
+    self->next_profile    = self->profile;
+    self->profile_changed = false;
+    pthread_mutex_unlock(&self->profile_lock);
+
+    const encoder_profile_t *profile = &self->next_profile;
+    const char *apodization = profile->apodization[0] != '\0' ? profile->apodization : NULL;
+    int level = __atomic_load_n(&self->level, __ATOMIC_RELAXED);
+
+    diskfile_t *file = diskwriter_open(self->writer, self->prewarm_filename);
+    if (file == NULL) {
+        failf("couldn't open file");
+    }
+
+    if (self->nthreads > 1) {
+        int blocksize = profile->blocksize > 0 ? profile->blocksize : ENCODER_PAR_BLOCKSIZE;
+        flacpar_t *par = flacpar_new(self->channels, self->sample_rate, level, blocksize,
+                                     apodization, ENCODER_PAR_CHUNK_BLOCKS);
+        if (par == NULL || !flacpar_init_diskfile(par, file)) {
+            failf("couldn't init parallel flac encoder");
+        }
+        self->next.par  = par;
+        self->next.file = file;
+    } else {
+        FLAC__StreamEncoder *flac = FLAC__stream_encoder_new();
+        if (flac == NULL) {
+            failf("couldn't start flac encoder");
+        }
+
+        FLAC__stream_encoder_set_channels(flac, self->channels);
+        FLAC__stream_encoder_set_bits_per_sample(flac, 16);
+        FLAC__stream_encoder_set_sample_rate(flac, self->sample_rate);
+        FLAC__stream_encoder_set_compression_level(flac, level);
+        if (profile->blocksize > 0) {
+            FLAC__stream_encoder_set_blocksize(flac, profile->blocksize);
+        }
+        if (apodization != NULL) {
+            FLAC__stream_encoder_set_apodization(flac, apodization);
+        }
+
+        FLAC__StreamEncoderInitStatus initstatus = FLAC__stream_encoder_init_stream(flac, encoder_write_cb,
+                                                                                    encoder_seek_cb, encoder_tell_cb,
+                                                                                    NULL, file);
+        if (initstatus != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+            failf("couldn't init flac encoder");
+        }
+        self->next.flac = flac;
+        self->next.file = file;
+    }
+
+    tracef("prepared next encoder at level %d in %dus", level, (int)(now_us() - prepare_start));
+}
+
+// throws away the prepared encoder and prepares one with the current profile
+static void encoder_reprepare(encoder_t *self) {
+    if (encoder_stream_active(&self->next)) encoder_stream_finish(&self->next);
+    encoder_prepare(self);
+}
+
+static bool encoder_profile_changed(encoder_t *self) {
+    return __atomic_load_n(&self->profile_changed, __ATOMIC_ACQUIRE);
+}
+
+// auto profile: accounts for the time spent encoding the last buffer and,
+// every ENCODER_AUTO_SECONDS of audio, moves the level one step toward
+// whatever keeps the load inside the budget.
+static void encoder_auto_tune(encoder_t *self, long long process_us, int nframes) {
+    if (self->cur.par != NULL) {
+        // the pool encodes in the background, so count its workers' time instead
+        long long encode_us, frames;
+        flacpar_encode_time(self->cur.par, &encode_us, &frames);
+        self->auto_encode_us += encode_us - self->auto_par_us;
+        self->auto_frames    += frames    - self->auto_par_frames;
+        self->auto_par_us     = encode_us;
+        self->auto_par_frames = frames;
+    } else {
+        self->auto_encode_us += process_us;
+        self->auto_frames    += nframes;
+    }
+
+    // buffers piling up in the ring means the budget is already blown, unless
+    // the producer is a replay that keeps the ring full on purpose
+    bool backlog = !self->wait && self->auto_hold == 0 && ringbuf_count(&self->ring) > self->ring.nslots / 4;
+    if (!backlog && self->auto_frames < (long long)self->sample_rate * ENCODER_AUTO_SECONDS) return;
+
+    int    threads   = self->cur.par != NULL ? self->nthreads : 1;
+    double budget_us = (double)self->auto_frames * 1000000.0 / self->sample_rate * threads;
+    double load      = budget_us > 0 ? self->auto_encode_us / budget_us : 0.0;
+
+    int level     = __atomic_load_n(&self->level, __ATOMIC_RELAXED);
+    int new_level = level;
+    if ((backlog || load > ENCODER_AUTO_HIGH_LOAD) && level > 0) {
+        new_level = level - 1;
+    } else if (load < ENCODER_AUTO_LOW_LOAD && level < 8 && self->auto_hold == 0) {
+        new_level = level + 1;
+    }
+    if (self->auto_hold > 0) self->auto_hold--;
+
+    if (new_level != level) {
+        tracef("auto profile: level %d using %d%% of the real-time budget%s, switching to %d",
+                level, (int)(load * 100), backlog ? " and falling behind" : "", new_level);
+        __atomic_store_n(&self->level, new_level, __ATOMIC_RELAXED);
+
+        // a single libflac encoder can't change level mid-stream; the next recording picks it up
+        if (self->cur.par != NULL) flacpar_set_level(self->cur.par, new_level);
+        self->auto_hold = ENCODER_AUTO_HOLD;
+    }
+    self->auto_encode_us = 0;
+    self->auto_frames    = 0;
+}
+
+static void encoder_handle_begin(encoder_t *self, encoder_msg_t *msg) {
+    long long begin_record_start = now_us();
+
+    if (!encoder_stream_active(&self->next) || encoder_profile_changed(self)) encoder_reprepare(self);
+
+    // the prepared encoder already has its file open; just give it its real name
+    strcpy(self->tmpfilename, msg->filename);
+    if (rename(self->prewarm_filename, self->tmpfilename) != 0) {
+        failf("couldn't rename %s to %s", self->prewarm_filename, self->tmpfilename);
+    }
+    self->cur = self->next;
+    memset(&self->next, 0, sizeof(self->next));
+    if (self->event_cb != NULL) {
+        self->event_cb(self->event_userdata, ENCODER_EVENT_BEGIN, self->tmpfilename, NULL, NULL);
+    }
+
+    self->frames_since_checkpoint = 0;
+    self->synced_dir              = false;
+    self->take_frames             = 0;
+    levels_reset(&self->take_levels, self->channels);
+    loudness_reset(&self->take_loudness);
+    levels_reset(&self->overview_point, self->channels);
+    self->overview_point_frames   = 0;
+    pthread_mutex_lock(&self->overview_lock);
+    overview_free(&self->overview);
+    self->overview_take = ++self->overview_takes;
+    pthread_mutex_unlock(&self->overview_lock);
+
+    self->auto_tune       = self->next_profile.compression_level == ENCODER_LEVEL_AUTO;
+    self->auto_encode_us  = 0;
+    self->auto_frames     = 0;
+    self->auto_par_us     = 0;
+    self->auto_par_frames = 0;
+
+    long long begin_record_end = now_us();
+    tracef("opened %s in %dus", self->tmpfilename, (int)(begin_record_end - begin_record_start));
+}
+
+// has the disk writer make what's been encoded so far durable. the first
+// checkpoint of a recording syncs the directory too, so a power loss can't
+// undo the rename that gave it its name. if the disk is too far behind to
+// take it, the next checkpoint covers this one.
+static void encoder_checkpoint(encoder_t *self) {
+    self->frames_since_checkpoint = 0;
+    if (self->cur.file == NULL) return;
+    if (diskfile_checkpoint(self->cur.file, !self->synced_dir)) self->synced_dir = true;
+}
+
+// the measured point joins the overview and the take's levels
+static void encoder_overview_point(encoder_t *self) {
+    pthread_mutex_lock(&self->overview_lock);
+    overview_add(&self->overview, &self->overview_point);
+    pthread_mutex_unlock(&self->overview_lock);
+    levels_merge(&self->take_levels, &self->overview_point);
+    levels_reset(&self->overview_point, self->channels);
+    self->overview_point_frames = 0;
+}
+
+// the take's levels, measured an overview point at a time when there is one
+static void encoder_measure(encoder_t *self, const short *samples, int nframes) {
+    int per_point = self->overview.frames_per_point;
+    if (per_point == 0) {
+        levels_accumulate(&self->take_levels, samples, nframes * self->channels);
+        return;
+    }
+    while (nframes > 0) {
+        int n = per_point - self->overview_point_frames;
+        if (n > nframes) n = nframes;
+        levels_accumulate(&self->overview_point, samples, n * self->channels);
+        self->overview_point_frames += n;
+        samples += n * self->channels;
+        nframes -= n;
+        if (self->overview_point_frames == per_point) encoder_overview_point(self);
+    }
+}
+
+static void encoder_handle_samples(encoder_t *self, encoder_msg_t *msg) {
+    if (!encoder_stream_active(&self->cur)) return;
+
+    long long process_start = now_us();
+    const short *src = msg->samples;
+    int left = msg->nframes;
+    while (left > 0) {
+        int n = left < ENCODER_WIDEN_FRAMES ? left : ENCODER_WIDEN_FRAMES;
+        int nsamples = n * self->channels;
+        int i;
+        for (i = 0; i < nsamples; i++) {
+            self->widen[i] = src[i];
+        }
+        if (!encoder_stream_process(&self->cur, self->widen, n)) {
+            failf("flac encoder process failed");
+        }
+        src  += nsamples;
+        left -= n;
+    }
+
+    // once the profile changes, the level belongs to the new profile
+    long long process_us = now_us() - process_start;
+    histo_record(&self->encode_latency, process_us);
+    if (self->auto_tune && !encoder_profile_changed(self)) {
+        encoder_auto_tune(self, process_us, msg->nframes);
+    } else if (self->cur.par != NULL && encoder_profile_changed(self)) {
+        // a parallel take moves to a new manual level right away, as it does to auto's
+        flacpar_set_level(self->cur.par, __atomic_load_n(&self->level, __ATOMIC_RELAXED));
+    }
+
+    self->take_frames += msg->nframes;
+    encoder_measure(self, msg->samples, msg->nframes);
+    loudness_accumulate(&self->take_loudness, msg->samples, msg->nframes);
+
+    self->frames_since_checkpoint += msg->nframes;
+    if (self->checkpoint_frames > 0 && self->frames_since_checkpoint >= self->checkpoint_frames) {
+        encoder_checkpoint(self);
+    }
+}
+
+static void encoder_handle_end(encoder_t *self, encoder_msg_t *msg) {
+    if (!encoder_stream_active(&self->cur)) return;
+    if (self->overview_point_frames > 0) encoder_overview_point(self);
+
+    // the finalizer is only behind if several takes end back to back.
+    // waiting here only delays encoding, never capture.
+    finalize_job_t *job;
+    while ((job = (finalize_job_t*)ringbuf_write_begin(&self->finalize_ring)) == NULL) {
+        usleep(10000);
+    }
+    job->stream    = self->cur;
+    job->queued_us = now_us();
+    job->take.frames   = self->take_frames;
+    job->take.measured = true;
+    job->take.peak     = levels_peak(&self->take_levels);
+    job->take.rms      = levels_rms(&self->take_levels);
+    job->take.loudness = loudness_integrated(&self->take_loudness);
+    job->take.clipped  = levels_clipped(&self->take_levels);
+    pthread_mutex_lock(&self->overview_lock);
+    overview_flush(&self->overview);
+    job->overview = self->overview;
+    overview_init(&self->overview, job->overview.frames_per_point);
+    self->overview_take = 0;
+    pthread_mutex_unlock(&self->overview_lock);
+    strcpy(job->tmpfilename, self->tmpfilename);
+    strcpy(job->filename,    msg->filename);
+    ringbuf_write_end(&self->finalize_ring);
+    sem_post(&self->finalize_wakeup);
+
+    memset(&self->cur, 0, sizeof(self->cur));
+    encoder_prepare(self);
+}
+
+static void *finalize_thread_main(void *arg) {
+    encoder_t *self = (encoder_t*)arg;
+    for (;;) {
+        finalize_job_t *job = (finalize_job_t*)ringbuf_read_begin(&self->finalize_ring);
+        if (job == NULL) {
+            sem_wait(&self->finalize_wakeup);
+            continue;
+        }
+
+        long long end_record_start = now_us();
+        if (!encoder_stream_finish(&job->stream)) {
+            tracef("error finishing %s", job->tmpfilename);
+        }
+
+        encoder_event_t event = ENCODER_EVENT_DISCARD;
+        if (job->filename[0] == '\0') {
+            unlink(job->tmpfilename);
+        } else if (rename(job->tmpfilename, job->filename) != 0) {
+            tracef("couldn't keep %s as %s: %s", job->tmpfilename, job->filename, strerror(errno));
+        } else {
+            event = ENCODER_EVENT_KEEP;
+            if (overview_count(&job->overview, 0) > 0) {
+                char path[ENCODER_MAX_FILENAME + 8];
+                snprintf(path, sizeof(path), "%s%s", job->filename, OVERVIEW_SUFFIX);
+                overview_save(&job->overview, path, self->sample_rate);
+            }
+        }
+        overview_free(&job->overview);
+        if (self->event_cb != NULL) {
+            self->event_cb(self->event_userdata, event, job->tmpfilename,
+                           event == ENCODER_EVENT_KEEP ? job->filename : NULL, &job->take);
+        }
+
+        long long end_record_end = now_us();
+        histo_record(&self->finalize_latency, end_record_end - end_record_start);
+        tracef("finalized recording in %dms, %dms after stop (encoder ring high water %d/%d buffers, "
+               "disk staging high water %d/%d, %d stalls)",
+                (int)((end_record_end - end_record_start) / 1000),
+                (int)((end_record_end - job->queued_us) / 1000),
+                ringbuf_high_water(&self->ring), self->ring.nslots,
+                diskwriter_high_water(self->writer), self->writer->nbuffers, diskwriter_stalls(self->writer));
+
+        ringbuf_read_end(&self->finalize_ring);
+    }
+    return NULL;
+}
+
+static void *encoder_thread_main(void *arg) {
+    encoder_t *self = (encoder_t*)arg;
+    encoder_prepare(self);
+    for (;;) {
+        encoder_msg_t *msg = (encoder_msg_t*)ringbuf_read_begin(&self->ring);
+        if (msg == NULL) {
+            // between recordings is the time to swap in an encoder for a new profile
+            if (encoder_profile_changed(self) && !encoder_stream_active(&self->cur)) encoder_reprepare(self);
+            sem_wait(&self->wakeup);
+            continue;
+        }
+        switch (msg->type) {
+            case ENCODER_MSG_BEGIN:   encoder_handle_begin(self, msg);   break;
+            case ENCODER_MSG_SAMPLES: encoder_handle_samples(self, msg); break;
+            case ENCODER_MSG_END:     encoder_handle_end(self, msg);     break;
+        }
+        ringbuf_read_end(&self->ring);
+    }
+    return NULL;
+}
+
+void encoder_init(encoder_t *self, int channels, int sample_rate, int frames_per_buffer, int nslots,
+                  int nthreads, const encoder_profile_t *profile, diskwriter_t *writer, const char *name) {
+    memset(self, 0, sizeof(*self));
+    if (name[0] == '\0') {
+        snprintf(self->prewarm_filename, sizeof(self->prewarm_filename), "%s%s", ENCODER_PREWARM_PREFIX,
+                 ENCODER_TMP_SUFFIX);
+    } else {
+        snprintf(self->prewarm_filename, sizeof(self->prewarm_filename), "%s-%s%s", ENCODER_PREWARM_PREFIX, name,
+                 ENCODER_TMP_SUFFIX);
+    }
+    self->channels          = channels;
+    self->sample_rate       = sample_rate;
+    self->frames_per_buffer = frames_per_buffer;
+    self->nthreads          = nthreads;
+    self->writer            = writer;
+    self->profile           = *profile;
+    self->level             = profile->compression_level == ENCODER_LEVEL_AUTO ? ENCODER_AUTO_START_LEVEL
+                                                                               : profile->compression_level;
+    pthread_mutex_init(&self->profile_lock, NULL);
+    pthread_mutex_init(&self->overview_lock, NULL);
+    histo_init(&self->encode_latency,   "encode");
+    histo_init(&self->finalize_latency, "finalize");
+    loudness_init(&self->take_loudness, channels, sample_rate);
+
+    char profilebuf[256];
+    encoder_profile_format(profile, profilebuf, sizeof(profilebuf));
+    tracef("encoding with profile '%s' on %d thread%s", profilebuf, nthreads, nthreads == 1 ? "" : "s");
+    // every encoder shares the one pool, sized for the one that wants the most
+    if (nthreads > 1 && nthreads > flacpar_pool_threads()) {
+        flacpar_pool_init(nthreads - flacpar_pool_threads());
+    }
+
+    self->widen = malloc(sizeof(FLAC__int32) * ENCODER_WIDEN_FRAMES * channels);
+    if (self->widen == NULL) {
+        failf("couldn't allocate encoder buffer");
+    }
+
+    int slot_size = sizeof(encoder_msg_t) + sizeof(short) * frames_per_buffer * channels;
+    ringbuf_init(&self->ring, slot_size, nslots + ENCODER_RESERVED_SLOTS);
+    sem_init(&self->wakeup, 0, 0);
+
+    ringbuf_init(&self->finalize_ring, sizeof(finalize_job_t), FINALIZE_RING_NJOBS);
+    sem_init(&self->finalize_wakeup, 0, 0);
+
+    if (pthread_create(&self->finalize_thread, NULL, finalize_thread_main, self) != 0) {
+        failf("couldn't start finalizer thread");
+    }
+    if (pthread_create(&self->thread, NULL, encoder_thread_main, self) != 0) {
+        failf("couldn't start encoder thread");
+    }
+}
+
+static encoder_msg_t *encoder_msg_begin(encoder_t *self, encoder_msg_type_t type, int reserve) {
+    encoder_msg_t *msg;
+    for (;;) {
+        msg = ringbuf_free(&self->ring) <= reserve ? NULL : (encoder_msg_t*)ringbuf_write_begin(&self->ring);
+        if (msg != NULL) break;
+        if (!self->wait) return NULL;
+        usleep(1000);
+    }
+    msg->type        = type;
+    msg->nframes     = 0;
+    msg->filename[0] = '\0';
+    return msg;
+}
+
+static void encoder_msg_end(encoder_t *self) {
+    ringbuf_write_end(&self->ring);
+    sem_post(&self->wakeup);
+}
+
+bool encoder_begin(encoder_t *self, const char *tmpfilename) {
+    // keep a slot back so the matching END always fits
+    encoder_msg_t *msg = encoder_msg_begin(self, ENCODER_MSG_BEGIN, 1);
+    if (msg == NULL) return false;
+    snprintf(msg->filename, sizeof(msg->filename), "%s", tmpfilename);
+    encoder_msg_end(self);
+    return true;
+}
+
+bool encoder_write(encoder_t *self, const short *samples, int nframes) {
+    if (nframes > self->frames_per_buffer) {
+        failf("encoder_write of %d frames exceeds buffer size %d", nframes, self->frames_per_buffer);
+    }
+    encoder_msg_t *msg = encoder_msg_begin(self, ENCODER_MSG_SAMPLES, ENCODER_RESERVED_SLOTS);
+    if (msg == NULL) {
+        self->dropped_buffers++;
+        return false;
+    }
+    msg->nframes = nframes;
+    memcpy(msg->samples, samples, sizeof(short) * nframes * self->channels);
+    encoder_msg_end(self);
+    return true;
+}
+
+bool encoder_end(encoder_t *self, const char *filename) {
+    encoder_msg_t *msg = encoder_msg_begin(self, ENCODER_MSG_END, 0);
+    if (msg == NULL) return false;
+    if (filename != NULL) {
+        snprintf(msg->filename, sizeof(msg->filename), "%s", filename);
+    }
+    encoder_msg_end(self);
+    return true;
+}
+
+void encoder_set_event_cb(encoder_t *self, encoder_event_cb_t cb, void *userdata) {
+    self->event_cb       = cb;
+    self->event_userdata = userdata;
+}
+
+void encoder_set_checkpoint(encoder_t *self, int seconds) {
+    self->checkpoint_frames = seconds * self->sample_rate;
+}
+
+void encoder_set_overview(encoder_t *self, int frames_per_point) {
+    pthread_mutex_lock(&self->overview_lock);
+    overview_init(&self->overview, frames_per_point);
+    pthread_mutex_unlock(&self->overview_lock);
+}
+
+int encoder_overview_read(encoder_t *self, int level, int offset, overview_point_t *points, int max, int *take) {
+    pthread_mutex_lock(&self->overview_lock);
+    *take = self->overview_take;
+    int n = overview_read(&self->overview, level, offset, points, max);
+    pthread_mutex_unlock(&self->overview_lock);
+    return n;
+}
+
+// keeps the complete frames of a recording that was cut off. returns false
+// if there are none.
+static bool encoder_repair(const char *tmpfilename, flac_streaminfo_t *info) {
+    int fd = open(tmpfilename, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        tracef("couldn't open %s to recover it: %s", tmpfilename, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t end = 0;
+    if (st.st_size > 0) {
+        void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (buf != MAP_FAILED) {
+            end = flac_scan_frames((const uint8_t*)buf, st.st_size, info);
+            munmap(buf, st.st_size);
+        }
+    }
+
+    uint8_t streaminfo[34];
+    bool ok = end > 0 && info->total_samples > 0;
+    if (ok) {
+        flac_write_streaminfo(streaminfo, info);
+        ok = pwrite(fd, streaminfo, sizeof(streaminfo), FLAC_STREAMINFO_OFFSET) == sizeof(streaminfo) &&
+             ftruncate(fd, end) == 0 && fdatasync(fd) == 0;
+        if (ok && (off_t)end < st.st_size) {
+            tracef("cut %lld bytes of incomplete audio off the end of %s", (long long)(st.st_size - end), tmpfilename);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+int encoder_recover(encoder_t *self) {
+    DIR *dir = opendir(".");
+    if (dir == NULL) return 0;
+    int nrecovered = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *tmpfilename = ent->d_name;
+        int len    = strlen(tmpfilename);
+        int suffix = strlen(ENCODER_TMP_SUFFIX);
+        if (len <= suffix || strcmp(tmpfilename + len - suffix, ENCODER_TMP_SUFFIX) != 0) continue;
+        // the encoder threads are already writing the next ones
+        if (strncmp(tmpfilename, ENCODER_PREWARM_PREFIX, strlen(ENCODER_PREWARM_PREFIX)) == 0) continue;
+
+        flac_streaminfo_t info;
+        if (!encoder_repair(tmpfilename, &info)) {
+            tracef("nothing to recover in %s, deleting it", tmpfilename);
+            unlink(tmpfilename);
+            continue;
+        }
+        // "<name>.<take>.flac.tmp" is kept as "<name>,<N>s.flac"
+        int name_len = len - suffix;
+        int digits   = name_len;
+        while (digits > 0 && isdigit((unsigned char)tmpfilename[digits - 1])) digits--;
+        if (digits < name_len && digits > 0 && tmpfilename[digits - 1] == '.') name_len = digits - 1;
+
+        char filename[ENCODER_MAX_FILENAME];
+        int  seconds = (int)(info.total_samples / (info.sample_rate > 0 ? info.sample_rate : self->sample_rate));
+        snprintf(filename, sizeof(filename), "%.*s,%ds.flac", name_len, tmpfilename, seconds);
+        if (rename(tmpfilename, filename) != 0) {
+            tracef("couldn't recover %s as %s: %s", tmpfilename, filename, strerror(errno));
+            continue;
+        }
+        tracef("recovered %s: %ds of audio left by a crash", filename, seconds);
+        encoder_take_t take = { .frames = (long long)info.total_samples };
+        if (self->event_cb != NULL) self->event_cb(self->event_userdata, ENCODER_EVENT_KEEP, tmpfilename, filename, &take);
+        nrecovered++;
+    }
+    closedir(dir);
+    return nrecovered;
+}
+
+void encoder_set_wait(encoder_t *self, bool wait) {
+    self->wait = wait;
+}
+
+void encoder_flush(encoder_t *self) {
+    // a message or job only leaves its ring once it has been dealt with, and
+    // END hands its job to the finalizer before it leaves
+    while (ringbuf_count(&self->ring) > 0) usleep(1000);
+    while (ringbuf_count(&self->finalize_ring) > 0) usleep(1000);
+}
+
+static long long encoder_thread_cpu_us(pthread_t thread) {
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &ts) != 0) return 0;
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long encoder_cpu_us(encoder_t *self) {
+    return encoder_thread_cpu_us(self->thread) + encoder_thread_cpu_us(self->finalize_thread);
+}
+
+int encoder_high_water(encoder_t *self) {
+    return ringbuf_high_water(&self->ring);
+}
+
+void encoder_set_profile(encoder_t *self, const encoder_profile_t *profile) {
+    pthread_mutex_lock(&self->profile_lock);
+    if (memcmp(&self->profile, profile, sizeof(*profile)) != 0) {
+        self->profile = *profile;
+        // auto carries on from wherever the level is now
+        if (profile->compression_level != ENCODER_LEVEL_AUTO) {
+            __atomic_store_n(&self->level, profile->compression_level, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&self->profile_changed, true, __ATOMIC_RELEASE);
+        sem_post(&self->wakeup);
+    }
+    pthread_mutex_unlock(&self->profile_lock);
+}
+
+void encoder_get_profile(encoder_t *self, encoder_profile_t *profile, int *level) {
+    pthread_mutex_lock(&self->profile_lock);
+    *profile = self->profile;
+    pthread_mutex_unlock(&self->profile_lock);
+    *level = __atomic_load_n(&self->level, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,273 @@
+#ifndef INCLUDED_ENCODER_H
+#define INCLUDED_ENCODER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <FLAC/all.h>
+
+#include "ringbuf.h"
+#include "flacpar.h"
+#include "diskwriter.h"
+#include "histo.h"
+#include "levels.h"
+#include "loudness.h"
+#include "overview.h"
+
+typedef struct encoder encoder_t;
+
+#define ENCODER_LEVEL_AUTO (-1)
+
+/* how recordings are compressed. blocksize and apodization left at 0/"" use
+ * whatever libflac picks for the level.
+ *
+ * with ENCODER_LEVEL_AUTO the encoder times itself against the real-time
+ * budget and settles on the strongest level the CPU can sustain, stepping
+ * down when something else (an upload, say) starts competing for it.
+ */
+typedef struct {
+    int     compression_level;      // 0-8 or ENCODER_LEVEL_AUTO
+    int     blocksize;
+    char    apodization[128];
+} encoder_profile_t;
+
+/* parses "<auto|0-8> [blocksize N|default] [apodization SPEC|default]" on top
+ * of *profile. any part may be left out. returns false and leaves *profile
+ * alone if str doesn't parse.
+ */
+bool encoder_profile_parse(encoder_profile_t *profile, const char *str);
+
+/* the inverse of encoder_profile_parse */
+void encoder_profile_format(const encoder_profile_t *profile, char *buf, int len);
+
+/* the encoder owns a thread that does all FLAC encoding and file I/O for
+ * recordings. the audio thread hands it work through a preallocated
+ * single-producer/single-consumer ring, so none of these calls ever block
+ * on the encoder or on the disk.
+ *
+ * the next recording's file + libflac encoder are prepared ahead of time, so
+ * starting a recording is just a rename. finishing one (flushing the last
+ * block, rewriting STREAMINFO, rename/unlink) is handed to a second
+ * finalizer thread so the encoder can move straight on to the next take.
+ *
+ * nslots is the number of FRAMES_PER_BUFFER sized buffers the ring can hold.
+ *
+ * with nthreads > 1, audio is encoded by the flacpar worker pool instead of
+ * a single libflac encoder, so higher compression levels keep up in real time.
+ *
+ * either way, the encoded stream is staged in memory and written out by
+ * writer's thread (see diskwriter.h), so a slow card delays the file, not
+ * the encoder.
+ *
+ * several encoders can run at once, one per stream being recorded; they
+ * share the flacpar pool and the disk writer. name tells their prewarmed
+ * files apart, and is "" when there's only one.
+ */
+void encoder_init(encoder_t *self, int channels, int sample_rate, int frames_per_buffer, int nslots,
+                  int nthreads, const encoder_profile_t *profile, diskwriter_t *writer, const char *name);
+
+/* start a new recording into tmpfilename. returns false if the ring is full.
+ *
+ * tmpfilename has to be unique to the recording: the one before may still be
+ * waiting to be finalized under its own. "<name>.<take>" + ENCODER_TMP_SUFFIX
+ * is recovered as "<name>,<N>s.flac".
+ */
+bool encoder_begin(encoder_t *self, const char *tmpfilename);
+
+/* queue nframes of interleaved audio. returns false (and drops the audio) if
+ * the encoder has fallen too far behind.
+ */
+bool encoder_write(encoder_t *self, const short *samples, int nframes);
+
+/* finish the current recording. if filename is NULL the recording is
+ * discarded, otherwise the temporary file is renamed to filename.
+ */
+bool encoder_end(encoder_t *self, const char *filename);
+
+/* what happens to each recording's file, for whoever follows along (the
+ * uploaders, the catalog). set the callback before the first recording.
+ */
+typedef enum {
+    ENCODER_EVENT_BEGIN,        // encoder thread: tmpfilename is open and about to be written to
+    ENCODER_EVENT_KEEP,         // finalizer thread: tmpfilename is complete and has been renamed to filename
+    ENCODER_EVENT_DISCARD,      // finalizer thread: tmpfilename was thrown away. filename is NULL
+} encoder_event_t;
+
+/* what went into a recording, measured on the encoder thread as it was
+ * encoded. recovered recordings weren't seen whole, so only their length
+ * is known.
+ */
+typedef struct {
+    long long   frames;
+    bool        measured;
+    double      peak;           // [0,1]
+    double      rms;            // [0,1]
+    double      loudness;       // LUFS, see loudness.h
+    int         clipped;        // samples
+} encoder_take_t;
+
+/* take is NULL for ENCODER_EVENT_BEGIN */
+typedef void (*encoder_event_cb_t)(void *userdata, encoder_event_t event, const char *tmpfilename,
+                                   const char *filename, const encoder_take_t *take);
+void encoder_set_event_cb(encoder_t *self, encoder_event_cb_t cb, void *userdata);
+
+/* every `seconds` of audio what's been encoded of the current recording is
+ * handed to the disk writer, which fdatasyncs it, so a crash or power loss
+ * costs at most that much audio (plus the few seconds the parallel encoder
+ * may have in flight) without the encoder ever waiting on the disk. 0 turns
+ * it off.
+ * set it before the first recording.
+ */
+void encoder_set_checkpoint(encoder_t *self, int seconds);
+
+/* builds a waveform overview of each recording, a point every
+ * frames_per_point frames (see overview.h), in the same pass over the audio
+ * that measures the take. a kept recording's is written next to it as
+ * filename + OVERVIEW_SUFFIX before ENCODER_EVENT_KEEP. 0 turns it off.
+ * set it before the first recording.
+ */
+void encoder_set_overview(encoder_t *self, int frames_per_point);
+
+/* copies up to max points of the current recording's overview at level,
+ * starting at offset, and returns how many. *take says which recording that
+ * is: it goes up by one each recording and is 0 between them.
+ * safe to call from any thread.
+ */
+int encoder_overview_read(encoder_t *self, int level, int offset, overview_point_t *points, int max, int *take);
+
+/* repairs the recordings a crash left behind as *.flac.tmp: each is cut back
+ * to its last complete frame, gets a STREAMINFO that matches, and is renamed
+ * <start>,<N>s.flac and reported with ENCODER_EVENT_KEEP as if it had been
+ * kept. ones without a whole frame are deleted. call once at startup, after
+ * encoder_set_event_cb and before the first recording. returns how many
+ * were recovered.
+ */
+int encoder_recover(encoder_t *self);
+
+/* with wait set, begin/write/end wait for room in the ring instead of
+ * failing. only for offline replay, where nothing is lost by waiting.
+ */
+void encoder_set_wait(encoder_t *self, bool wait);
+
+/* blocks until everything queued so far is encoded, finalized and renamed */
+void encoder_flush(encoder_t *self);
+
+/* cpu time used so far by the encoder + finalizer threads. the flacpar
+ * workers aren't included.
+ */
+long long encoder_cpu_us(encoder_t *self);
+
+/* the most buffers that have ever been waiting in the ring at once */
+int encoder_high_water(encoder_t *self);
+
+/* changes the profile. safe to call from any thread. blocksize and
+ * apodization apply from the next recording; a recording in progress
+ * keeps the ones it started with. a new level applies to a recording in
+ * progress from its next buffer when it's encoded in parallel, and from the
+ * next recording with a single libflac encoder.
+ */
+void encoder_set_profile(encoder_t *self, const encoder_profile_t *profile);
+
+/* the current profile, and the level it's encoding at (with a single
+ * libflac encoder, the level the next recording will start at).
+ */
+void encoder_get_profile(encoder_t *self, encoder_profile_t *profile, int *level);
+
+#define ENCODER_MAX_FILENAME 1024
+
+#define ENCODER_PREWARM_PREFIX   "next"      // next.flac.tmp, or next-<name>.flac.tmp
+#define ENCODER_TMP_SUFFIX       ".flac.tmp"
+
+// blocksize + chunk length used for parallel encoding. 4096 is what libflac
+// picks for levels 3-8 at 44.1k; 16 blocks is ~1.5s of audio per chunk.
+#define ENCODER_PAR_BLOCKSIZE    (4096)
+#define ENCODER_PAR_CHUNK_BLOCKS (16)
+
+// one recording's worth of encoder: a plain libflac encoder or a parallel one
+typedef struct {
+    FLAC__StreamEncoder *flac;
+    flacpar_t           *par;
+    diskfile_t          *file;          // what either writes to
+} encoder_stream_t;
+
+// auto profile: level to start at, how much audio to time between decisions,
+// and the fraction of the real-time budget (per encoding thread) to step
+// down above and up below. stepping up is held off for a few windows after
+// any change so the level doesn't oscillate.
+#define ENCODER_AUTO_START_LEVEL (5)
+#define ENCODER_AUTO_SECONDS     (5)
+#define ENCODER_AUTO_HIGH_LOAD   (0.6)
+#define ENCODER_AUTO_LOW_LOAD    (0.25)
+#define ENCODER_AUTO_HOLD        (3)
+
+// audio is queued as int16 and widened for libflac this many frames at a time,
+// so the int32 copy stays in L1 instead of being a second full size buffer
+#define ENCODER_WIDEN_FRAMES (512)
+
+struct encoder
+{
+    ringbuf_t            ring;
+    sem_t                wakeup;
+    pthread_t            thread;
+    int                  channels;
+    int                  sample_rate;
+    int                  frames_per_buffer;
+    int                  nthreads;
+    int                  dropped_buffers;
+    bool                 wait;          // see encoder_set_wait
+    diskwriter_t        *writer;
+    char                 prewarm_filename[ENCODER_MAX_FILENAME];
+
+    histo_t              encode_latency;    // encoder thread time per buffer
+    histo_t              finalize_latency;  // flush + close + rename per recording
+
+    // set from any thread, picked up by the encoder thread
+    pthread_mutex_t      profile_lock;
+    encoder_profile_t    profile;
+    bool                 profile_changed;
+    int                  level;         // atomic. tuned by the encoder thread with the auto profile
+
+    // only touched by the encoder thread
+    FLAC__int32         *widen;         // ENCODER_WIDEN_FRAMES of int32 for libflac
+    encoder_stream_t     cur;           // current recording, or all NULL
+    encoder_stream_t     next;          // prepared for the next recording, or all NULL
+    char                 tmpfilename[ENCODER_MAX_FILENAME];
+    encoder_profile_t    next_profile;  // what next was prepared with
+
+    // auto profile timing for the current recording, encoder thread only
+    long long            auto_encode_us;
+    long long            auto_frames;
+    long long            auto_par_us;   // flacpar_encode_time already counted
+    long long            auto_par_frames;
+    int                  auto_hold;
+    bool                 auto_tune;     // cur was started with the auto profile
+
+    // what's gone into the current recording, encoder thread only
+    long long            take_frames;
+    levels_t             take_levels;
+    loudness_t           take_loudness;
+
+    // the current recording's overview. built by the encoder thread, read
+    // by anyone under the lock
+    pthread_mutex_t      overview_lock;
+    overview_t           overview;
+    int                  overview_take; // 0 between recordings
+    int                  overview_takes;
+    levels_t             overview_point;    // the point being measured, encoder thread only
+    int                  overview_point_frames;
+
+    // checkpoints, encoder thread only
+    int                  checkpoint_frames;
+    long long            frames_since_checkpoint;
+    bool                 synced_dir;    // the current recording's name is durable
+
+    // encoder thread -> finalizer thread
+    ringbuf_t            finalize_ring;
+    sem_t                finalize_wakeup;
+    pthread_t            finalize_thread;
+    encoder_event_cb_t   event_cb;
+    void                *event_userdata;
+};
+
+#endif
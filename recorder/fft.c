@@ -0,0 +1,186 @@
+#include "fft.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    include <arm_neon.h>
+#    define FFT_HAVE_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#    include <emmintrin.h>
+#    define FFT_HAVE_SSE  1
+#endif
+
+// runs every butterfly of one stage: blocks of 2 * half points, twiddles wr/wi[0..half)
+typedef void (*fft_stage_fn_t)(float *re, float *im, const float *wr, const float *wi, int n, int half);
+
+void fft_init(fft_t *self, int size) {
+    memset(self, 0, sizeof(*self));
+    if (size < 8 || (size & (size - 1)) != 0) failf("fft size %d isn't a power of two >= 8", size);
+    self->size     = size;
+    self->half     = size / 2;
+    self->bitrev   = malloc(sizeof(int) * self->half);
+    self->re       = malloc(sizeof(float) * self->half);
+    self->im       = malloc(sizeof(float) * self->half);
+    self->wr       = malloc(sizeof(float) * self->half);
+    self->wi       = malloc(sizeof(float) * self->half);
+    self->split_re = malloc(sizeof(float) * (self->half + 1));
+    self->split_im = malloc(sizeof(float) * (self->half + 1));
+    if (self->bitrev == NULL || self->re == NULL || self->im == NULL || self->wr == NULL ||
+        self->wi == NULL || self->split_re == NULL || self->split_im == NULL) {
+        failf("couldn't allocate %d point fft", size);
+    }
+
+    int bits = 0, i, j, h;
+    while ((1 << bits) < self->half) bits++;
+    for (i = 0; i < self->half; i++) {
+        int r = 0;
+        for (j = 0; j < bits; j++) {
+            if (i & (1 << j)) r |= 1 << (bits - 1 - j);
+        }
+        self->bitrev[i] = r;
+    }
+
+    // the stage combining blocks of h points uses e^-2pi*i*j/(2h), stored at h - 1
+    for (h = 1; h < self->half; h *= 2) {
+        for (j = 0; j < h; j++) {
+            self->wr[h - 1 + j] = (float)cos(M_PI * j / h);
+            self->wi[h - 1 + j] = (float)-sin(M_PI * j / h);
+        }
+    }
+    for (i = 0; i <= self->half; i++) {
+        self->split_re[i] = (float)cos(2.0 * M_PI * i / size);
+        self->split_im[i] = (float)-sin(2.0 * M_PI * i / size);
+    }
+}
+
+void fft_destroy(fft_t *self) {
+    free(self->bitrev);
+    free(self->re);
+    free(self->im);
+    free(self->wr);
+    free(self->wi);
+    free(self->split_re);
+    free(self->split_im);
+    memset(self, 0, sizeof(*self));
+}
+
+static void fft_stage_scalar(float *re, float *im, const float *wr, const float *wi, int n, int half) {
+    int i, j;
+    for (i = 0; i < n; i += 2 * half) {
+        for (j = 0; j < half; j++) {
+            int   a  = i + j;
+            int   b  = a + half;
+            float tr = re[b] * wr[j] - im[b] * wi[j];
+            float ti = re[b] * wi[j] + im[b] * wr[j];
+            re[b] = re[a] - tr;
+            im[b] = im[a] - ti;
+            re[a] += tr;
+            im[a] += ti;
+        }
+    }
+}
+
+#if FFT_HAVE_NEON
+static void fft_stage_neon(float *re, float *im, const float *wr, const float *wi, int n, int half) {
+    if (half < 4) {
+        fft_stage_scalar(re, im, wr, wi, n, half);
+        return;
+    }
+    int i, j;
+    for (i = 0; i < n; i += 2 * half) {
+        float *ar = re + i, *ai = im + i, *br = re + i + half, *bi = im + i + half;
+        for (j = 0; j < half; j += 4) {
+            float32x4_t vwr = vld1q_f32(wr + j), vwi = vld1q_f32(wi + j);
+            float32x4_t vbr = vld1q_f32(br + j), vbi = vld1q_f32(bi + j);
+            float32x4_t var = vld1q_f32(ar + j), vai = vld1q_f32(ai + j);
+            float32x4_t tr  = vmlsq_f32(vmulq_f32(vbr, vwr), vbi, vwi);
+            float32x4_t ti  = vmlaq_f32(vmulq_f32(vbr, vwi), vbi, vwr);
+            vst1q_f32(br + j, vsubq_f32(var, tr));
+            vst1q_f32(bi + j, vsubq_f32(vai, ti));
+            vst1q_f32(ar + j, vaddq_f32(var, tr));
+            vst1q_f32(ai + j, vaddq_f32(vai, ti));
+        }
+    }
+}
+#endif
+
+#if FFT_HAVE_SSE
+static void fft_stage_sse(float *re, float *im, const float *wr, const float *wi, int n, int half) {
+    if (half < 4) {
+        fft_stage_scalar(re, im, wr, wi, n, half);
+        return;
+    }
+    int i, j;
+    for (i = 0; i < n; i += 2 * half) {
+        float *ar = re + i, *ai = im + i, *br = re + i + half, *bi = im + i + half;
+        for (j = 0; j < half; j += 4) {
+            __m128 vwr = _mm_loadu_ps(wr + j), vwi = _mm_loadu_ps(wi + j);
+            __m128 vbr = _mm_loadu_ps(br + j), vbi = _mm_loadu_ps(bi + j);
+            __m128 var = _mm_loadu_ps(ar + j), vai = _mm_loadu_ps(ai + j);
+            __m128 tr  = _mm_sub_ps(_mm_mul_ps(vbr, vwr), _mm_mul_ps(vbi, vwi));
+            __m128 ti  = _mm_add_ps(_mm_mul_ps(vbr, vwi), _mm_mul_ps(vbi, vwr));
+            _mm_storeu_ps(br + j, _mm_sub_ps(var, tr));
+            _mm_storeu_ps(bi + j, _mm_sub_ps(vai, ti));
+            _mm_storeu_ps(ar + j, _mm_add_ps(var, tr));
+            _mm_storeu_ps(ai + j, _mm_add_ps(vai, ti));
+        }
+    }
+}
+#endif
+
+// even samples go in the real part and odd in the imaginary, so one half
+// size complex transform does the work; the two interleaved spectra are
+// pulled apart again at the end
+static void fft_run(fft_t *self, const float *in, float *power, fft_stage_fn_t stage) {
+    int n = self->half;
+    int i, h;
+    for (i = 0; i < n; i++) {
+        int r = self->bitrev[i];
+        self->re[i] = in[2 * r];
+        self->im[i] = in[2 * r + 1];
+    }
+    for (h = 1; h < n; h *= 2) {
+        stage(self->re, self->im, self->wr + h - 1, self->wi + h - 1, n, h);
+    }
+
+    int k;
+    for (k = 0; k <= n; k++) {
+        int   a  = k % n;
+        int   b  = (n - k) % n;
+        // even part (Z[k] + conj Z[n-k]) / 2, odd part (Z[k] - conj Z[n-k]) / 2i
+        float er  = 0.5f * (self->re[a] + self->re[b]);
+        float ei  = 0.5f * (self->im[a] - self->im[b]);
+        float odr = 0.5f * (self->im[a] + self->im[b]);
+        float odi = -0.5f * (self->re[a] - self->re[b]);
+        float xr  = er + odr * self->split_re[k] - odi * self->split_im[k];
+        float xi  = ei + odr * self->split_im[k] + odi * self->split_re[k];
+        power[k] = xr * xr + xi * xi;
+    }
+}
+
+void fft_power_scalar(fft_t *self, const float *in, float *power) {
+    fft_run(self, in, power, fft_stage_scalar);
+}
+
+void fft_power(fft_t *self, const float *in, float *power) {
+#if FFT_HAVE_NEON
+    fft_run(self, in, power, fft_stage_neon);
+#elif FFT_HAVE_SSE
+    fft_run(self, in, power, fft_stage_sse);
+#else
+    fft_run(self, in, power, fft_stage_scalar);
+#endif
+}
+
+const char *fft_impl_name() {
+#if FFT_HAVE_NEON
+    return "neon";
+#elif FFT_HAVE_SSE
+    return "sse";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,38 @@
+#ifndef INCLUDED_FFT_H
+#define INCLUDED_FFT_H
+
+typedef struct fft fft_t;
+
+/* power spectrum of a block of real samples.
+ *
+ * the size real points are packed into size/2 complex ones and run through
+ * an iterative radix-2 FFT on split real/imaginary arrays, so the butterflies
+ * of every stage but the first two are plain 4-wide float loops. those use
+ * NEON or SSE when available, with a scalar fallback. twiddles are
+ * precomputed per stage so each stage reads them in order.
+ */
+void fft_init(fft_t *self, int size);      // size must be a power of two >= 8
+void fft_destroy(fft_t *self);
+
+/* power[k] = |X[k]|^2 for k in [0, size/2] */
+void fft_power(fft_t *self, const float *in, float *power);
+
+/* the portable reference implementation of fft_power */
+void fft_power_scalar(fft_t *self, const float *in, float *power);
+
+const char *fft_impl_name();
+
+struct fft
+{
+    int         size;           // real points
+    int         half;           // complex points
+    int        *bitrev;         // half entries
+    float      *re;             // work arrays, half entries each
+    float      *im;
+    float      *wr;             // stage twiddles, half - 1 entries: 1 for the first stage, 2 for the next...
+    float      *wi;
+    float      *split_re;       // e^-2pi*i*k/size for unpacking the real transform, half + 1 entries
+    float      *split_im;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "flacpar.h"
+#include "flacutil.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// shared worker pool: a FIFO of queued chunks from every flacpar_t
+static pthread_mutex_t   pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    pool_cond = PTHREAD_COND_INITIALIZER;
+static flacpar_chunk_t  *pool_head;
+static flacpar_chunk_t  *pool_tail;
+static int               pool_nthreads;
+
+static void *flacpar_grow(void *p, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return p;
+    size_t n = *cap ? *cap : 4096;
+    while (n < need) n *= 2;
+    p = realloc(p, n * elem);
+    if (p == NULL) failf("out of memory growing flac chunk to %d", (int)n);
+    *cap = n;
+    return p;
+}
+
+static FLAC__StreamEncoderWriteStatus flacpar_write_cb(const FLAC__StreamEncoder *encoder,
+                                                       const FLAC__byte buffer[], size_t bytes,
+                                                       unsigned samples, unsigned current_frame,
+                                                       void *client_data) {
+    flacpar_chunk_t *chunk = (flacpar_chunk_t*)client_data;
+
+    // samples == 0 means stream header/metadata, which we write ourselves
+    if (samples == 0) return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+    chunk->out = flacpar_grow(chunk->out, &chunk->out_cap, chunk->out_len + bytes, 1);
+    memcpy(chunk->out + chunk->out_len, buffer, bytes);
+    chunk->out_len += bytes;
+
+    size_t cap = chunk->frame_lens_cap;
+    chunk->frame_lens = flacpar_grow(chunk->frame_lens, &cap, chunk->nframes_out + 1, sizeof(unsigned));
+    chunk->frame_lens_cap = (int)cap;
+    chunk->frame_lens[chunk->nframes_out++] = (unsigned)bytes;
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static void flacpar_encode_chunk(FLAC__StreamEncoder *enc, flacpar_chunk_t *chunk) {
+    flacpar_t *owner = chunk->owner;
+    chunk->out_len     = 0;
+    chunk->nframes_out = 0;
+    chunk->failed      = false;
+
+    // compression level sets the blocksize too, so it has to go first
+    FLAC__stream_encoder_set_channels(enc, owner->channels);
+    FLAC__stream_encoder_set_bits_per_sample(enc, 16);
+    FLAC__stream_encoder_set_sample_rate(enc, owner->sample_rate);
+    FLAC__stream_encoder_set_compression_level(enc, chunk->level);
+    FLAC__stream_encoder_set_blocksize(enc, owner->blocksize);
+    if (owner->apodization[0] != '\0') {
+        FLAC__stream_encoder_set_apodization(enc, owner->apodization);
+    }
+    FLAC__stream_encoder_set_do_md5(enc, false);
+
+    if (FLAC__stream_encoder_init_stream(enc, flacpar_write_cb, NULL, NULL, NULL, chunk) != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+        chunk->failed = true;
+        return;
+    }
+    if (!FLAC__stream_encoder_process_interleaved(enc, chunk->samples, chunk->nframes)) {
+        chunk->failed = true;
+    }
+    if (!FLAC__stream_encoder_finish(enc)) {
+        chunk->failed = true;
+    }
+}
+
+// writes out every finished chunk that is next in line. called with owner->lock held.
+static void flacpar_drain(flacpar_t *self) {
+    while (!self->writing) {
+        flacpar_chunk_t *chunk = &self->chunks[self->write_seq % self->nchunks];
+        if (chunk->state != FLACPAR_CHUNK_DONE || chunk->seq != self->write_seq) break;
+
+        self->writing = true;
+        pthread_mutex_unlock(&self->lock);
+
+        if (chunk->failed) self->failed = true;
+
+        size_t off = 0;
+        int f;
+        for (f = 0; f < chunk->nframes_out && !self->failed; f++) {
+            unsigned len = chunk->frame_lens[f];
+            self->renumber_buf = flacpar_grow(self->renumber_buf, &self->renumber_cap, len + 8, 1);
+            size_t n = flac_renumber_frame(self->renumber_buf, chunk->out + off, len, self->next_frame);
+            if (n == 0 || !diskfile_write(self->file, self->renumber_buf, n)) {
+                self->failed = true;
+                break;
+            }
+            if (self->min_framesize == 0 || n < self->min_framesize) self->min_framesize = (unsigned)n;
+            if (n > self->max_framesize) self->max_framesize = (unsigned)n;
+            self->next_frame++;
+            off += len;
+        }
+        self->total_samples += chunk->nframes;
+
+        pthread_mutex_lock(&self->lock);
+        chunk->state = FLACPAR_CHUNK_FREE;
+        self->write_seq++;
+        self->writing = false;
+        pthread_cond_broadcast(&self->cond);
+    }
+}
+
+static void *flacpar_worker_main(void *arg) {
+    FLAC__StreamEncoder *enc = FLAC__stream_encoder_new();
+    if (enc == NULL) {
+        failf("couldn't start flac encoder");
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_head == NULL) pthread_cond_wait(&pool_cond, &pool_lock);
+        flacpar_chunk_t *chunk = pool_head;
+        pool_head = chunk->next_queued;
+        if (pool_head == NULL) pool_tail = NULL;
+        pthread_mutex_unlock(&pool_lock);
+
+        long long encode_start = now_us();
+        flacpar_encode_chunk(enc, chunk);
+
+        flacpar_t *owner = chunk->owner;
+        __atomic_add_fetch(&owner->encode_us, now_us() - encode_start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&owner->encoded_frames, (long long)chunk->nframes, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&owner->lock);
+        chunk->state = FLACPAR_CHUNK_DONE;
+        flacpar_drain(owner);
+        pthread_mutex_unlock(&owner->lock);
+    }
+    return NULL;
+}
+
+void flacpar_pool_init(int nthreads) {
+    int i;
+    for (i = 0; i < nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, flacpar_worker_main, NULL) != 0) {
+            failf("couldn't start flac worker thread");
+        }
+        pthread_detach(thread);
+    }
+    pool_nthreads += nthreads;
+}
+
+int flacpar_pool_threads() {
+    return pool_nthreads;
+}
+
+flacpar_t *flacpar_new(int channels, int sample_rate, int compression_level, int blocksize,
+                       const char *apodization, int chunk_blocks) {
+    flacpar_t *self = calloc(1, sizeof(flacpar_t));
+    if (self == NULL) return NULL;
+
+    self->channels          = channels;
+    self->sample_rate       = sample_rate;
+    self->compression_level = compression_level;
+    self->blocksize         = blocksize;
+    self->chunk_frames      = (unsigned)(blocksize * chunk_blocks);
+    if (apodization != NULL) {
+        snprintf(self->apodization, sizeof(self->apodization), "%s", apodization);
+    }
+
+    // enough for every worker to be busy while the caller fills the next one
+    self->nchunks = 2 * (pool_nthreads > 0 ? pool_nthreads : 1) + 1;
+    self->chunks  = calloc(self->nchunks, sizeof(flacpar_chunk_t));
+    if (self->chunks == NULL) failf("out of memory");
+
+    int i;
+    for (i = 0; i < self->nchunks; i++) {
+        self->chunks[i].owner   = self;
+        self->chunks[i].state   = FLACPAR_CHUNK_FREE;
+        self->chunks[i].samples = malloc(sizeof(FLAC__int32) * self->chunk_frames * channels);
+        if (self->chunks[i].samples == NULL) failf("out of memory allocating flac chunk");
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    return self;
+}
+
+void flacpar_delete(flacpar_t *self) {
+    if (self == NULL) return;
+    int i;
+    for (i = 0; i < self->nchunks; i++) {
+        free(self->chunks[i].samples);
+        free(self->chunks[i].out);
+        free(self->chunks[i].frame_lens);
+    }
+    free(self->chunks);
+    free(self->renumber_buf);
+    if (self->file != NULL) diskfile_close(self->file);
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->cond);
+    free(self);
+}
+
+void flacpar_set_level(flacpar_t *self, int compression_level) {
+    __atomic_store_n(&self->compression_level, compression_level, __ATOMIC_RELAXED);
+}
+
+void flacpar_encode_time(flacpar_t *self, long long *encode_us, long long *frames) {
+    *encode_us = __atomic_load_n(&self->encode_us, __ATOMIC_RELAXED);
+    *frames    = __atomic_load_n(&self->encoded_frames, __ATOMIC_RELAXED);
+}
+
+static void flacpar_streaminfo(flacpar_t *self, flac_streaminfo_t *info) {
+    memset(info, 0, sizeof(*info));
+    info->min_blocksize   = self->blocksize;
+    info->max_blocksize   = self->blocksize;
+    info->min_framesize   = self->min_framesize;
+    info->max_framesize   = self->max_framesize;
+    info->sample_rate     = self->sample_rate;
+    info->channels        = self->channels;
+    info->bits_per_sample = 16;
+    info->total_samples   = self->total_samples;
+}
+
+bool flacpar_init_diskfile(flacpar_t *self, diskfile_t *file) {
+    if (pool_nthreads == 0) {
+        failf("flacpar_pool_init wasn't called");
+    }
+    self->file = file;
+
+    uint8_t header[FLAC_STREAMINFO_HEADER_BYTES];
+    flac_streaminfo_t info;
+    flacpar_streaminfo(self, &info);
+    flac_write_stream_header(header, &info);
+    return diskfile_write(file, header, sizeof(header));
+}
+
+// hands the chunk being filled to the pool. called with self->lock held.
+static void flacpar_submit(flacpar_t *self) {
+    flacpar_chunk_t *chunk = self->filling;
+    self->filling = NULL;
+    chunk->state       = FLACPAR_CHUNK_QUEUED;
+    chunk->level       = __atomic_load_n(&self->compression_level, __ATOMIC_RELAXED);
+    chunk->next_queued = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_tail) pool_tail->next_queued = chunk;
+    else           pool_head = chunk;
+    pool_tail = chunk;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+bool flacpar_process_interleaved(flacpar_t *self, const FLAC__int32 *buffer, unsigned nframes) {
+    while (nframes > 0) {
+        if (self->filling == NULL) {
+            pthread_mutex_lock(&self->lock);
+            flacpar_chunk_t *chunk = &self->chunks[self->fill_seq % self->nchunks];
+            while (chunk->state != FLACPAR_CHUNK_FREE) pthread_cond_wait(&self->cond, &self->lock);
+            pthread_mutex_unlock(&self->lock);
+
+            chunk->state   = FLACPAR_CHUNK_FILLING;
+            chunk->seq     = self->fill_seq++;
+            chunk->nframes = 0;
+            self->filling  = chunk;
+        }
+        if (self->failed) return false;
+
+        flacpar_chunk_t *chunk = self->filling;
+        unsigned n = self->chunk_frames - chunk->nframes;
+        if (n > nframes) n = nframes;
+        memcpy(chunk->samples + (size_t)chunk->nframes * self->channels, buffer, sizeof(FLAC__int32) * n * self->channels);
+        chunk->nframes += n;
+        buffer         += (size_t)n * self->channels;
+        nframes        -= n;
+
+        if (chunk->nframes == self->chunk_frames) {
+            pthread_mutex_lock(&self->lock);
+            flacpar_submit(self);
+            pthread_mutex_unlock(&self->lock);
+        }
+    }
+    return true;
+}
+
+bool flacpar_finish(flacpar_t *self) {
+    pthread_mutex_lock(&self->lock);
+    if (self->filling != NULL) {
+        if (self->filling->nframes > 0) {
+            flacpar_submit(self);
+        } else {
+            self->filling->state = FLACPAR_CHUNK_FREE;
+            self->filling = NULL;
+            self->fill_seq--;
+        }
+    }
+    while (self->write_seq != self->fill_seq) pthread_cond_wait(&self->cond, &self->lock);
+    pthread_mutex_unlock(&self->lock);
+
+    bool ok = !self->failed;
+
+    // go back and fill in the real STREAMINFO
+    uint8_t streaminfo[34];
+    flac_streaminfo_t info;
+    flacpar_streaminfo(self, &info);
+    flac_write_streaminfo(streaminfo, &info);
+    if (!diskfile_seek(self->file, FLAC_STREAMINFO_OFFSET) ||
+        !diskfile_write(self->file, streaminfo, sizeof(streaminfo))) {
+        ok = false;
+    }
+    if (!diskfile_close(self->file)) ok = false;
+    self->file = NULL;
+    return ok;
+}
@@ -0,0 +1,122 @@
+#ifndef INCLUDED_FLACPAR_H
+#define INCLUDED_FLACPAR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <FLAC/all.h>
+
+#include "diskwriter.h"
+
+typedef struct flacpar flacpar_t;
+typedef struct flacpar_chunk flacpar_chunk_t;
+
+/* parallel FLAC encoding.
+ *
+ * audio is cut into chunks of chunk_blocks * blocksize frames. each chunk is
+ * encoded by a separate libflac encoder on a shared worker pool, then its
+ * frames are renumbered and written out in order, so the result is a single
+ * ordinary fixed-blocksize FLAC stream. since every frame is independent in
+ * FLAC, this gives exactly the same frames libflac would have produced on
+ * one thread (except the MD5 in STREAMINFO, which is left unset).
+ *
+ * the calls mirror the libflac stream encoder: new, init, process,
+ * finish, delete. a flacpar_t must only be used by one thread at a time.
+ */
+
+/* starts the shared worker pool. must be called once before flacpar_new. */
+void flacpar_pool_init(int nthreads);
+int  flacpar_pool_threads();
+
+/* apodization may be NULL for libflac's default at each level */
+flacpar_t *flacpar_new(int channels, int sample_rate, int compression_level, int blocksize,
+                       const char *apodization, int chunk_blocks);
+void       flacpar_delete(flacpar_t *self);
+
+/* changes the compression level for chunks queued from now on. the
+ * blocksize can't change within a stream, but the level can.
+ */
+void flacpar_set_level(flacpar_t *self, int compression_level);
+
+/* total wall clock time workers have spent encoding this stream's chunks,
+ * and how many frames those chunks held. safe to call from any thread.
+ */
+void flacpar_encode_time(flacpar_t *self, long long *encode_us, long long *frames);
+
+/* writes the stream header to file and takes ownership of it */
+bool flacpar_init_diskfile(flacpar_t *self, diskfile_t *file);
+
+/* queues nframes of interleaved audio. blocks only if every chunk is still
+ * waiting to be encoded or written.
+ */
+bool flacpar_process_interleaved(flacpar_t *self, const FLAC__int32 *buffer, unsigned nframes);
+
+/* encodes whatever is left, waits for all of it to be written, rewrites
+ * STREAMINFO and closes the file.
+ */
+bool flacpar_finish(flacpar_t *self);
+
+typedef enum {
+    FLACPAR_CHUNK_FREE,
+    FLACPAR_CHUNK_FILLING,
+    FLACPAR_CHUNK_QUEUED,
+    FLACPAR_CHUNK_DONE,
+} flacpar_chunk_state_t;
+
+struct flacpar_chunk
+{
+    flacpar_t              *owner;
+    flacpar_chunk_state_t   state;
+    long long               seq;
+    int                     level;              // compression level this chunk is encoded at
+    FLAC__int32            *samples;
+    unsigned                nframes;
+    bool                    failed;
+
+    // encoded frames, back to back, and the length of each
+    uint8_t                *out;
+    size_t                  out_len;
+    size_t                  out_cap;
+    unsigned               *frame_lens;
+    int                     nframes_out;
+    int                     frame_lens_cap;
+
+    flacpar_chunk_t        *next_queued;        // pool queue link
+};
+
+struct flacpar
+{
+    int                     channels;
+    int                     sample_rate;
+    int                     compression_level;
+    int                     blocksize;
+    char                    apodization[128];   // empty for libflac's default
+    unsigned                chunk_frames;
+
+    // updated atomically by the workers
+    long long               encode_us;
+    long long               encoded_frames;
+
+    diskfile_t             *file;
+    bool                    failed;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;               // a chunk was written + freed
+    flacpar_chunk_t        *chunks;
+    int                     nchunks;
+    flacpar_chunk_t        *filling;            // chunk being filled by the caller, or NULL
+    long long               fill_seq;           // seq the next chunk to fill gets
+    long long               write_seq;          // seq of the next chunk to write
+    bool                    writing;            // a worker is writing chunks right now
+
+    // only touched by whoever holds `writing`
+    uint64_t                next_frame;
+    uint64_t                total_samples;
+    unsigned                min_framesize;
+    unsigned                max_framesize;
+    uint8_t                *renumber_buf;
+    size_t                  renumber_cap;
+};
+
+#endif
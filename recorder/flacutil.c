@@ -0,0 +1,277 @@
+#include "flacutil.h"
+
+#include <string.h>
+
+static uint8_t  crc8_table[256];
+static uint16_t crc16_table[256];
+static bool     crc_tables_ready;
+
+static void flac_init_crc_tables() {
+    int i, bit;
+    for (i = 0; i < 256; i++) {
+        uint8_t c8 = (uint8_t)i;
+        for (bit = 0; bit < 8; bit++) {
+            c8 = (c8 & 0x80) ? (uint8_t)((c8 << 1) ^ 0x07) : (uint8_t)(c8 << 1);
+        }
+        crc8_table[i] = c8;
+
+        uint16_t c16 = (uint16_t)(i << 8);
+        for (bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 0x8000) ? (uint16_t)((c16 << 1) ^ 0x8005) : (uint16_t)(c16 << 1);
+        }
+        crc16_table[i] = c16;
+    }
+    // building the tables twice from two threads produces the same bytes
+    __atomic_store_n(&crc_tables_ready, true, __ATOMIC_RELEASE);
+}
+
+uint8_t flac_crc8(const uint8_t *data, size_t len) {
+    if (!__atomic_load_n(&crc_tables_ready, __ATOMIC_ACQUIRE)) flac_init_crc_tables();
+    uint8_t crc = 0;
+    while (len--) crc = crc8_table[crc ^ *data++];
+    return crc;
+}
+
+uint16_t flac_crc16(uint16_t crc, const uint8_t *data, size_t len) {
+    if (!__atomic_load_n(&crc_tables_ready, __ATOMIC_ACQUIRE)) flac_init_crc_tables();
+    while (len--) crc = (uint16_t)((crc << 8) ^ crc16_table[(crc >> 8) ^ *data++]);
+    return crc;
+}
+
+void flac_write_streaminfo(uint8_t *p, const flac_streaminfo_t *info) {
+    p[0]  = (uint8_t)(info->min_blocksize >> 8);
+    p[1]  = (uint8_t)(info->min_blocksize);
+    p[2]  = (uint8_t)(info->max_blocksize >> 8);
+    p[3]  = (uint8_t)(info->max_blocksize);
+    p[4]  = (uint8_t)(info->min_framesize >> 16);
+    p[5]  = (uint8_t)(info->min_framesize >> 8);
+    p[6]  = (uint8_t)(info->min_framesize);
+    p[7]  = (uint8_t)(info->max_framesize >> 16);
+    p[8]  = (uint8_t)(info->max_framesize >> 8);
+    p[9]  = (uint8_t)(info->max_framesize);
+    // 20 bits rate, 3 bits channels-1, 5 bits bps-1, 36 bits total samples
+    p[10] = (uint8_t)(info->sample_rate >> 12);
+    p[11] = (uint8_t)(info->sample_rate >> 4);
+    p[12] = (uint8_t)(((info->sample_rate & 0x0f) << 4) | (((info->channels - 1) & 0x07) << 1) | (((info->bits_per_sample - 1) >> 4) & 0x01));
+    p[13] = (uint8_t)((((info->bits_per_sample - 1) & 0x0f) << 4) | ((info->total_samples >> 32) & 0x0f));
+    p[14] = (uint8_t)(info->total_samples >> 24);
+    p[15] = (uint8_t)(info->total_samples >> 16);
+    p[16] = (uint8_t)(info->total_samples >> 8);
+    p[17] = (uint8_t)(info->total_samples);
+    memcpy(p + 18, info->md5, 16);
+}
+
+void flac_read_streaminfo(const uint8_t *p, flac_streaminfo_t *info) {
+    info->min_blocksize   = (p[0] << 8) | p[1];
+    info->max_blocksize   = (p[2] << 8) | p[3];
+    info->min_framesize   = (p[4] << 16) | (p[5] << 8) | p[6];
+    info->max_framesize   = (p[7] << 16) | (p[8] << 8) | p[9];
+    info->sample_rate     = (p[10] << 12) | (p[11] << 4) | (p[12] >> 4);
+    info->channels        = ((p[12] >> 1) & 0x07) + 1;
+    info->bits_per_sample = (((p[12] & 0x01) << 4) | (p[13] >> 4)) + 1;
+    info->total_samples   = ((uint64_t)(p[13] & 0x0f) << 32) | ((uint64_t)p[14] << 24) |
+                            ((uint64_t)p[15] << 16) | ((uint64_t)p[16] << 8) | (uint64_t)p[17];
+    memcpy(info->md5, p + 18, 16);
+}
+
+void flac_write_stream_header(uint8_t *out, const flac_streaminfo_t *info) {
+    memcpy(out, "fLaC", 4);
+    out[4] = 0x80;          // last metadata block, type 0 (STREAMINFO)
+    out[5] = 0;
+    out[6] = 0;
+    out[7] = 34;
+    flac_write_streaminfo(out + FLAC_STREAMINFO_OFFSET, info);
+}
+
+// frame/sample numbers use the same variable length coding as UTF-8, extended to 36 bits
+static size_t flac_encode_number(uint8_t *out, uint64_t v) {
+    if (v < 0x80) { out[0] = (uint8_t)v; return 1; }
+    int n;
+    if      (v < 0x800)       n = 2;
+    else if (v < 0x10000)     n = 3;
+    else if (v < 0x200000)    n = 4;
+    else if (v < 0x4000000)   n = 5;
+    else if (v < 0x80000000u) n = 6;
+    else                      n = 7;
+    int i;
+    for (i = n - 1; i > 0; i--) {
+        out[i] = (uint8_t)(0x80 | (v & 0x3f));
+        v >>= 6;
+    }
+    out[0] = (uint8_t)((0xff00 >> n) | v);
+    return n;
+}
+
+static size_t flac_decode_number(const uint8_t *in, size_t len, uint64_t *v) {
+    if (len == 0) return 0;
+    uint8_t b = in[0];
+    if (!(b & 0x80)) { *v = b; return 1; }
+    size_t n = 0;
+    while (n < 8 && (b & (0x80 >> n))) n++;
+    if (n < 2 || n > 7 || n > len) return 0;
+    uint64_t x = n == 7 ? 0 : (b & (0xff >> (n + 1)));
+    size_t i;
+    for (i = 1; i < n; i++) {
+        if ((in[i] & 0xc0) != 0x80) return 0;
+        x = (x << 6) | (in[i] & 0x3f);
+    }
+    *v = x;
+    return n;
+}
+
+static const unsigned flac_sample_rates[12] = {
+    0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000
+};
+
+static const unsigned flac_sample_sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+
+bool flac_parse_frame_header(const uint8_t *buf, size_t len, flac_frame_header_t *hdr) {
+    if (len < 6) return false;
+    if (buf[0] != 0xff || (buf[1] & 0xfe) != 0xf8) return false;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->variable_blocksize = buf[1] & 0x01;
+
+    unsigned bs_code   = buf[2] >> 4;
+    unsigned rate_code = buf[2] & 0x0f;
+    unsigned ch_code   = buf[3] >> 4;
+    unsigned size_code = (buf[3] >> 1) & 0x07;
+    if (bs_code == 0 || rate_code == 15 || ch_code > 10 || size_code == 3 || (buf[3] & 0x01)) return false;
+
+    hdr->number_offset = 4;
+    hdr->number_len    = flac_decode_number(buf + 4, len - 4, &hdr->number);
+    if (hdr->number_len == 0) return false;
+    if (!hdr->variable_blocksize && hdr->number_len > 6) return false;
+
+    size_t pos = 4 + hdr->number_len;
+    if (bs_code == 1) {
+        hdr->blocksize = 192;
+    } else if (bs_code <= 5) {
+        hdr->blocksize = 576 << (bs_code - 2);
+    } else if (bs_code == 6) {
+        if (pos + 1 > len) return false;
+        hdr->blocksize = buf[pos] + 1;
+        pos += 1;
+    } else if (bs_code == 7) {
+        if (pos + 2 > len) return false;
+        hdr->blocksize = ((buf[pos] << 8) | buf[pos + 1]) + 1;
+        pos += 2;
+    } else {
+        hdr->blocksize = 256 << (bs_code - 8);
+    }
+
+    if (rate_code < 12) {
+        hdr->sample_rate = flac_sample_rates[rate_code];
+    } else if (rate_code == 12) {
+        if (pos + 1 > len) return false;
+        hdr->sample_rate = buf[pos] * 1000;
+        pos += 1;
+    } else {
+        if (pos + 2 > len) return false;
+        hdr->sample_rate = (buf[pos] << 8) | buf[pos + 1];
+        if (rate_code == 14) hdr->sample_rate *= 10;
+        pos += 2;
+    }
+
+    hdr->channels        = ch_code < 8 ? ch_code + 1 : 2;
+    hdr->bits_per_sample = flac_sample_sizes[size_code];
+
+    if (pos + 1 > len) return false;
+    if (flac_crc8(buf, pos) != buf[pos]) return false;
+    hdr->header_len = pos + 1;
+    return true;
+}
+
+size_t flac_renumber_frame(uint8_t *dst, const uint8_t *src, size_t src_len, uint64_t number) {
+    flac_frame_header_t hdr;
+    if (!flac_parse_frame_header(src, src_len, &hdr) || hdr.variable_blocksize) return 0;
+    if (src_len < hdr.header_len + 2) return 0;
+
+    size_t out = 0;
+    memcpy(dst, src, hdr.number_offset);
+    out += hdr.number_offset;
+    out += flac_encode_number(dst + out, number);
+
+    // optional blocksize/sample rate fields sit between the number and the CRC-8
+    size_t tail_start = hdr.number_offset + hdr.number_len;
+    size_t tail_len   = hdr.header_len - 1 - tail_start;
+    memcpy(dst + out, src + tail_start, tail_len);
+    out += tail_len;
+    dst[out] = flac_crc8(dst, out);
+    out++;
+
+    // subframes are byte aligned after the header and don't change
+    size_t body_len = src_len - hdr.header_len - 2;
+    memcpy(dst + out, src + hdr.header_len, body_len);
+    out += body_len;
+
+    uint16_t crc = flac_crc16(0, dst, out);
+    dst[out++] = (uint8_t)(crc >> 8);
+    dst[out++] = (uint8_t)(crc);
+    return out;
+}
+
+// the longest fixed-blocksize frame header: sync, 6 byte number, 16 bit
+// blocksize and sample rate, CRC-8
+#define FLAC_MAX_FRAME_HEADER (16)
+
+// a frame runs up to the next frame's sync code, at a point where the CRC-16
+// of everything since its own sync comes out 0 (its stored CRC included)
+static size_t flac_frame_end(const uint8_t *buf, size_t len, size_t start, const flac_frame_header_t *hdr) {
+    uint16_t crc = flac_crc16(0, buf + start, hdr->header_len);
+    size_t   pos = start + hdr->header_len;
+    while (pos < len) {
+        const uint8_t *ff = memchr(buf + pos, 0xff, len - pos);
+        size_t next = ff != NULL ? (size_t)(ff - buf) : len;
+        crc = flac_crc16(crc, buf + pos, next - pos);
+        pos = next;
+        if (pos == len) break;
+
+        if (crc == 0 && pos + 1 < len && buf[pos + 1] == 0xf8) {
+            flac_frame_header_t following;
+            if (flac_parse_frame_header(buf + pos, len - pos, &following)) {
+                if (following.number == hdr->number + 1) return pos;
+            } else if (len - pos < FLAC_MAX_FRAME_HEADER) {
+                return pos;         // the next frame was cut off in its header
+            }
+        }
+        crc = flac_crc16(crc, buf + pos, 1);
+        pos++;
+    }
+    return crc == 0 ? len : 0;
+}
+
+size_t flac_scan_frames(const uint8_t *buf, size_t len, flac_streaminfo_t *info) {
+    if (len < FLAC_STREAMINFO_HEADER_BYTES || memcmp(buf, "fLaC", 4) != 0 || (buf[4] & 0x7f) != 0) return 0;
+    flac_read_streaminfo(buf + FLAC_STREAMINFO_OFFSET, info);
+
+    size_t pos = 4;
+    bool   last;
+    do {
+        if (pos + 4 > len) return 0;
+        last = buf[pos] & 0x80;
+        pos += 4 + ((buf[pos + 1] << 16) | (buf[pos + 2] << 8) | buf[pos + 3]);
+        if (pos > len) return 0;
+    } while (!last);
+
+    info->total_samples = 0;
+    info->min_framesize = 0;
+    info->max_framesize = 0;
+    memset(info->md5, 0, sizeof(info->md5));
+
+    uint64_t number = 0;
+    while (pos < len) {
+        flac_frame_header_t hdr;
+        if (!flac_parse_frame_header(buf + pos, len - pos, &hdr) || hdr.variable_blocksize || hdr.number != number) break;
+        size_t end = flac_frame_end(buf, len, pos, &hdr);
+        if (end == 0) break;
+
+        unsigned framesize = (unsigned)(end - pos);
+        if (info->min_framesize == 0 || framesize < info->min_framesize) info->min_framesize = framesize;
+        if (framesize > info->max_framesize) info->max_framesize = framesize;
+        info->total_samples += hdr.blocksize;
+        number++;
+        pos = end;
+    }
+    return pos;
+}
@@ -0,0 +1,78 @@
+#ifndef INCLUDED_FLACUTIL_H
+#define INCLUDED_FLACUTIL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* helpers for working with FLAC at the byte level, for the things libflac
+ * doesn't expose: stitching independently encoded frames into one stream
+ * and repairing streams that were cut off.
+ */
+
+typedef struct {
+    unsigned    min_blocksize;
+    unsigned    max_blocksize;
+    unsigned    min_framesize;      // 0 means unknown
+    unsigned    max_framesize;      // 0 means unknown
+    unsigned    sample_rate;
+    unsigned    channels;
+    unsigned    bits_per_sample;
+    uint64_t    total_samples;      // 0 means unknown
+    uint8_t     md5[16];            // all zeros means unknown
+} flac_streaminfo_t;
+
+// "fLaC" + a last-metadata-block header + STREAMINFO
+#define FLAC_STREAMINFO_HEADER_BYTES (4 + 4 + 34)
+
+// offset of the STREAMINFO body from the start of the stream
+#define FLAC_STREAMINFO_OFFSET       (8)
+
+typedef struct {
+    bool        variable_blocksize;
+    uint64_t    number;             // frame number, or first sample number if variable_blocksize
+    unsigned    blocksize;          // samples per channel
+    unsigned    sample_rate;        // 0 means "from STREAMINFO"
+    unsigned    channels;
+    unsigned    bits_per_sample;    // 0 means "from STREAMINFO"
+    size_t      number_offset;      // where the coded number starts
+    size_t      number_len;         // how many bytes it takes
+    size_t      header_len;         // up to and including the CRC-8
+} flac_frame_header_t;
+
+uint8_t  flac_crc8(const uint8_t *data, size_t len);
+uint16_t flac_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+/* serializes "fLaC" + STREAMINFO as the only metadata block into out, which
+ * must hold FLAC_STREAMINFO_HEADER_BYTES.
+ */
+void flac_write_stream_header(uint8_t *out, const flac_streaminfo_t *info);
+
+/* serializes just the 34 byte STREAMINFO body */
+void flac_write_streaminfo(uint8_t *out, const flac_streaminfo_t *info);
+
+/* parses the 34 byte STREAMINFO body */
+void flac_read_streaminfo(const uint8_t *in, flac_streaminfo_t *info);
+
+/* parses and CRC checks a frame header. returns false if buf doesn't start
+ * with a valid one.
+ */
+bool flac_parse_frame_header(const uint8_t *buf, size_t len, flac_frame_header_t *hdr);
+
+/* copies the frame in src (src_len bytes, header + subframes + CRC-16) to
+ * dst with its frame number replaced by number, fixing both CRCs. dst must
+ * have room for src_len + 6. returns the new length, or 0 if src isn't a
+ * valid fixed-blocksize frame.
+ */
+size_t flac_renumber_frame(uint8_t *dst, const uint8_t *src, size_t src_len, uint64_t number);
+
+/* finds how much of a stream that may have been cut off mid-write is
+ * intact: the metadata blocks, then fixed-blocksize frames for as long as
+ * each one's header and CRC-16 check out and the frame numbers run on.
+ * fills info from STREAMINFO plus what was found (total_samples and the
+ * frame sizes; md5 is cleared) and returns where the last complete frame
+ * ends, or 0 if buf doesn't start like a FLAC stream.
+ */
+size_t flac_scan_frames(const uint8_t *buf, size_t len, flac_streaminfo_t *info);
+
+#endif
@@ -0,0 +1,84 @@
+#include "histo.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+void histo_init(histo_t *self, const char *name) {
+    memset(self, 0, sizeof(*self));
+    self->name = name;
+}
+
+// values below HISTO_SUB_BUCKETS get a bucket each. above that, the top
+// HISTO_SUB_BITS bits after the leading one pick the bucket within its power of two.
+static int histo_bucket(long long us) {
+    if (us < HISTO_SUB_BUCKETS) return us < 0 ? 0 : (int)us;
+    int exponent = 63 - __builtin_clzll((unsigned long long)us);
+    if (exponent > HISTO_MAX_EXPONENT) return -1;
+    int sub = (int)(us >> (exponent - HISTO_SUB_BITS)) - HISTO_SUB_BUCKETS;
+    return (exponent - HISTO_SUB_BITS + 1) * HISTO_SUB_BUCKETS + sub;
+}
+
+static long long histo_bucket_upper(int bucket) {
+    if (bucket < HISTO_SUB_BUCKETS) return bucket;
+    int exponent = bucket / HISTO_SUB_BUCKETS + HISTO_SUB_BITS - 1;
+    int sub      = bucket % HISTO_SUB_BUCKETS;
+    long long width = 1LL << (exponent - HISTO_SUB_BITS);
+    return (HISTO_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+void histo_record(histo_t *self, long long us) {
+    int bucket = histo_bucket(us);
+    if (bucket < 0) {
+        __atomic_fetch_add(&self->overflow, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&self->buckets[bucket], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&self->count, 1, __ATOMIC_RELAXED);
+
+    long long max = __atomic_load_n(&self->max, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&self->max, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// racing writers may lose a few samples; fine for monitoring
+void histo_reset(histo_t *self) {
+    int i;
+    for (i = 0; i < HISTO_NBUCKETS; i++) __atomic_store_n(&self->buckets[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->overflow, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->count,    0, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->max,      0, __ATOMIC_RELAXED);
+}
+
+long long histo_percentile(histo_t *self, double p) {
+    // sum the buckets rather than trusting count, which may be mid-update
+    unsigned long long counts[HISTO_NBUCKETS];
+    unsigned long long total = 0;
+    int i;
+    for (i = 0; i < HISTO_NBUCKETS; i++) {
+        counts[i] = __atomic_load_n(&self->buckets[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    total += __atomic_load_n(&self->overflow, __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+
+    unsigned long long rank = (unsigned long long)(p * total + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (i = 0; i < HISTO_NBUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) break;
+    }
+    long long max = __atomic_load_n(&self->max, __ATOMIC_RELAXED);
+    if (i == HISTO_NBUCKETS) return max;
+    long long upper = histo_bucket_upper(i);
+    return upper < max ? upper : max;
+}
+
+void histo_format(histo_t *self, char *buf, int len) {
+    snprintf(buf, len, "%s count %llu p50 %lldus p99 %lldus max %lldus overflow %llu", self->name,
+             __atomic_load_n(&self->count, __ATOMIC_RELAXED),
+             histo_percentile(self, 0.50), histo_percentile(self, 0.99),
+             __atomic_load_n(&self->max, __ATOMIC_RELAXED),
+             __atomic_load_n(&self->overflow, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,42 @@
+#ifndef INCLUDED_HISTO_H
+#define INCLUDED_HISTO_H
+
+typedef struct histo histo_t;
+
+/* lock-free log-linear latency histogram, in microseconds.
+ *
+ * every power of two is split into HISTO_SUB_BUCKETS linear buckets, so
+ * percentiles are accurate to within 1/HISTO_SUB_BUCKETS (12.5%) from 1us up
+ * to a few hours. anything longer counts as overflow.
+ *
+ * histo_record may be called from any number of threads at once, including
+ * the audio loop: it is a few relaxed atomic adds, no locks and no syscalls.
+ * readers see a consistent-enough snapshot for monitoring.
+ */
+void histo_init(histo_t *self, const char *name);
+void histo_record(histo_t *self, long long us);
+void histo_reset(histo_t *self);
+
+/* the upper bound of the bucket holding the p'th fraction (0-1) of samples,
+ * or 0 if there are none.
+ */
+long long histo_percentile(histo_t *self, double p);
+
+/* "<name> count N p50 Xus p99 Yus max Zus overflow O" */
+void histo_format(histo_t *self, char *buf, int len);
+
+#define HISTO_SUB_BITS      (3)
+#define HISTO_SUB_BUCKETS   (1 << HISTO_SUB_BITS)
+#define HISTO_MAX_EXPONENT  (34)     // 2^35us is about 9.5 hours
+#define HISTO_NBUCKETS      ((HISTO_MAX_EXPONENT - HISTO_SUB_BITS + 2) * HISTO_SUB_BUCKETS)
+
+struct histo
+{
+    const char         *name;
+    unsigned long long  count;
+    unsigned long long  overflow;
+    long long           max;
+    unsigned long long  buckets[HISTO_NBUCKETS];
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "levels.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    include <arm_neon.h>
+#    define LEVELS_HAVE_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define LEVELS_HAVE_X86  1
+#endif
+
+// the simd kernels count clips in 16 bit lanes, so flush them before they can wrap
+#define LEVELS_BLOCK_VECTORS (16384)
+
+typedef void (*levels_fn_t)(levels_t *self, const short *samples, int nsamples);
+
+void levels_reset(levels_t *self, int channels) {
+    memset(self, 0, sizeof(*self));
+    self->channels = channels;
+}
+
+void levels_merge(levels_t *self, const levels_t *src) {
+    int ch;
+    for (ch = 0; ch < self->channels; ch++) {
+        if (src->peak[ch] > self->peak[ch]) self->peak[ch] = src->peak[ch];
+    }
+    if (src->min < self->min) self->min = src->min;
+    if (src->max > self->max) self->max = src->max;
+    self->sum_squares += src->sum_squares;
+    self->clip_pos    += src->clip_pos;
+    self->clip_neg    += src->clip_neg;
+    self->nsamples    += src->nsamples;
+}
+
+void levels_accumulate_scalar(levels_t *self, const short *samples, int nsamples) {
+    int       channels = self->channels;
+    long long accum    = 0;
+    int       clip_pos = 0;
+    int       clip_neg = 0;
+    int       min      = self->min;
+    int       max      = self->max;
+    int       i, ch;
+    for (i = 0; i < nsamples; i += channels) {
+        for (ch = 0; ch < channels; ch++) {
+            int s = samples[i + ch];
+            accum += s * s;
+            int a = s < 0 ? -s : s;
+            if (a > self->peak[ch]) self->peak[ch] = a;
+            if (s < min) min = s;
+            if (s > max) max = s;
+            if (s > LEVELS_CLIP_POS) clip_pos++;
+            if (s < LEVELS_CLIP_NEG) clip_neg++;
+        }
+    }
+    self->min          = min;
+    self->max          = max;
+    self->sum_squares += accum;
+    self->clip_pos    += clip_pos;
+    self->clip_neg    += clip_neg;
+    self->nsamples    += nsamples;
+}
+
+// folds per-lane min/max into per-channel peaks and the overall min/max. lane l always holds channel l % channels.
+static void levels_fold_lanes(levels_t *self, const short *mx, const short *mn, int nlanes) {
+    int l;
+    for (l = 0; l < nlanes; l++) {
+        int ch = l % self->channels;
+        int a  = mx[l];
+        int b  = -(int)mn[l];
+        if (mn[l] < self->min) self->min = mn[l];
+        if (mx[l] > self->max) self->max = mx[l];
+        if (b > a) a = b;
+        if (a > self->peak[ch]) self->peak[ch] = a;
+    }
+}
+
+#if LEVELS_HAVE_NEON
+static void levels_accumulate_neon(levels_t *self, const short *samples, int nsamples) {
+    int n = (8 % self->channels) ? 0 : (nsamples & ~7);
+    int i = 0;
+
+    int16x8_t vmax  = vdupq_n_s16(-32768);
+    int16x8_t vmin  = vdupq_n_s16(32767);
+    int16x8_t hi    = vdupq_n_s16(LEVELS_CLIP_POS);
+    int16x8_t lo    = vdupq_n_s16(LEVELS_CLIP_NEG);
+    int64x2_t acc   = vdupq_n_s64(0);
+    long long clip_pos = 0, clip_neg = 0;
+
+    while (i < n) {
+        int end = n - i > LEVELS_BLOCK_VECTORS * 8 ? i + LEVELS_BLOCK_VECTORS * 8 : n;
+        uint16x8_t cpos = vdupq_n_u16(0);
+        uint16x8_t cneg = vdupq_n_u16(0);
+        for (; i < end; i += 8) {
+            int16x8_t v = vld1q_s16(samples + i);
+            acc  = vpadalq_s32(acc, vmull_s16(vget_low_s16(v),  vget_low_s16(v)));
+            acc  = vpadalq_s32(acc, vmull_s16(vget_high_s16(v), vget_high_s16(v)));
+            vmax = vmaxq_s16(vmax, v);
+            vmin = vminq_s16(vmin, v);
+            cpos = vsubq_u16(cpos, vcgtq_s16(v, hi));
+            cneg = vsubq_u16(cneg, vcltq_s16(v, lo));
+        }
+        uint64x2_t p = vpaddlq_u32(vpaddlq_u16(cpos));
+        uint64x2_t q = vpaddlq_u32(vpaddlq_u16(cneg));
+        clip_pos += vgetq_lane_u64(p, 0) + vgetq_lane_u64(p, 1);
+        clip_neg += vgetq_lane_u64(q, 0) + vgetq_lane_u64(q, 1);
+    }
+
+    short mx[8], mn[8];
+    vst1q_s16(mx, vmax);
+    vst1q_s16(mn, vmin);
+    if (n > 0) levels_fold_lanes(self, mx, mn, 8);
+
+    self->sum_squares += vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+    self->clip_pos    += (int)clip_pos;
+    self->clip_neg    += (int)clip_neg;
+    self->nsamples    += n;
+
+    levels_accumulate_scalar(self, samples + n, nsamples - n);
+}
+#endif
+
+#if LEVELS_HAVE_X86
+static void levels_accumulate_sse2(levels_t *self, const short *samples, int nsamples) {
+    int n = (8 % self->channels) ? 0 : (nsamples & ~7);
+    int i = 0;
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i vmax = _mm_set1_epi16(-32768);
+    __m128i vmin = _mm_set1_epi16(32767);
+    __m128i hi   = _mm_set1_epi16(LEVELS_CLIP_POS);
+    __m128i lo   = _mm_set1_epi16(LEVELS_CLIP_NEG);
+    __m128i acc  = zero;
+    __m128i cnt  = zero;       // 32 bit clip totals: [pos, pos, neg, neg] after the unpack below
+
+    while (i < n) {
+        int end = n - i > LEVELS_BLOCK_VECTORS * 8 ? i + LEVELS_BLOCK_VECTORS * 8 : n;
+        __m128i cpos = zero;
+        __m128i cneg = zero;
+        for (; i < end; i += 8) {
+            __m128i v  = _mm_loadu_si128((const __m128i*)(samples + i));
+            // pairs of squares fit in an unsigned 32 bit lane, so widen with zeros
+            __m128i sq = _mm_madd_epi16(v, v);
+            acc  = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+            acc  = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+            vmax = _mm_max_epi16(vmax, v);
+            vmin = _mm_min_epi16(vmin, v);
+            cpos = _mm_sub_epi16(cpos, _mm_cmpgt_epi16(v, hi));
+            cneg = _mm_sub_epi16(cneg, _mm_cmplt_epi16(v, lo));
+        }
+        __m128i p = _mm_madd_epi16(cpos, ones);
+        __m128i q = _mm_madd_epi16(cneg, ones);
+        cnt = _mm_add_epi32(cnt, _mm_unpacklo_epi64(_mm_add_epi32(p, _mm_srli_si128(p, 8)),
+                                                     _mm_add_epi32(q, _mm_srli_si128(q, 8))));
+    }
+
+    short mx[8], mn[8];
+    int   c[4];
+    long long a[2];
+    _mm_storeu_si128((__m128i*)mx, vmax);
+    _mm_storeu_si128((__m128i*)mn, vmin);
+    _mm_storeu_si128((__m128i*)c, cnt);
+    _mm_storeu_si128((__m128i*)a, acc);
+    if (n > 0) levels_fold_lanes(self, mx, mn, 8);
+
+    self->sum_squares += a[0] + a[1];
+    self->clip_pos    += c[0] + c[1];
+    self->clip_neg    += c[2] + c[3];
+    self->nsamples    += n;
+
+    levels_accumulate_scalar(self, samples + n, nsamples - n);
+}
+
+__attribute__((target("avx2")))
+static void levels_accumulate_avx2(levels_t *self, const short *samples, int nsamples) {
+    int n = (16 % self->channels) ? 0 : (nsamples & ~15);
+    int i = 0;
+
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i vmax = _mm256_set1_epi16(-32768);
+    __m256i vmin = _mm256_set1_epi16(32767);
+    __m256i hi   = _mm256_set1_epi16(LEVELS_CLIP_POS);
+    __m256i lo   = _mm256_set1_epi16(LEVELS_CLIP_NEG);
+    __m256i acc  = zero;
+    __m256i cpos32 = zero;
+    __m256i cneg32 = zero;
+
+    while (i < n) {
+        int end = n - i > LEVELS_BLOCK_VECTORS * 16 ? i + LEVELS_BLOCK_VECTORS * 16 : n;
+        __m256i cpos = zero;
+        __m256i cneg = zero;
+        for (; i < end; i += 16) {
+            __m256i v  = _mm256_loadu_si256((const __m256i*)(samples + i));
+            __m256i sq = _mm256_madd_epi16(v, v);
+            acc  = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+            acc  = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+            vmax = _mm256_max_epi16(vmax, v);
+            vmin = _mm256_min_epi16(vmin, v);
+            cpos = _mm256_sub_epi16(cpos, _mm256_cmpgt_epi16(v, hi));
+            cneg = _mm256_sub_epi16(cneg, _mm256_cmpgt_epi16(lo, v));
+        }
+        cpos32 = _mm256_add_epi32(cpos32, _mm256_madd_epi16(cpos, ones));
+        cneg32 = _mm256_add_epi32(cneg32, _mm256_madd_epi16(cneg, ones));
+    }
+
+    short mx[16], mn[16];
+    int   p[8], q[8];
+    long long a[4];
+    _mm256_storeu_si256((__m256i*)mx, vmax);
+    _mm256_storeu_si256((__m256i*)mn, vmin);
+    _mm256_storeu_si256((__m256i*)p, cpos32);
+    _mm256_storeu_si256((__m256i*)q, cneg32);
+    _mm256_storeu_si256((__m256i*)a, acc);
+    if (n > 0) levels_fold_lanes(self, mx, mn, 16);
+
+    int k;
+    for (k = 0; k < 8; k++) {
+        self->clip_pos += p[k];
+        self->clip_neg += q[k];
+    }
+    self->sum_squares += a[0] + a[1] + a[2] + a[3];
+    self->nsamples    += n;
+
+    levels_accumulate_scalar(self, samples + n, nsamples - n);
+}
+#endif
+
+static levels_fn_t levels_select(const char **name) {
+#if LEVELS_HAVE_NEON
+    *name = "neon";
+    return levels_accumulate_neon;
+#elif LEVELS_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return levels_accumulate_avx2;
+    }
+    *name = "sse2";
+    return levels_accumulate_sse2;
+#else
+    *name = "scalar";
+    return levels_accumulate_scalar;
+#endif
+}
+
+static levels_fn_t  levels_impl;
+static const char  *levels_name;
+
+// the kernel, chosen on first use by whichever threads get there first; they
+// all choose the same one. its name is published before it, so anyone who
+// sees the kernel sees the name too.
+static levels_fn_t levels_kernel() {
+    levels_fn_t impl = __atomic_load_n(&levels_impl, __ATOMIC_ACQUIRE);
+    if (impl == NULL) {
+        const char *name;
+        impl = levels_select(&name);
+        __atomic_store_n(&levels_name, name, __ATOMIC_RELAXED);
+        __atomic_store_n(&levels_impl, impl, __ATOMIC_RELEASE);
+    }
+    return impl;
+}
+
+void levels_accumulate(levels_t *self, const short *samples, int nsamples) {
+    levels_kernel()(self, samples, nsamples);
+}
+
+const char *levels_impl_name() {
+    levels_kernel();
+    return __atomic_load_n(&levels_name, __ATOMIC_RELAXED);
+}
+
+double levels_rms(const levels_t *self) {
+    if (self->nsamples == 0) return 0.0;
+    return sqrt((double)self->sum_squares / (32768.0 * 32768.0) / (double)self->nsamples);
+}
+
+int levels_clipped(const levels_t *self) {
+    return self->clip_pos + self->clip_neg;
+}
+
+double levels_peak(const levels_t *self) {
+    int peak = 0, ch;
+    for (ch = 0; ch < self->channels; ch++) {
+        if (self->peak[ch] > peak) peak = self->peak[ch];
+    }
+    return peak / 32768.0;
+}
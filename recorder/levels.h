@@ -0,0 +1,47 @@
+#ifndef INCLUDED_LEVELS_H
+#define INCLUDED_LEVELS_H
+
+typedef struct levels levels_t;
+
+#define LEVELS_MAX_CHANNELS (8)
+
+// a sample is clipped if it is beyond 0.99 of full scale in either direction
+#define LEVELS_CLIP_POS     (32440)
+#define LEVELS_CLIP_NEG     (-32440)
+
+void levels_reset(levels_t *self, int channels);
+
+/* accumulates nsamples of interleaved 16 bit audio into self in one pass.
+ *
+ * nsamples must be a multiple of the channel count given to levels_reset.
+ * uses NEON, AVX2 or SSE2 when available, with a scalar fallback.
+ */
+void levels_accumulate(levels_t *self, const short *samples, int nsamples);
+
+/* adds everything accumulated in src to self, as if its samples had been
+ * accumulated into self too
+ */
+void levels_merge(levels_t *self, const levels_t *src);
+
+/* the portable reference implementation of levels_accumulate */
+void levels_accumulate_scalar(levels_t *self, const short *samples, int nsamples);
+
+const char *levels_impl_name();
+
+double levels_rms(const levels_t *self);       // rms over everything accumulated, in [0,1]
+int    levels_clipped(const levels_t *self);   // positive + negative clips
+double levels_peak(const levels_t *self);      // largest |sample| on any channel, in [0,1]
+
+struct levels
+{
+    int         channels;
+    long long   nsamples;
+    long long   sum_squares;                    // sum of sample^2 over every channel
+    int         peak[LEVELS_MAX_CHANNELS];      // largest |sample| seen per channel
+    int         min;                            // most negative sample on any channel, or 0
+    int         max;                            // most positive sample on any channel, or 0
+    int         clip_pos;                       // samples > LEVELS_CLIP_POS
+    int         clip_neg;                       // samples < LEVELS_CLIP_NEG
+};
+
+#endif
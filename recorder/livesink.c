@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include "livesink.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LIVESINK_CONNECT_TIMEOUT_S  (10)
+#define LIVESINK_STALL_BYTES        (1024)
+#define LIVESINK_STALL_S            (30)
+
+void livesink_init(livesink_t *self, const char *sink, int interval_ms) {
+    memset(self, 0, sizeof(*self));
+    snprintf(self->sink, sizeof(self->sink), "%s", sink);
+    int len = strlen(self->sink);
+    while (len > 1 && self->sink[len - 1] == '/') self->sink[--len] = 0;
+    self->http        = strncmp(self->sink, "http://", 7) == 0 || strncmp(self->sink, "https://", 8) == 0;
+    self->interval_ms = interval_ms;
+    histo_init(&self->latency, "live");
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wakeup, NULL);
+
+    self->buf = malloc(LIVESINK_CHUNK_BYTES);
+    if (self->buf == NULL) failf("couldn't allocate live upload buffer");
+    if (self->http) {
+        if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) failf("couldn't initialize libcurl");
+        self->curl = curl_easy_init();
+        if (self->curl == NULL) failf("couldn't allocate curl handle");
+    }
+}
+
+void livesink_begin(livesink_t *self, const char *tmpfilename) {
+    // opened here rather than on the sending thread, which might only get
+    // to it after the recording has been renamed
+    int fd = open(tmpfilename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        tracef("couldn't open %s to send it live: %s", tmpfilename, strerror(errno));
+        return;
+    }
+    pthread_mutex_lock(&self->lock);
+    int i;
+    for (i = 0; i < LIVESINK_MAX_STREAMS; i++) {
+        livesink_stream_t *s = &self->streams[i];
+        if (s->state != LIVESINK_STREAM_FREE) continue;
+        memset(s, 0, sizeof(*s));
+        s->state  = LIVESINK_STREAM_LIVE;
+        s->fd     = fd;
+        s->out_fd = -1;
+        snprintf(s->tmpfilename, sizeof(s->tmpfilename), "%s", tmpfilename);
+        break;
+    }
+    pthread_mutex_unlock(&self->lock);
+    if (i == LIVESINK_MAX_STREAMS) {
+        tracef("%d recordings are still being sent to %s; not sending %s live", i, self->sink, tmpfilename);
+        close(fd);
+    }
+}
+
+void livesink_end(livesink_t *self, const char *tmpfilename, const char *filename) {
+    pthread_mutex_lock(&self->lock);
+    int i;
+    for (i = 0; i < LIVESINK_MAX_STREAMS; i++) {
+        livesink_stream_t *s = &self->streams[i];
+        if (s->state != LIVESINK_STREAM_LIVE || strcmp(s->tmpfilename, tmpfilename) != 0) continue;
+        if (filename != NULL) {
+            snprintf(s->filename, sizeof(s->filename), "%s", filename);
+            s->state   = LIVESINK_STREAM_KEPT;
+            s->kept_us = now_us();
+        } else {
+            s->state   = LIVESINK_STREAM_DISCARDED;
+        }
+        self->kicked = true;
+        pthread_cond_signal(&self->wakeup);
+        break;
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void livesink_dir_path(livesink_t *self, const char *name, char *buf, int len) {
+    snprintf(buf, len, "%s/%s", self->sink, name);
+}
+
+static bool livesink_dir_append(livesink_t *self, livesink_stream_t *s, int n) {
+    char path[2048];
+    livesink_dir_path(self, s->tmpfilename, path, sizeof(path));
+    if (s->out_fd < 0) {
+        s->out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (s->out_fd < 0) {
+            tracef("couldn't create %s: %s", path, strerror(errno));
+            return false;
+        }
+    }
+    if (pwrite(s->out_fd, self->buf, n, s->sent) != n) {
+        tracef("couldn't write %s: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool livesink_dir_complete(livesink_t *self, livesink_stream_t *s, const uint8_t *header) {
+    char path[2048], final_path[2048];
+    livesink_dir_path(self, s->tmpfilename, path, sizeof(path));
+    livesink_dir_path(self, s->filename, final_path, sizeof(final_path));
+    if (pwrite(s->out_fd, header, LIVESINK_HEADER_BYTES, 0) != LIVESINK_HEADER_BYTES ||
+        fdatasync(s->out_fd) != 0 || rename(path, final_path) != 0) {
+        tracef("couldn't finish %s: %s", final_path, strerror(errno));
+        return false;
+    }
+    close(s->out_fd);
+    s->out_fd = -1;
+    return true;
+}
+
+static void livesink_dir_discard(livesink_t *self, livesink_stream_t *s) {
+    char path[2048];
+    livesink_dir_path(self, s->tmpfilename, path, sizeof(path));
+    if (s->out_fd >= 0) close(s->out_fd);
+    s->out_fd = -1;
+    unlink(path);
+}
+
+static size_t livesink_ignore(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    return size * nmemb;
+}
+
+// one request on the thread's connection. returns the response code, or 0 if
+// there wasn't one. length gets the Content-Length of a HEAD.
+static long livesink_request(livesink_t *self, const char *method, livesink_stream_t *s, const char *query,
+                             const char *range, const uint8_t *data, long len, long long *length) {
+    CURL *curl = self->curl;
+    curl_easy_reset(curl);
+
+    char url[2048];
+    char *name = curl_easy_escape(curl, s->tmpfilename, 0);
+    snprintf(url, sizeof(url), "%s/%s%s%s", self->sink, name, query != NULL ? "?" : "", query != NULL ? query : "");
+    curl_free(name);
+
+    struct curl_slist *headers = range != NULL ? curl_slist_append(NULL, range) : NULL;
+    curl_easy_setopt(curl, CURLOPT_URL,             url);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL,        1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,  (long)LIVESINK_CONNECT_TIMEOUT_S);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)LIVESINK_STALL_BYTES);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,  (long)LIVESINK_STALL_S);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,   livesink_ignore);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT,       "recordthepiano");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER,      headers);
+    if (strcmp(method, "HEAD") == 0) {
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
+    }
+    if (data != NULL) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS,    data);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
+    }
+
+    long code = 0;
+    CURLcode rc = curl_easy_perform(curl);
+    if (rc != CURLE_OK) {
+        tracef("live %s of %s failed: %s", method, s->tmpfilename, curl_easy_strerror(rc));
+    } else {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        curl_off_t cl = -1;
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
+        if (length != NULL) *length = cl;
+    }
+    curl_slist_free_all(headers);
+    return code;
+}
+
+static bool livesink_http_append(livesink_t *self, livesink_stream_t *s, int n) {
+    char range[128];
+    snprintf(range, sizeof(range), "Content-Range: bytes %lld-%lld/*", s->sent, s->sent + n - 1);
+    long code = livesink_request(self, "PUT", s, NULL, range, self->buf, n, NULL);
+    if (code >= 200 && code < 300) return true;
+    if (code == 0) return false;
+
+    // the server doesn't have what we think it has (it restarted, or an
+    // earlier reply got lost): carry on from wherever it got to
+    long long length = -1;
+    code = livesink_request(self, "HEAD", s, NULL, NULL, NULL, 0, &length);
+    long long resume = code == 404 ? 0 : code >= 200 && code < 300 && length >= 0 ? length : -1;
+    if (resume >= 0 && resume <= s->sent + n) {
+        tracef("live sink has %lld bytes of %s, resuming from there", resume, s->tmpfilename);
+        s->sent = resume;
+    }
+    return false;
+}
+
+static bool livesink_http_complete(livesink_t *self, livesink_stream_t *s, const uint8_t *header) {
+    char range[128];
+    snprintf(range, sizeof(range), "Content-Range: bytes 0-%d/%lld", LIVESINK_HEADER_BYTES - 1, s->sent);
+    char query[1024];
+    char *name = curl_easy_escape(self->curl, s->filename, 0);
+    snprintf(query, sizeof(query), "name=%s", name);
+    curl_free(name);
+    long code = livesink_request(self, "PUT", s, query, range, header, LIVESINK_HEADER_BYTES, NULL);
+    if (code != 0 && (code < 200 || code >= 300)) tracef("live sink turned down the end of %s: %ld", s->filename, code);
+    return code >= 200 && code < 300;
+}
+
+// sends whatever's new. returns true once the stream is done with.
+static bool livesink_service(livesink_t *self, livesink_stream_t *s, livesink_stream_state_t state) {
+    if (state == LIVESINK_STREAM_DISCARDED) {
+        if (self->http) {
+            livesink_request(self, "DELETE", s, NULL, NULL, NULL, 0, NULL);
+        } else {
+            livesink_dir_discard(self, s);
+        }
+        return true;
+    }
+
+    for (;;) {
+        ssize_t n = pread(s->fd, self->buf, LIVESINK_CHUNK_BYTES, s->sent);
+        if (n < 0) {
+            tracef("couldn't read %s to send it live: %s", s->tmpfilename, strerror(errno));
+            return false;
+        }
+        if (n == 0) break;
+        bool ok = self->http ? livesink_http_append(self, s, n) : livesink_dir_append(self, s, n);
+        if (!ok) return false;
+        s->sent += n;
+    }
+    if (state != LIVESINK_STREAM_KEPT) return false;
+
+    // a kept recording doesn't change any more, so this is all of it
+    uint8_t header[LIVESINK_HEADER_BYTES];
+    if (s->sent < LIVESINK_HEADER_BYTES || pread(s->fd, header, sizeof(header), 0) != sizeof(header)) {
+        tracef("%s is too short to send", s->filename);
+        return true;
+    }
+    bool ok = self->http ? livesink_http_complete(self, s, header) : livesink_dir_complete(self, s, header);
+    if (!ok) return false;
+
+    long long latency = now_us() - s->kept_us;
+    histo_record(&self->latency, latency);
+    tracef("%s is at %s, %dms after it was kept", s->filename, self->sink, (int)(latency / 1000));
+    return true;
+}
+
+static void *livesink_thread_main(void *arg) {
+    livesink_t *self = (livesink_t*)arg;
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        self->kicked = false;
+        int i;
+        for (i = 0; i < LIVESINK_MAX_STREAMS; i++) {
+            livesink_stream_t *s = &self->streams[i];
+            livesink_stream_state_t state = s->state;
+            if (state == LIVESINK_STREAM_FREE) continue;
+
+            pthread_mutex_unlock(&self->lock);
+            bool done = livesink_service(self, s, state);
+            if (done) close(s->fd);
+            pthread_mutex_lock(&self->lock);
+            if (done) s->state = LIVESINK_STREAM_FREE;
+        }
+        if (self->kicked) continue;
+
+        long long wake_us = now_us() + (long long)self->interval_ms * 1000;
+        struct timespec ts = { wake_us / 1000000, (wake_us % 1000000) * 1000 };
+        pthread_cond_timedwait(&self->wakeup, &self->lock, &ts);
+    }
+    return NULL;
+}
+
+void livesink_start(livesink_t *self) {
+    pthread_create(&self->thread, NULL, livesink_thread_main, self);
+}
@@ -0,0 +1,94 @@
+#ifndef INCLUDED_LIVESINK_H
+#define INCLUDED_LIVESINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "histo.h"
+
+typedef struct livesink livesink_t;
+
+/* copies recordings somewhere else while they're still being recorded, so
+ * a finished take is available there moments after it stops instead of
+ * after a whole-file upload.
+ *
+ * every interval_ms, a thread sends whatever the encoder has written to
+ * each recording since last time. a FLAC file only changes behind the end
+ * in its STREAMINFO, which the encoder rewrites when it finishes, so once a
+ * recording is kept the thread sends the rest and then the final header,
+ * and the copy is complete.
+ *
+ * the recording is held open from livesink_begin on, so the encoder
+ * renaming it, or the upload queue deleting it, doesn't get in the way.
+ *
+ * sink is either a directory (a network mount, say), where the copy is
+ * written as <tmpfilename> and renamed to <filename> when it's complete, or
+ * an http(s) url, which is sent
+ *
+ *     PUT    url/<tmpfilename>             Content-Range: bytes <first>-<last>/<total or *>
+ *     HEAD   url/<tmpfilename>             after a failed PUT: Content-Length is how much it has
+ *     DELETE url/<tmpfilename>             the recording was discarded
+ *
+ * each range starts where the last one ended, except the final one: bytes
+ * 0-41/<total>, the finished header, with ?name=<filename>. a failed range
+ * is sent again (from wherever the server says it got to) on the next pass.
+ */
+void livesink_init(livesink_t *self, const char *sink, int interval_ms);
+
+/* starts the sending thread */
+void livesink_start(livesink_t *self);
+
+/* a recording started writing to tmpfilename */
+void livesink_begin(livesink_t *self, const char *tmpfilename);
+
+/* the recording in tmpfilename is complete and was kept as filename, or,
+ * with filename NULL, was thrown away.
+ */
+void livesink_end(livesink_t *self, const char *tmpfilename, const char *filename);
+
+#define LIVESINK_MAX_STREAMS    (16)            // recordings being sent at once, incl. finished ones catching up: two per input
+#define LIVESINK_CHUNK_BYTES    (256 * 1024)    // most sent per request
+#define LIVESINK_HEADER_BYTES   (42)            // what gets rewritten when a recording finishes
+#define LIVESINK_MAX_FILENAME   (256)
+
+typedef enum {
+    LIVESINK_STREAM_FREE,
+    LIVESINK_STREAM_LIVE,       // still being recorded
+    LIVESINK_STREAM_KEPT,       // complete; send the rest and the header
+    LIVESINK_STREAM_DISCARDED,
+} livesink_stream_state_t;
+
+typedef struct {
+    livesink_stream_state_t state;
+    int                 fd;             // the recording
+    char                tmpfilename[LIVESINK_MAX_FILENAME];
+    char                filename[LIVESINK_MAX_FILENAME];
+    long long           kept_us;
+
+    // sending thread only
+    long long           sent;           // bytes the sink has
+    int                 out_fd;         // directory sink: the copy
+} livesink_stream_t;
+
+struct livesink
+{
+    char                sink[1024];
+    bool                http;
+    int                 interval_ms;
+    histo_t             latency;        // from kept to complete at the sink
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      wakeup;
+    bool                kicked;         // a recording ended since the thread last looked
+    livesink_stream_t   streams[LIVESINK_MAX_STREAMS];
+    pthread_t           thread;
+
+    // sending thread only
+    CURL               *curl;
+    uint8_t            *buf;            // LIVESINK_CHUNK_BYTES
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "loudness.h"
+
+#include <math.h>
+#include <string.h>
+
+void loudness_init(loudness_t *self, int channels, int sample_rate) {
+    memset(self, 0, sizeof(*self));
+    self->channels    = channels < LOUDNESS_MAX_CHANNELS ? channels : LOUDNESS_MAX_CHANNELS;
+    self->step_frames = sample_rate / 10;
+
+    // BS.1770 gives the filters at 48kHz only; these are the analog
+    // prototypes they came from, so any rate gets the same response
+    double f0 = 1681.974450955533;
+    double G  = 3.999843853973347;
+    double Q  = 0.7071752369554196;
+    double K  = tan(M_PI * f0 / sample_rate);
+    double Vh = pow(10.0, G / 20.0);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+    self->shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+    self->shelf.b1 = 2.0 * (K * K - Vh) / a0;
+    self->shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+    self->shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+    self->shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q  = 0.5003270373238773;
+    K  = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + K / Q + K * K;
+    self->highpass.b0 = 1.0;
+    self->highpass.b1 = -2.0;
+    self->highpass.b2 = 1.0;
+    self->highpass.a1 = 2.0 * (K * K - 1.0) / a0;
+    self->highpass.a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+void loudness_reset(loudness_t *self) {
+    memset(self->state, 0, sizeof(self->state));
+    self->step_fill = 0;
+    self->step_sum  = 0.0;
+    self->nsteps    = 0;
+    memset(self->bin_blocks, 0, sizeof(self->bin_blocks));
+    memset(self->bin_energy, 0, sizeof(self->bin_energy));
+}
+
+static double loudness_lufs(double energy) {
+    return -0.691 + 10.0 * log10(energy);
+}
+
+static void loudness_add_block(loudness_t *self, double energy) {
+    if (energy <= 0.0) return;
+    double lufs = loudness_lufs(energy);
+    if (lufs <= LOUDNESS_SILENCE) return;
+    int bin = (int)((lufs - LOUDNESS_SILENCE) * LOUDNESS_BINS_PER_LU);
+    if (bin >= LOUDNESS_NBINS) bin = LOUDNESS_NBINS - 1;
+    self->bin_blocks[bin]++;
+    self->bin_energy[bin] += energy;
+}
+
+// transposed direct form II, s holds the two delays
+static inline double loudness_filter(const loudness_biquad_t *f, double *s, double x) {
+    double y = f->b0 * x + s[0];
+    s[0] = f->b1 * x - f->a1 * y + s[1];
+    s[1] = f->b2 * x - f->a2 * y;
+    return y;
+}
+
+void loudness_accumulate(loudness_t *self, const short *samples, int nframes) {
+    int stride = self->channels;
+    int i, ch;
+    for (i = 0; i < nframes; i++) {
+        for (ch = 0; ch < self->channels; ch++) {
+            double x = samples[i * stride + ch] / 32768.0;
+            double y = loudness_filter(&self->highpass, &self->state[ch][2],
+                                       loudness_filter(&self->shelf, &self->state[ch][0], x));
+            self->step_sum += y * y;
+        }
+        if (++self->step_fill < self->step_frames) continue;
+
+        self->steps[self->nsteps++ % LOUDNESS_STEPS_PER_BLOCK] = self->step_sum / self->step_frames;
+        self->step_fill = 0;
+        self->step_sum  = 0.0;
+        if (self->nsteps >= LOUDNESS_STEPS_PER_BLOCK) {
+            double energy = 0.0;
+            int s;
+            for (s = 0; s < LOUDNESS_STEPS_PER_BLOCK; s++) energy += self->steps[s];
+            loudness_add_block(self, energy / LOUDNESS_STEPS_PER_BLOCK);
+        }
+    }
+}
+
+double loudness_integrated(const loudness_t *self) {
+    long long blocks = 0;
+    double    energy = 0.0;
+    int bin;
+    for (bin = 0; bin < LOUDNESS_NBINS; bin++) {
+        blocks += self->bin_blocks[bin];
+        energy += self->bin_energy[bin];
+    }
+    if (blocks == 0) return LOUDNESS_SILENCE;
+
+    double gate  = loudness_lufs(energy / blocks) - 10.0;
+    int    first = (int)ceil((gate - LOUDNESS_SILENCE) * LOUDNESS_BINS_PER_LU);
+    if (first < 0) first = 0;
+    blocks = 0;
+    energy = 0.0;
+    for (bin = first; bin < LOUDNESS_NBINS; bin++) {
+        blocks += self->bin_blocks[bin];
+        energy += self->bin_energy[bin];
+    }
+    return blocks > 0 ? loudness_lufs(energy / blocks) : LOUDNESS_SILENCE;
+}
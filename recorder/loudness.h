@@ -0,0 +1,54 @@
+#ifndef INCLUDED_LOUDNESS_H
+#define INCLUDED_LOUDNESS_H
+
+typedef struct loudness loudness_t;
+
+/* integrated loudness (ITU-R BS.1770-4, as used by EBU R128) of everything
+ * accumulated since the last reset, in LUFS.
+ *
+ * each channel is K-weighted, and the sum of their mean squares is taken
+ * over 400ms blocks every 100ms. blocks under -70 LUFS are ignored, then so
+ * are blocks more than 10 LU under the mean of the rest. block energies are
+ * binned LOUDNESS_BINS_PER_LU to the LU instead of kept, so memory doesn't
+ * grow with the length of a take and the relative gate is accurate to a
+ * bin.
+ *
+ * channels are weighted equally, which is right for mono and stereo.
+ */
+void   loudness_init(loudness_t *self, int channels, int sample_rate);
+void   loudness_reset(loudness_t *self);
+void   loudness_accumulate(loudness_t *self, const short *samples, int nframes);
+
+/* LOUDNESS_SILENCE if no block got through the gates */
+double loudness_integrated(const loudness_t *self);
+
+#define LOUDNESS_MAX_CHANNELS   (8)
+#define LOUDNESS_SILENCE        (-70.0)     // the absolute gate
+#define LOUDNESS_CEILING        (10.0)      // louder blocks land in the top bin
+#define LOUDNESS_BINS_PER_LU    (10)
+#define LOUDNESS_NBINS          (80 * LOUDNESS_BINS_PER_LU + 1)     // LOUDNESS_SILENCE to LOUDNESS_CEILING
+#define LOUDNESS_STEPS_PER_BLOCK (4)        // 100ms steps in a 400ms block
+
+// a biquad, normalized so a0 is 1
+typedef struct {
+    double      b0, b1, b2, a1, a2;
+} loudness_biquad_t;
+
+struct loudness
+{
+    int                 channels;
+    int                 step_frames;            // 100ms
+    loudness_biquad_t   shelf;                  // K-weighting stage 1: the head's high shelf
+    loudness_biquad_t   highpass;               // stage 2: RLB high pass
+    double              state[LOUDNESS_MAX_CHANNELS][4];
+
+    int                 step_fill;              // frames into the current step
+    double              step_sum;               // sum of K-weighted squares, every channel
+    double              steps[LOUDNESS_STEPS_PER_BLOCK];   // mean square of the last few steps
+    long long           nsteps;
+
+    unsigned            bin_blocks[LOUDNESS_NBINS];
+    double              bin_energy[LOUDNESS_NBINS];
+};
+
+#endif
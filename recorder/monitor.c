@@ -0,0 +1,108 @@
+#include "monitor.h"
+#include "utils.h"
+
+#include <string.h>
+
+const char *monitor_format_to_str(monitor_format_t format) {
+    switch (format) {
+        case MONITOR_FORMAT_NONE: return "off";
+        case MONITOR_FORMAT_PCM:  return "pcm";
+        case MONITOR_FORMAT_ULAW: return "ulaw";
+        default:                  return "unknown";
+    }
+}
+
+bool monitor_format_parse(const char *str, monitor_format_t *format) {
+    if      (strcmp(str, "off")  == 0) *format = MONITOR_FORMAT_NONE;
+    else if (strcmp(str, "pcm")  == 0) *format = MONITOR_FORMAT_PCM;
+    else if (strcmp(str, "ulaw") == 0) *format = MONITOR_FORMAT_ULAW;
+    else return false;
+    return true;
+}
+
+int monitor_format_bytes(monitor_format_t format) {
+    return format == MONITOR_FORMAT_PCM ? 2 : 1;
+}
+
+void monitor_init(monitor_t *self, int channels, int sample_rate, int max_frames, int nslots) {
+    memset(self, 0, sizeof(*self));
+    self->channels    = channels;
+    self->rate        = sample_rate / MONITOR_DECIMATION;
+    // a frame can finish one output sample left over from the last write
+    self->max_samples = max_frames / MONITOR_DECIMATION + 1;
+    ringbuf_init(&self->ring, sizeof(monitor_frame_t) + sizeof(short) * self->max_samples, nslots);
+}
+
+void monitor_destroy(monitor_t *self) {
+    ringbuf_destroy(&self->ring);
+}
+
+void monitor_set_listening(monitor_t *self, bool listening) {
+    __atomic_store_n(&self->listening, listening, __ATOMIC_RELAXED);
+}
+
+void monitor_write(monitor_t *self, const short *samples, int nframes, long long captured_us) {
+    if (!__atomic_load_n(&self->listening, __ATOMIC_RELAXED)) {
+        self->phase = 0;
+        self->acc   = 0;
+        return;
+    }
+
+    unsigned seq = self->seq++;
+    monitor_frame_t *frame = (monitor_frame_t*)ringbuf_write_begin(&self->ring);
+    if (frame == NULL) return;      // network thread is behind; the gap in seq says so
+
+    // the first output sample may have started in the previous write
+    long long frame_us = 1000000LL * MONITOR_DECIMATION / self->rate;
+    frame->captured_us = captured_us - self->phase * frame_us / MONITOR_DECIMATION;
+    frame->seq         = seq;
+
+    int divisor = MONITOR_DECIMATION * self->channels;
+    int n = 0, i, ch;
+    for (i = 0; i < nframes; i++) {
+        for (ch = 0; ch < self->channels; ch++) self->acc += samples[i * self->channels + ch];
+        if (++self->phase == MONITOR_DECIMATION) {
+            frame->samples[n++] = (short)(self->acc / divisor);
+            self->phase = 0;
+            self->acc   = 0;
+        }
+    }
+    frame->nsamples = n;
+    ringbuf_write_end(&self->ring);
+}
+
+monitor_frame_t *monitor_read_begin(monitor_t *self) {
+    return (monitor_frame_t*)ringbuf_read_begin(&self->ring);
+}
+
+void monitor_read_end(monitor_t *self) {
+    ringbuf_read_end(&self->ring);
+}
+
+// G.711 on the top 14 bits: sign, 3 bit segment, 4 bit mantissa, inverted
+static unsigned char monitor_ulaw(short pcm) {
+    int x    = pcm >> 2;
+    int mask = 0xff;
+    if (x < 0) {
+        x    = -x;
+        mask = 0x7f;
+    }
+    if (x > 8158) x = 8158;
+    x += 0x21;
+    int segment = 0;
+    while (segment < 7 && x >= (0x40 << segment)) segment++;
+    return (unsigned char)(((segment << 4) | ((x >> (segment + 1)) & 0x0f)) ^ mask);
+}
+
+int monitor_encode(const monitor_frame_t *frame, monitor_format_t format, unsigned char *out) {
+    int i;
+    if (format == MONITOR_FORMAT_PCM) {
+        for (i = 0; i < frame->nsamples; i++) {
+            out[i * 2]     = (unsigned char)(frame->samples[i] & 0xff);
+            out[i * 2 + 1] = (unsigned char)((frame->samples[i] >> 8) & 0xff);
+        }
+        return frame->nsamples * 2;
+    }
+    for (i = 0; i < frame->nsamples; i++) out[i] = monitor_ulaw(frame->samples[i]);
+    return frame->nsamples;
+}
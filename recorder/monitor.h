@@ -0,0 +1,74 @@
+#ifndef INCLUDED_MONITOR_H
+#define INCLUDED_MONITOR_H
+
+#include <stdbool.h>
+
+#include "ringbuf.h"
+
+typedef struct monitor monitor_t;
+
+/* a low rate mono copy of the capture for remote listening.
+ *
+ * the audio loop hands each buffer to monitor_write straight from the
+ * capture slot. while nobody is listening that returns at once; otherwise
+ * it downmixes and decimates by MONITOR_DECIMATION into a lock-free ring
+ * that the network thread drains and encodes, once per format, for every
+ * listener. if the network thread falls behind, frames are dropped rather
+ * than the audio loop waiting.
+ *
+ * decimation is a plain boxcar average: it leaves some aliasing, which is
+ * fine for checking what the mic hears, and costs one add per sample.
+ */
+typedef enum {
+    MONITOR_FORMAT_NONE,
+    MONITOR_FORMAT_PCM,         // 16 bit little endian
+    MONITOR_FORMAT_ULAW,        // 8 bit G.711 mu-law
+} monitor_format_t;
+
+const char *monitor_format_to_str(monitor_format_t format);
+bool monitor_format_parse(const char *str, monitor_format_t *format);
+int  monitor_format_bytes(monitor_format_t format);    // per sample
+
+typedef struct {
+    long long   captured_us;    // when the first input frame in it came in
+    unsigned    seq;            // counts up by one per frame written, dropped or not
+    int         nsamples;
+    short       samples[];
+} monitor_frame_t;
+
+/* max_frames is the most input frames a single monitor_write will get */
+void monitor_init(monitor_t *self, int channels, int sample_rate, int max_frames, int nslots);
+void monitor_destroy(monitor_t *self);
+
+/* network thread: turns the feed on or off */
+void monitor_set_listening(monitor_t *self, bool listening);
+
+/* audio loop: captured_us is when the first of the nframes came in */
+void monitor_write(monitor_t *self, const short *samples, int nframes, long long captured_us);
+
+/* network thread: the oldest frame not yet sent, or NULL */
+monitor_frame_t *monitor_read_begin(monitor_t *self);
+void             monitor_read_end(monitor_t *self);
+
+/* encodes frame into out, which must hold nsamples * monitor_format_bytes.
+ * returns the number of bytes written.
+ */
+int monitor_encode(const monitor_frame_t *frame, monitor_format_t format, unsigned char *out);
+
+#define MONITOR_DECIMATION  (4)
+
+struct monitor
+{
+    ringbuf_t   ring;
+    int         channels;
+    int         rate;               // after decimation
+    int         max_samples;        // per frame
+    bool        listening;          // written by the network thread, read by the audio loop
+
+    // audio loop only
+    unsigned    seq;
+    int         phase;              // input frames summed into acc so far
+    int         acc;
+};
+
+#endif
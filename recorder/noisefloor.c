@@ -0,0 +1,34 @@
+#include "noisefloor.h"
+
+#include <math.h>
+#include <string.h>
+
+// -120dB, so digital silence still leaves something to rise from
+#define NOISEFLOOR_MIN_LEVEL (1e-6)
+
+void noisefloor_init(noisefloor_t *self, double percentile, double rise_db, double push_seconds) {
+    memset(self, 0, sizeof(*self));
+    double up_db   = rise_db * push_seconds;
+    double down_db = up_db * (1.0 - percentile) / percentile;
+    self->up       = pow(10.0, up_db / 20.0);
+    self->down     = pow(10.0, -down_db / 20.0);
+    self->level    = NOISEFLOOR_MIN_LEVEL;
+}
+
+void noisefloor_reset(noisefloor_t *self, double level) {
+    self->level = level > NOISEFLOOR_MIN_LEVEL ? level : NOISEFLOOR_MIN_LEVEL;
+}
+
+// a fixed step in dB is a fixed ratio, so this needs no logs
+void noisefloor_push(noisefloor_t *self, double level) {
+    if (level > self->level) {
+        self->level *= self->up;
+    } else {
+        self->level *= self->down;
+        if (self->level < NOISEFLOOR_MIN_LEVEL) self->level = NOISEFLOOR_MIN_LEVEL;
+    }
+}
+
+double noisefloor_level(const noisefloor_t *self) {
+    return self->level;
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDED_NOISEFLOOR_H
+#define INCLUDED_NOISEFLOOR_H
+
+typedef struct noisefloor noisefloor_t;
+
+/* streaming estimate of a low percentile of the levels pushed, in O(1) time
+ * and space per push.
+ *
+ * the estimate is nudged up a fixed number of dB for every level above it
+ * and down a few more for every one below, in the ratio that settles
+ * with `percentile` of the levels below it. so it needs no history, and it
+ * moves at most rise_db per second up and rise_db * (1 - p) / p down: quick
+ * to follow a quieter room, slow to be dragged up by anything loud.
+ */
+void   noisefloor_init(noisefloor_t *self, double percentile, double rise_db, double push_seconds);
+
+/* starts over from level, e.g. a calibrated base level */
+void   noisefloor_reset(noisefloor_t *self, double level);
+
+void   noisefloor_push(noisefloor_t *self, double level);
+double noisefloor_level(const noisefloor_t *self);     // same units as pushed
+
+struct noisefloor
+{
+    double      up;             // factor per push
+    double      down;
+    double      level;          // the estimate
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "onset.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// no bin's floor is taken to be below about the quantization noise of 16 bit
+// input, so digital silence doesn't make every bin infinitely far above it
+#define ONSET_FLOOR_MIN          (3e-8f)
+
+// the first hops of a calibration only settle the floor estimate that the
+// flux of the later ones is measured against
+#define ONSET_CALIBRATION_SETTLE (10)
+
+void onset_init(onset_t *self, int channels, int sample_rate, int hop_frames) {
+    memset(self, 0, sizeof(*self));
+    fft_init(&self->fft, ONSET_FFT_SIZE);
+    self->channels    = channels;
+    self->sample_rate = sample_rate;
+    // peaks are compared against the bins 4 away, which have to exist
+    self->low_bin     = ONSET_BAND_LOW_HZ  * ONSET_FFT_SIZE / sample_rate;
+    self->high_bin    = ONSET_BAND_HIGH_HZ * ONSET_FFT_SIZE / sample_rate;
+    if (self->low_bin < 4) self->low_bin = 4;
+    if (self->high_bin > ONSET_FFT_SIZE / 2 - 4) self->high_bin = ONSET_FFT_SIZE / 2 - 4;
+
+    int nbins = ONSET_FFT_SIZE / 2 + 1;
+    self->window      = malloc(sizeof(float) * ONSET_FFT_SIZE);
+    self->history     = calloc(ONSET_FFT_SIZE, sizeof(float));
+    self->frame       = malloc(sizeof(float) * ONSET_FFT_SIZE);
+    self->power       = malloc(sizeof(float) * nbins);
+    self->floor       = malloc(sizeof(float) * nbins);
+    self->prev        = calloc(nbins, sizeof(float));
+    self->floor_accum = calloc(nbins, sizeof(double));
+    self->follow      = malloc(sizeof(noisefloor_t) * nbins);
+    if (self->window == NULL || self->history == NULL || self->frame == NULL || self->power == NULL ||
+        self->floor == NULL || self->prev == NULL || self->floor_accum == NULL || self->follow == NULL) {
+        failf("couldn't allocate onset detector");
+    }
+
+    int i;
+    for (i = 0; i < ONSET_FFT_SIZE; i++) {
+        self->window[i] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * i / ONSET_FFT_SIZE));
+    }
+    for (i = 0; i < nbins; i++) {
+        self->floor[i] = ONSET_FLOOR_MIN;
+        noisefloor_init(&self->follow[i], 0.5, ONSET_FLOOR_RISE_DB, (double)hop_frames / sample_rate);
+    }
+}
+
+void onset_destroy(onset_t *self) {
+    fft_destroy(&self->fft);
+    free(self->window);
+    free(self->history);
+    free(self->frame);
+    free(self->power);
+    free(self->floor);
+    free(self->prev);
+    free(self->floor_accum);
+    free(self->follow);
+    memset(self, 0, sizeof(*self));
+}
+
+void onset_begin_calibration(onset_t *self) {
+    memset(self->floor_accum, 0, sizeof(double) * (ONSET_FFT_SIZE / 2 + 1));
+    self->calibrating      = true;
+    self->calibration_hops = 0;
+    self->flux_sum         = 0;
+    self->flux_sum_squares = 0;
+    self->hold_frames      = 0;
+}
+
+void onset_end_calibration(onset_t *self) {
+    if (!self->calibrating) return;
+    self->calibrating = false;
+    int n = self->calibration_hops - ONSET_CALIBRATION_SETTLE;
+    if (n < 2) {
+        tracef("onset detector calibrated on only %d hops; keeping the old floor", self->calibration_hops);
+        return;
+    }
+    double mean     = self->flux_sum / n;
+    double variance = self->flux_sum_squares / n - mean * mean;
+    self->flux_mean      = mean;
+    self->flux_dev       = sqrt(variance > 0 ? variance : 0);
+    self->flux_threshold = mean + ONSET_FLUX_SIGMAS * self->flux_dev;
+    self->calibrated     = true;
+
+    int k;
+    for (k = 0; k <= ONSET_FFT_SIZE / 2; k++) {
+        noisefloor_reset(&self->follow[k], sqrt(self->floor[k] * M_LN2));
+    }
+}
+
+// a bin's power in noise is exponentially distributed, so its median is
+// ln 2 of the mean that the calibrated floor is
+void onset_follow_floor(onset_t *self) {
+    if (!self->calibrated || self->calibrating) return;
+    int k;
+    for (k = self->low_bin - 4; k < self->high_bin + 4; k++) {
+        if (self->power[k] > self->floor[k] * ONSET_PEAK_RATIO) continue;
+        noisefloor_push(&self->follow[k], sqrtf(self->power[k]));
+        double level = noisefloor_level(&self->follow[k]);
+        float  f     = (float)(level * level / M_LN2);
+        self->floor[k] = f > ONSET_FLOOR_MIN ? f : ONSET_FLOOR_MIN;
+    }
+}
+
+// while calibrating, the floor so far stands in for the finished one
+static void onset_learn(onset_t *self) {
+    int nbins = ONSET_FFT_SIZE / 2 + 1;
+    int k;
+    self->calibration_hops++;
+    for (k = 0; k < nbins; k++) {
+        self->floor_accum[k] += self->power[k];
+        float f = (float)(self->floor_accum[k] / self->calibration_hops);
+        self->floor[k] = f > ONSET_FLOOR_MIN ? f : ONSET_FLOOR_MIN;
+    }
+}
+
+void onset_process(onset_t *self, const short *samples, int nframes) {
+    int i, ch, k;
+
+    // slide the window along and downmix the new frames onto the end
+    int keep = ONSET_FFT_SIZE - nframes;
+    if (keep > 0) {
+        memmove(self->history, self->history + nframes, sizeof(float) * keep);
+    } else {
+        samples += (nframes - ONSET_FFT_SIZE) * self->channels;
+        nframes  = ONSET_FFT_SIZE;
+        keep     = 0;
+    }
+    float scale = 1.0f / (32768.0f * self->channels);
+    for (i = 0; i < nframes; i++) {
+        int sum = 0;
+        for (ch = 0; ch < self->channels; ch++) sum += samples[i * self->channels + ch];
+        self->history[keep + i] = sum * scale;
+    }
+    for (i = 0; i < ONSET_FFT_SIZE; i++) self->frame[i] = self->history[i] * self->window[i];
+
+    fft_power(&self->fft, self->frame, self->power);
+    if (self->calibrating) onset_learn(self);
+
+    // log(1 + power/floor) is about 0.7 for noise whatever its level, so the
+    // flux of a steady background is small and steady too
+    const float *p = self->power;
+    double harmonic = 0, harmonic_floor = 0, flux = 0;
+    int    harmonics = 0;
+    for (k = self->low_bin; k < self->high_bin; k++) {
+        if (p[k] > self->floor[k] * ONSET_PEAK_RATIO && p[k] >= p[k - 1] && p[k] > p[k + 1]) {
+            float around = (p[k - 4] + p[k - 3] + p[k - 2] + p[k + 2] + p[k + 3] + p[k + 4]) / 6.0f;
+            if (p[k] > around * ONSET_PEAK_CONTRAST) {
+                harmonics++;
+                harmonic       += p[k - 1] + p[k] + p[k + 1];
+                harmonic_floor += self->floor[k - 1] + self->floor[k] + self->floor[k + 1];
+            }
+        }
+        float c = logf(1.0f + p[k] / self->floor[k]);
+        if (c > self->prev[k]) flux += c - self->prev[k];
+        self->prev[k] = c;
+    }
+    self->harmonic_ratio = harmonics > 0 ? harmonic / harmonic_floor : 1.0;
+    self->flux           = flux / (self->high_bin - self->low_bin);
+    self->harmonics      = harmonics;
+
+    if (self->calibrating) {
+        if (self->calibration_hops > ONSET_CALIBRATION_SETTLE) {
+            self->flux_sum         += self->flux;
+            self->flux_sum_squares += self->flux * self->flux;
+        }
+        self->active = false;
+        return;
+    }
+
+    if (!self->calibrated) {
+        self->active = false;
+        return;
+    }
+    if (self->flux > self->flux_threshold) {
+        self->hold_frames = ONSET_HOLD_MS * self->sample_rate / 1000;
+    } else if (self->hold_frames > 0) {
+        self->hold_frames -= nframes;
+    }
+
+    // mean absolute deviation * 1.25 is about the standard deviation for
+    // gaussian noise, which is what the calibrated spread was
+    double alpha = (double)nframes * 1000 / ((double)ONSET_FLUX_AVERAGE_MS * self->sample_rate);
+    self->flux_mean     += alpha * (self->flux - self->flux_mean);
+    self->flux_dev      += alpha * (1.25 * fabs(self->flux - self->flux_mean) - self->flux_dev);
+    self->flux_threshold = self->flux_mean + ONSET_FLUX_SIGMAS * self->flux_dev;
+    self->active = harmonics >= ONSET_MIN_HARMONICS || self->hold_frames > 0;
+}
+
+bool onset_active(const onset_t *self) {
+    return self->active;
+}
+
+int onset_harmonics(const onset_t *self) {
+    return self->harmonics;
+}
+
+double onset_harmonic_db(const onset_t *self) {
+    return 10.0 * log10(self->harmonic_ratio);
+}
+
+double onset_flux(const onset_t *self) {
+    return self->flux;
+}
@@ -0,0 +1,96 @@
+#ifndef INCLUDED_ONSET_H
+#define INCLUDED_ONSET_H
+
+#include <stdbool.h>
+
+#include "fft.h"
+#include "noisefloor.h"
+
+typedef struct onset onset_t;
+
+/* spectral alternative to thresholding broadband rms.
+ *
+ * each hop is downmixed into a sliding ONSET_FFT_SIZE window, which is
+ * transformed and compared bin by bin against a noise floor learned while
+ * calibrating. only the band where the piano's harmonics carry most of their
+ * energy is looked at, so HVAC rumble and pedal thumps below it don't count.
+ * a hop is active when
+ *  - at least ONSET_MIN_HARMONICS bins are harmonic peaks: local maxima that
+ *    stand ONSET_PEAK_RATIO above the floor and ONSET_PEAK_CONTRAST above the
+ *    bins around them. a soft note is quiet broadband but still has sharp
+ *    peaks, while broadband noise getting louder (the fan speeding up) has
+ *    none, or
+ *  - spectral flux, how much the band rose since the last hop, stood out
+ *    from its recent average within the last ONSET_HOLD_MS (a note's attack).
+ *    the average and spread start from calibration and then follow the
+ *    background over ONSET_FLUX_AVERAGE_MS, so louder noise doesn't read as
+ *    a string of onsets.
+ */
+void onset_init(onset_t *self, int channels, int sample_rate, int hop_frames);
+void onset_destroy(onset_t *self);
+
+/* learns the noise floor from every hop between begin and end. until the
+ * first calibration ends, no hop is active.
+ */
+void onset_begin_calibration(onset_t *self);
+void onset_end_calibration(onset_t *self);
+
+/* nframes is hop_frames, except perhaps at the end of input */
+void onset_process(onset_t *self, const short *samples, int nframes);
+
+/* after calibration, moves the floor toward the last hop: each bin's floor
+ * follows the median of that bin over time, leaving out harmonic peaks.
+ * rises by at most ONSET_FLOOR_RISE_DB a second.
+ */
+void onset_follow_floor(onset_t *self);
+
+bool   onset_active(const onset_t *self);
+int    onset_harmonics(const onset_t *self);   // peaks found in the last hop
+double onset_harmonic_db(const onset_t *self); // their energy over the floor's in the same bins
+double onset_flux(const onset_t *self);        // for the last hop
+
+#define ONSET_FFT_SIZE      (1024)      // 23ms at 44100, 43Hz per bin
+#define ONSET_BAND_LOW_HZ   (100)
+#define ONSET_BAND_HIGH_HZ  (5000)
+#define ONSET_PEAK_RATIO    (10.0)      // 10dB
+#define ONSET_PEAK_CONTRAST (8.0)       // 9dB over the mean of the bins 2-4 away on either side
+#define ONSET_MIN_HARMONICS (3)
+#define ONSET_FLUX_SIGMAS   (6.0)       // an onset is flux this many deviations over its average
+#define ONSET_FLUX_AVERAGE_MS (1000)
+#define ONSET_FLOOR_RISE_DB (1.0)
+#define ONSET_HOLD_MS       (200)
+
+struct onset
+{
+    fft_t       fft;
+    int         channels;
+    int         sample_rate;
+    int         low_bin;
+    int         high_bin;           // exclusive
+
+    float      *window;             // hann, ONSET_FFT_SIZE
+    float      *history;            // mono, the last ONSET_FFT_SIZE frames
+    float      *frame;              // history * window
+    float      *power;              // ONSET_FFT_SIZE / 2 + 1 bins
+    float      *floor;
+    float      *prev;               // log(1 + power / floor) of the last hop, per bin
+    noisefloor_t *follow;           // per bin, of its amplitude
+
+    bool        calibrating;
+    bool        calibrated;
+    int         calibration_hops;
+    double     *floor_accum;
+    double      flux_sum;
+    double      flux_sum_squares;
+    double      flux_mean;          // moving average of flux
+    double      flux_dev;           // moving average of its deviation from that
+    double      flux_threshold;
+
+    int         hold_frames;        // left until a flux onset stops counting
+    double      harmonic_ratio;
+    double      flux;
+    int         harmonics;
+    bool        active;
+};
+
+#endif
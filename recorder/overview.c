@@ -0,0 +1,114 @@
+#include "overview.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+void overview_init(overview_t *self, int frames_per_point) {
+    memset(self, 0, sizeof(*self));
+    self->frames_per_point = frames_per_point;
+}
+
+void overview_free(overview_t *self) {
+    int level;
+    for (level = 0; level < OVERVIEW_MAX_LEVELS; level++) free(self->points[level]);
+    overview_init(self, self->frames_per_point);
+}
+
+static void overview_push(overview_t *self, int level, overview_point_t point) {
+    if (self->count[level] == self->capacity[level]) {
+        int capacity = self->capacity[level] > 0 ? self->capacity[level] * 2 : 256;
+        overview_point_t *points = realloc(self->points[level], sizeof(*points) * capacity);
+        if (points == NULL) failf("out of memory growing waveform overview");
+        self->points[level]   = points;
+        self->capacity[level] = capacity;
+    }
+    self->points[level][self->count[level]++] = point;
+    if (level + 1 == OVERVIEW_MAX_LEVELS) return;
+
+    overview_pending_t *p = &self->pending[level];
+    if (p->n == 0 || point.min < p->min) p->min = point.min;
+    if (p->n == 0 || point.max > p->max) p->max = point.max;
+    p->sum_squares += (double)point.rms * point.rms;
+    if (++p->n < OVERVIEW_FACTOR) return;
+
+    overview_point_t next = { .min = p->min, .max = p->max, .rms = (int16_t)sqrt(p->sum_squares / p->n) };
+    memset(p, 0, sizeof(*p));
+    overview_push(self, level + 1, next);
+}
+
+void overview_add(overview_t *self, const levels_t *levels) {
+    overview_point_t point = {
+        .min = (int16_t)levels->min,
+        .max = (int16_t)levels->max,
+        .rms = (int16_t)fmin(levels_rms(levels) * 32768.0, 32767.0),
+    };
+    overview_push(self, 0, point);
+}
+
+void overview_flush(overview_t *self) {
+    int level;
+    for (level = 0; level + 1 < OVERVIEW_MAX_LEVELS; level++) {
+        overview_pending_t *p = &self->pending[level];
+        if (p->n == 0) continue;
+        overview_point_t next = { .min = p->min, .max = p->max, .rms = (int16_t)sqrt(p->sum_squares / p->n) };
+        memset(p, 0, sizeof(*p));
+        overview_push(self, level + 1, next);
+    }
+}
+
+int overview_count(const overview_t *self, int level) {
+    return level >= 0 && level < OVERVIEW_MAX_LEVELS ? self->count[level] : 0;
+}
+
+int overview_read(const overview_t *self, int level, int offset, overview_point_t *points, int max) {
+    int n = overview_count(self, level) - offset;
+    if (offset < 0 || n <= 0) return 0;
+    if (n > max) n = max;
+    memcpy(points, self->points[level] + offset, sizeof(*points) * n);
+    return n;
+}
+
+bool overview_save(const overview_t *self, const char *path, int sample_rate) {
+    char tmppath[1024];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    FILE *f = fopen(tmppath, "wb");
+    if (f == NULL) {
+        tracef("couldn't write peak file %s: %s", tmppath, strerror(errno));
+        return false;
+    }
+
+    struct {
+        char     magic[8];
+        uint32_t sample_rate;
+        uint32_t frames_per_point;
+        uint32_t factor;
+        uint32_t levels;
+        uint32_t count[OVERVIEW_MAX_LEVELS];
+    } header;
+    memcpy(header.magic, OVERVIEW_MAGIC, sizeof(header.magic));
+    header.sample_rate      = sample_rate;
+    header.frames_per_point = self->frames_per_point;
+    header.factor           = OVERVIEW_FACTOR;
+    header.levels           = OVERVIEW_MAX_LEVELS;
+
+    bool ok = true;
+    int level;
+    for (level = 0; level < OVERVIEW_MAX_LEVELS; level++) header.count[level] = self->count[level];
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (level = 0; level < OVERVIEW_MAX_LEVELS && ok; level++) {
+        int n = self->count[level];
+        ok = n == 0 || fwrite(self->points[level], sizeof(overview_point_t), n, f) == (size_t)n;
+    }
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tmppath, path) != 0) ok = false;
+    if (!ok) {
+        tracef("couldn't write peak file %s: %s", path, strerror(errno));
+        unlink(tmppath);
+    }
+    return ok;
+}
@@ -0,0 +1,85 @@
+#ifndef INCLUDED_OVERVIEW_H
+#define INCLUDED_OVERVIEW_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "levels.h"
+
+typedef struct overview overview_t;
+
+/* a stretch of audio as a waveform view needs it: the most negative and most
+ * positive sample on any channel (or 0), and the rms, all in 16 bit sample units
+ */
+typedef struct {
+    int16_t     min;
+    int16_t     max;
+    int16_t     rms;
+} overview_point_t;
+
+/* a waveform overview of one take, at several resolutions, built as the take
+ * is recorded.
+ *
+ * level 0 has a point per frames_per_point frames, each from the levels_t
+ * metered for them. every OVERVIEW_FACTOR points of a level make one point
+ * of the next, so each level is OVERVIEW_FACTOR times coarser than the one
+ * before and all of them together are a third bigger than level 0. a view
+ * at any zoom reads the level closest to a point per pixel instead of
+ * touching the audio.
+ *
+ * not thread safe; the encoder locks around it.
+ */
+void overview_init(overview_t *self, int frames_per_point);
+void overview_free(overview_t *self);
+
+/* appends a level 0 point, and any coarser ones it completes */
+void overview_add(overview_t *self, const levels_t *levels);
+
+/* at the end of the take: turns whatever is left over on each level into
+ * one last, shorter, point of the next
+ */
+void overview_flush(overview_t *self);
+
+int  overview_count(const overview_t *self, int level);
+
+/* copies up to max points of a level, starting at offset. returns how many */
+int  overview_read(const overview_t *self, int level, int offset, overview_point_t *points, int max);
+
+/* writes the overview as a peak file:
+ *
+ *   char     magic[8]                      OVERVIEW_MAGIC
+ *   uint32   sample_rate
+ *   uint32   frames_per_point              at level 0
+ *   uint32   factor                        OVERVIEW_FACTOR
+ *   uint32   levels                        OVERVIEW_MAX_LEVELS
+ *   uint32   count[OVERVIEW_MAX_LEVELS]    points in each level
+ *   int16    min, max, rms                 every point of level 0, then level 1, ...
+ *
+ * native endian. written to path + ".tmp" and renamed, so it's either all
+ * there or not at all.
+ */
+bool overview_save(const overview_t *self, const char *path, int sample_rate);
+
+#define OVERVIEW_MAGIC          "rtppeak1"
+#define OVERVIEW_FACTOR         (4)
+#define OVERVIEW_MAX_LEVELS     (8)         // at 10ms a point, the coarsest is ~3 minutes a point
+#define OVERVIEW_SUFFIX         ".peaks"    // a take's peak file is its filename + this
+
+// the points of a level that haven't made a point of the next yet
+typedef struct {
+    int         min;
+    int         max;
+    double      sum_squares;                // of the points' rms
+    int         n;
+} overview_pending_t;
+
+struct overview
+{
+    int                 frames_per_point;
+    overview_point_t   *points[OVERVIEW_MAX_LEVELS];
+    int                 count[OVERVIEW_MAX_LEVELS];
+    int                 capacity[OVERVIEW_MAX_LEVELS];
+    overview_pending_t  pending[OVERVIEW_MAX_LEVELS];
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
 
 #include <pthread.h>
 #include <sched.h>
@@ -19,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -28,21 +30,69 @@
 #include <portaudio.h>
 
 #include "utils.h"
-
-const char  *DEVICE_NAME                  = "USB Audio CODEC: USB Audio (hw:1,0)";
+#include "encoder.h"
+#include "diskwriter.h"
+#include "capture.h"
+#include "winstats.h"
+#include "histo.h"
+#include "monitor.h"
+#include "onset.h"
+#include "noisefloor.h"
+#include "uploadq.h"
+#include "uploader.h"
+#include "livesink.h"
+#include "catalog.h"
+#include "overview.h"
+
+const char  *DEVICE_NAME                  = "USB Audio CODEC: USB Audio (hw:1,0)";   // what's recorded unless -D says otherwise
+const int    STREAM_FIRST_CPU             = 1;         // stream n's audio thread is pinned to cpu STREAM_FIRST_CPU + n, wrapping. -1 doesn't pin
+const int    STREAM_PRIORITY              = 1;         // SCHED_FIFO priority of the audio threads, when run as root
 const int    SAMPLE_RATE                  = 44100;
 const int    CHANNELS                     = 2;
 const int    FRAMES_PER_BUFFER            = 4410;
+const int    CALLBACK_FRAMES_PER_BUFFER   = 256;       // portaudio period size in callback capture mode
+const int    CAPTURE_RING_NBUFFERS        = 8;         // buffers the audio loop may fall behind the capture callback
+const int    ANALYSIS_HOP_FRAMES          = 441;       // detection + metering step (10ms). must divide FRAMES_PER_BUFFER
 
 const int    BASE_RMS_NBUFFERS            = 20;        // number of buffers of audio to use when determining the 'quiet' audio level at startup
 const int    PREROLL_NBUFFERS             = 25;        // number of buffers of pre-roll to keep around 
+const int    DETECT_NBUFFERS              = 25;        // number of buffers in the loudness detection window
+const int    DETECT_SMOOTH_HOPS           = 10;        // detection + base level use the rms of the last this many hops
 const double NOISE_THRESHOLD              = 1.3;       // if RMS for a buffer > status.base_level * NOISE_THRESHOLD, then it is considered noisy
+const double NOISE_FLOOR_PERCENTILE       = 0.5;       // after calibration, base level follows this percentile of quiet hop levels
+const double NOISE_FLOOR_RISE_DB          = 1.0;       // dB/s base level can rise; it falls (1 - p) / p times as fast
+const double NOISE_FLOOR_QUIET            = 4.0;       // hops louder than this * base level don't move it (music, mostly)
+const double NOISE_FLOOR_PUBLISH_DB       = 0.5;       // base level is republished when it has moved this far
+const char  *DETECTOR                     = "rms";     // what makes a hop loud: "rms" (see NOISE_THRESHOLD) or "spectral" (see onset.h)
 const int    MIN_RECORDING_LENGTH_SECONDS = 15;
-
+const int    ENCODE_THREADS               = 4;         // > 1 encodes in parallel on a worker pool (the odroid-u2 has 4 cores)
+const char  *ENCODE_PROFILE               = "auto";    // level 0-8 or auto, [blocksize N] [apodization SPEC]. see encoder_profile_parse
+const int    ENCODE_RING_NBUFFERS         = 50;        // number of buffers the encoder thread may fall behind before we drop audio
+const int    CHECKPOINT_SECONDS           = 5;         // most audio a crash or power loss can cost a recording
+const int    WRITE_BUFFER_KB              = 256;       // encoded audio is written to the card this much at a time...
+const int    WRITE_NBUFFERS               = 32;        // ...from up to this many staged buffers (~1 minute of FLAC) before the encoder waits
+const bool   WRITE_DIRECT                 = false;     // write recordings with O_DIRECT, bypassing the page cache
+const int    MONITOR_RING_NBUFFERS        = 8;         // buffers of monitor audio the network thread may fall behind before they're dropped
+const int    MONITOR_MAX_BEHIND_MS        = 100;       // a monitor listener with more audio than this still unsent skips frames
+const char  *UPLOAD_URL                   = "https://api.soundcloud.com";
+const char  *UPLOAD_LOGIN                 = ".soundcloudlogin";    // in $HOME, username + password on two lines
+const char  *UPLOAD_TOKEN                 = ".soundcloudtoken";    // in $HOME, where the login is remembered
+const char  *UPLOAD_ARTWORK               = "/usr/local/share/recordthepiano/logo.png";
+const char  *LIVE_UPLOAD_SINK             = "";        // directory or http(s) url to copy recordings to as they're made, see livesink.h
+const int    LIVE_UPLOAD_INTERVAL_MS      = 2000;      // how often new audio is sent there
+const int    UPLOAD_WORKERS               = 2;         // uploads in flight at once
+const int    UPLOAD_RETRY_INITIAL_SECONDS = 30;        // a failed upload waits this long, doubling per failure...
+const int    UPLOAD_RETRY_MAX_SECONDS     = 3600;      // ...up to this
+const char  *CATALOG_PATH                 = "catalog.db";   // every kept take, for the list and info commands
+const int    LIST_DEFAULT_TAKES           = 20;        // takes per page of "list" unless it asks for more...
+const int    LIST_MAX_TAKES               = 200;       // ...up to this
+
+#define      MAX_STREAMS                  (8)
+#define      MAX_STREAM_NAME              (21)         // so "<24 char start>-<name>,<up to 10 digits>s.flac" fits a catalog name
 #define      LISTEN_PORT                  (10123)
-#define      LISTEN_BACKLOG               (10)
-#define      EPOLL_MAX_EVENTS             (10)
-#define      MAX_CONNECTIONS              (20)
+#define      LISTEN_BACKLOG               (128)
+#define      EPOLL_MAX_EVENTS             (64)
+#define      CONN_MAX_OUTPUT              (64 * 1024)  // bytes a client may fall behind on reading before it is dropped
 
 typedef enum {
     STATE_INITIALIZING,
@@ -74,13 +124,35 @@ const char *record_mode_to_str(record_mode_t record_mode) {
     }
 }
 
+typedef enum {
+    DETECTOR_RMS,
+    DETECTOR_SPECTRAL
+} detector_t;
+
+const char *detector_to_str(detector_t detector) {
+    switch (detector) {
+        case DETECTOR_RMS:      return "rms";
+        case DETECTOR_SPECTRAL: return "spectral";
+        default:                return "unknown";
+    }
+}
+
+static bool detector_parse(const char *str, detector_t *detector) {
+    if      (strcmp(str, "rms")      == 0) *detector = DETECTOR_RMS;
+    else if (strcmp(str, "spectral") == 0) *detector = DETECTOR_SPECTRAL;
+    else return false;
+    return true;
+}
+
 typedef struct {
     record_mode_t       record_mode;
     state_t             state;
-    double              level;
+    double              level;          // rms of the last hop
+    double              peak;           // largest sample in the last hop, in [0,1]
     double              base_level;
     int                 clipped_frames;
     double              recording_time;
+    int                 stream;         // which one it's from
 } audio_status_t;
 
 typedef enum {
@@ -92,6 +164,9 @@ typedef enum {
     COMMAND_TYPE_UNPAUSE,
     COMMAND_TYPE_STOP,
     COMMAND_TYPE_CANCEL,
+    COMMAND_TYPE_FOLLOW_START,      // from a linked stream's leader: it started recording...
+    COMMAND_TYPE_FOLLOW_KEEP,       // ...and stopped and kept it...
+    COMMAND_TYPE_FOLLOW_DISCARD,    // ...or threw it away
 } command_type_t;
 
 const char *command_type_to_str(command_type_t type) {
@@ -104,142 +179,364 @@ const char *command_type_to_str(command_type_t type) {
         case COMMAND_TYPE_UNPAUSE: return "unpause";
         case COMMAND_TYPE_STOP: return "stop";
         case COMMAND_TYPE_CANCEL: return "cancel";
+        case COMMAND_TYPE_FOLLOW_START: return "follow_start";
+        case COMMAND_TYPE_FOLLOW_KEEP: return "follow_keep";
+        case COMMAND_TYPE_FOLLOW_DISCARD: return "follow_discard";
         default: return "unknown";
     }
 }
 
 typedef struct {
     command_type_t type;
+    time_t         start;           // FOLLOW_START: when the leader's take started, so linked takes share a name
+    bool           skip_preroll;    // FOLLOW_START: the leader's take has no preroll, so theirs mustn't either
 } command_t;
 
+// parts of the audio loop whose cpu time is accounted separately
+typedef enum {
+    STAGE_READ,         // waiting on capture/replay + copying into the preroll
+    STAGE_ANALYSIS,     // levels, detection window, calibration
+    STAGE_CONTROL,      // commands + state machine
+    STAGE_QUEUE,        // handing audio + start/stop to the encoder
+    STAGE_STATUS,       // publishing status to the network thread
+    NSTAGES
+} stage_t;
+
+const char *stage_to_str(stage_t stage) {
+    switch (stage) {
+        case STAGE_READ:     return "read";
+        case STAGE_ANALYSIS: return "analysis";
+        case STAGE_CONTROL:  return "control";
+        case STAGE_QUEUE:    return "queue";
+        case STAGE_STATUS:   return "status";
+        default:             return "unknown";
+    }
+}
+
+// one capture -> analysis -> encode pipeline, with its own audio thread: a
+// device, a channel pair of a multichannel one (see the README), or a
+// replayed session. every stream is CHANNELS x SAMPLE_RATE.
+typedef struct stream {
+    int             index;
+    char            name[MAX_STREAM_NAME + 1];  // goes in its recordings' names. "" when it's the only stream
+    char            prefix[40];         // for its traces: "<name>: ", or ""
+    char            source[256];        // device name or replay path
+    struct stream  *leader;             // linked: starts + stops when the leader does, instead of on its own
+    capture_t       capture;
+    encoder_t       encoder;
+    int             control_read_fd;    // commands for its audio loop
+    int             control_write_fd;
+    pthread_t       thread;
+    int             result;             // what its audio loop returned
+
+    // cpu time per stage since startup, and wall time per stage per pass
+    long long       stage_cpu_us[NSTAGES];
+    histo_t         stage_latency[NSTAGES];
+    char            histo_names[NSTAGES + 2][48];
+} stream_t;
+
+static stream_t            streams[MAX_STREAMS];
+static int                 nstreams;
+
+typedef struct {
+    stream_t   *stream;
+    long long   cpu_us;             // when the current stage started
+    long long   wall_us;
+    long long   pass_us[NSTAGES];   // wall time per stage in this pass of the loop
+} stage_clock_t;
+
+static void stage_start(stage_clock_t *clock, stream_t *stream) {
+    memset(clock, 0, sizeof(*clock));
+    clock->stream  = stream;
+    clock->cpu_us  = thread_cpu_us();
+    clock->wall_us = now_us();
+}
+
+// charges the time since the last stage ended to stage
+static void stage_end(stage_clock_t *clock, stage_t stage) {
+    long long cpu  = thread_cpu_us();
+    long long wall = now_us();
+    clock->stream->stage_cpu_us[stage] += cpu - clock->cpu_us;
+    clock->pass_us[stage]  += wall - clock->wall_us;
+    clock->cpu_us  = cpu;
+    clock->wall_us = wall;
+}
+
+// records one pass of the loop into the latency histograms
+static void stage_publish(stage_clock_t *clock) {
+    int stage;
+    for (stage = 0; stage < NSTAGES; stage++) {
+        histo_record(&clock->stream->stage_latency[stage], clock->pass_us[stage]);
+        clock->pass_us[stage] = 0;
+    }
+}
+
 static audio_status_t DEFAULT_AUDIO_STATUS = {
     .level          = 0.0,
+    .peak           = 0.0,
     .base_level     = 0.0,
     .record_mode    = RECORD_MODE_AUTO,
     .state          = STATE_INITIALIZING,
     .clipped_frames = 0,
-    .recording_time = 0.0
+    .recording_time = 0.0,
+    .stream         = 0,
 };
 
-typedef struct {
+// status fields a client can subscribe to
+typedef enum {
+    STATUS_FIELD_LEVEL      = 1 << 0,
+    STATUS_FIELD_TIME       = 1 << 1,
+    STATUS_FIELD_MODE       = 1 << 2,
+    STATUS_FIELD_STATE      = 1 << 3,
+    STATUS_FIELD_BASE_LEVEL = 1 << 4,
+    STATUS_FIELD_CLIP       = 1 << 5,
+    STATUS_FIELD_PEAK       = 1 << 6,
+    STATUS_FIELD_LAST       = STATUS_FIELD_PEAK,
+    STATUS_FIELD_ALL        = (1 << 7) - 1,
+    STATUS_FIELD_LEGACY     = STATUS_FIELD_ALL & ~STATUS_FIELD_PEAK,  // what a client that hasn't subscribed gets
+} status_field_t;
+
+const char *status_field_to_str(status_field_t field) {
+    switch (field) {
+        case STATUS_FIELD_LEVEL:      return "level";
+        case STATUS_FIELD_TIME:       return "time";
+        case STATUS_FIELD_MODE:       return "mode";
+        case STATUS_FIELD_STATE:      return "state";
+        case STATUS_FIELD_BASE_LEVEL: return "base_level";
+        case STATUS_FIELD_CLIP:       return "clip";
+        case STATUS_FIELD_PEAK:       return "peak";
+        default:                      return "unknown";
+    }
+}
+
+typedef struct connection {
     int             sock;
     lineparser_t    lineparser;
+    bool            dead;               // closed; freed at the end of this pass of the network loop
+    struct connection *next_dead;
+
+    // what the socket wouldn't take yet, sent as EPOLLOUT comes in
+    char           *out;
+    int             out_len;
+    int             out_cap;
+
+    // every client gets whatever changed of its fields once per interval.
+    // clients that haven't subscribed get the legacy fields once per buffer,
+    // as they always have, one line per field. subscribers get a "status ..."
+    // frame at the rate they asked for.
+    bool            subscribed;
+    int             fields;             // status_field_t mask
+    long long       interval_us;        // 0 means every update
+    long long       next_frame_us;
+    int             dirty;              // subscribed fields changed since the last frame
+    int             clip_accum;         // clipped samples since the last frame
+    double          peak_accum;         // highest peak since the last frame
+
+    // live audio, see monitor.h
+    monitor_format_t monitor_format;
+    int             monitor_dropped;    // frames skipped since the last one sent
+
+    // the current take's waveform, see the overview command
+    bool            overview;
+    int             overview_level;
+    int             overview_stream;
+    int             overview_take;      // the take it's being sent, 0 for none
+    int             overview_sent;      // points of it sent so far
 } connection_t;
 
 // status pipe is used to communicate status back to the network loop
 static int                 status_pipe_read_fd;  
 static int                 status_pipe_write_fd;
 
-// control pipe is used to send commands to the audio loop
-static int                 control_pipe_read_fd;
-static int                 control_pipe_write_fd;
+// open connections indexed by fd. network thread only.
+static connection_t      **conns;
+static int                 conns_cap;
+static int                 conns_max_fd = -1;
+static int                 nconns;
+static connection_t       *dead_conns;
 
-static connection_t        connections[MAX_CONNECTIONS];
+// the thread that writes what every stream's encoder encodes to disk
+static diskwriter_t        diskwriter;
 
-int run(int device) {
-    PaStreamParameters input_params  = {0,};
-    input_params.device                    = device;
-    input_params.channelCount              = 2;
-    input_params.sampleFormat              = paInt16;
-    input_params.suggestedLatency          = Pa_GetDeviceInfo(device)->defaultHighInputLatency;
-    input_params.hostApiSpecificStreamInfo = NULL;
+static detector_t          detector;
 
-    int err;
+static histo_t             upload_latency;
+static uploadq_t           uploadq;
+static uploader_t          uploader;
+static livesink_t          livesink;
+static catalog_t           catalog;
+static bool                live_upload;
 
-    PaStream *stream;
-    err = Pa_OpenStream(&stream, 
-                        &input_params, 
-                        NULL,
-                        SAMPLE_RATE, 
-                        FRAMES_PER_BUFFER, 
-                        paNoFlag, 
-                        NULL, NULL);
-    if (err != paNoError) {
-        tracef("error initializing stream: %s", Pa_GetErrorText(err));
-        return 1;
+// live audio feed from the audio loop to the network thread
+static monitor_t           monitor;
+static int                 monitor_listeners;   // network thread only
+static histo_t             monitor_latency;
+
+static int                 overview_listeners;  // network thread only
+
+// traces from a stream's audio loop say which stream they're from
+#define stream_tracef(stream, fmt, ...) tracef("%s" fmt, (stream)->prefix, ##__VA_ARGS__)
+
+// tells a stream's audio loop to do something
+static void stream_send(stream_t *stream, const command_t *cmd) {
+    if (sizeof(*cmd) != write(stream->control_write_fd, cmd, sizeof(*cmd))) {
+        failf("short write on command pipe");
     }
+}
 
-    err = Pa_StartStream(stream);
-    if (err != paNoError) {
-        tracef("error starting stream: %s", Pa_GetErrorText(err));
-        return 1;
+// passes what a leader just did on to the streams linked to it
+static void stream_follow(stream_t *stream, command_type_t type, time_t start, bool skip_preroll) {
+    command_t cmd = { .type = type, .start = start, .skip_preroll = skip_preroll };
+    int i;
+    for (i = 0; i < nstreams; i++) {
+        if (streams[i].leader == stream) stream_send(&streams[i], &cmd);
+    }
+}
+
+// hands the current recording to the encoder to be finished and kept or
+// discarded. returns true if it will be kept. a linked stream's take is kept
+// or discarded with its leader's, whatever its length.
+static bool end_recording(stream_t *stream, audio_status_t *status, int record_buf_idx, char *filenamebuf, bool cancel) {
+    long long end_record_start = now_us();
+    int n_seconds = (int)((long long)record_buf_idx * (long long)FRAMES_PER_BUFFER /  (long long)SAMPLE_RATE);
+    status->state = STATE_IDLE;
+    char numbuf[128];
+    const char *finalname = NULL;
+    if (cancel) {
+        stream_tracef(stream, "discarding recording because user told us to");
+    } else if (stream->leader == NULL && status->record_mode == RECORD_MODE_AUTO &&
+               n_seconds < MIN_RECORDING_LENGTH_SECONDS) {
+        stream_tracef(stream, "discarding recording because too short (%ds < %ds)", n_seconds, MIN_RECORDING_LENGTH_SECONDS);
+    } else {
+        snprintf(numbuf, sizeof(numbuf), ",%ds.flac", n_seconds);
+        strcat(filenamebuf, numbuf);
+        finalname = filenamebuf;
     }
 
+    // flush, close + rename/unlink happen on the finalizer thread
+    if (!encoder_end(&stream->encoder, finalname)) {
+        failf("couldn't queue end of recording. this shouldn't happen");
+    }
+    stream_tracef(stream, "stopped recording in %dus", (int)(now_us() - end_record_start));
+    stream_follow(stream, finalname != NULL ? COMMAND_TYPE_FOLLOW_KEEP : COMMAND_TYPE_FOLLOW_DISCARD, 0, false);
+    return finalname != NULL;
+}
+
+// runs a stream's audio loop until capture fails or a replay runs out
+int run(stream_t *stream) {
+    capture_t *capture = &stream->capture;
+    int err;
+
+    // a replay going as fast as it can outruns the network thread; status is
+    // only ever the latest value, so it's fine to skip some
+    bool replay_fast = capture->mode == CAPTURE_MODE_REPLAY && !capture->paced;
+    long long buffer_us = (long long)FRAMES_PER_BUFFER * 1000000 / SAMPLE_RATE;
+
+    long long total_bufs     = 0;
+    long long total_hops     = 0;
+    long long stage_cpu_start[NSTAGES];
+    memcpy(stage_cpu_start, stream->stage_cpu_us, sizeof(stage_cpu_start));
+    stage_clock_t stage_clock;
+    stage_start(&stage_clock, stream);
+    long long run_start      = now_us();
+    long long run_cpu_start  = process_cpu_us();
+    long long encoder_cpu_start = encoder_cpu_us(&stream->encoder);
+    int       nkept          = 0;
+    int       ntakes         = 0;   // makes each take's tmp name its own, see encoder_begin
+    int       ndiscarded     = 0;
+
     int    buf_idx        = 0;
     int    record_buf_idx = 0;
 
-    // preroll + cached RMS values
-    short       rawsamples[FRAMES_PER_BUFFER * CHANNELS];
-    FLAC__int32    samples[FRAMES_PER_BUFFER * CHANNELS * PREROLL_NBUFFERS];
-    double        past_rms[PREROLL_NBUFFERS];
+    // detection runs per analysis hop; the preroll and the encoder deal in whole buffers
+    int    hops_per_buffer = capture_hops_per_buffer(capture);
+    int    detect_hops     = DETECT_NBUFFERS * hops_per_buffer;
+    int    base_hops       = BASE_RMS_NBUFFERS * hops_per_buffer;
+    int    init_hops       = 0;
+
+    // preroll + detection window. the preroll is kept as native int16; the
+    // encoder thread widens to what libflac wants only for audio it encodes.
+    size_t  preroll_bytes = sizeof(short) * FRAMES_PER_BUFFER * CHANNELS * PREROLL_NBUFFERS;
+    short  *samples       = malloc(preroll_bytes);
+    if (samples == NULL) {
+        stream_tracef(stream, "couldn't allocate preroll");
+        return 1;
+    }
+    memset(samples, 0, preroll_bytes);
+
+    // a hop's activity is its smoothed rms, or 1 if the spectral detector found it active.
+    // smoothing keeps a single noisy 10ms hop from counting as loud and
+    // holding a recording open.
+    winstats_t past_activity;
+    winstats_init(&past_activity, detect_hops, 0.0);
+    winstats_t recent_power;
+    winstats_init(&recent_power, DETECT_SMOOTH_HOPS, 0.0);
+    onset_t onset;
+    onset_init(&onset, CHANNELS, SAMPLE_RATE, ANALYSIS_HOP_FRAMES);
+    onset_begin_calibration(&onset);
 
     // for flac encoder
-    FLAC__StreamEncoder *encoder = NULL;
-    char tmpfilenamebuf[1024];
-    char filenamebuf[1024];
-    FILE *file = NULL;
+    char tmpfilenamebuf[ENCODER_MAX_FILENAME];
+    char filenamebuf[ENCODER_MAX_FILENAME];
     double base_rms_accum = 0;
+    noisefloor_t noise_floor;
+    noisefloor_init(&noise_floor, NOISE_FLOOR_PERCENTILE, NOISE_FLOOR_RISE_DB,
+                    (double)ANALYSIS_HOP_FRAMES / SAMPLE_RATE);
 
     audio_status_t status = DEFAULT_AUDIO_STATUS;
+    status.stream = stream->index;
+    bool   follower     = stream->leader != NULL;
+    time_t follow_start = 0;
 
-    if (geteuid() == 0) {
-        struct sched_param sparams = {0,};
-        sparams.sched_priority = 1;
-        int rc = sched_setscheduler(0, SCHED_FIFO, &sparams);
-        if (rc == -1) {
-            perror("sched_setscheduler");
-        } else {
-            tracef("set FIFO scheduler");
-        }
-    }
-
+    // each pass of the loop is one analysis hop, taken as soon as it has
+    // been captured. the last hop of each buffer also moves the buffer into
+    // the preroll and, when recording, on to the encoder.
     for (;;) {
         int preroll_idx   = buf_idx % PREROLL_NBUFFERS;
         int sample_offset = FRAMES_PER_BUFFER * CHANNELS * preroll_idx;
 
-        err = Pa_ReadStream(stream, rawsamples, FRAMES_PER_BUFFER);
+        double audio_seconds = (double)total_hops * ANALYSIS_HOP_FRAMES / SAMPLE_RATE;
+
+        const short     *hopsamples;
+        levels_t         levels;
+        err = capture_read_hop(capture, &hopsamples, &levels);
         if (err == paInputOverflowed) {
-            tracef("input overflow");
+            stream_tracef(stream, "input overflow");
             continue;
         }
+        if (err == CAPTURE_END_OF_INPUT) {
+            stream_tracef(stream, "end of input at %.1fs", audio_seconds);
+            if (status.state == STATE_RECORDING || status.state == STATE_PAUSED) {
+                end_recording(stream, &status, record_buf_idx, filenamebuf, false) ? nkept++ : ndiscarded++;
+            }
+            break;
+        }
         if (err != paNoError) {
-            tracef("error reading stream: %s", Pa_GetErrorText(err));
+            stream_tracef(stream, "error reading stream: %s", Pa_GetErrorText(err));
             return 1;
         }
-
-        // copy short buffer into int32 buffer since this is what libflac wants
-        int i;
-        for (i = 0; i < FRAMES_PER_BUFFER * CHANNELS; i++) {
-            samples[sample_offset + i] = rawsamples[i];
+        bool end_of_buffer = capture->hop == hops_per_buffer;
+        stage_end(&stage_clock, STAGE_READ);
+
+        // levels were metered by the capture path as the samples arrived
+        double rms = levels_rms(&levels);
+        status.level          = rms;
+        status.peak           = levels_peak(&levels);
+        status.clipped_frames = levels_clipped(&levels);
+
+        winstats_push(&recent_power, rms * rms);
+        double smoothed_rms = sqrt(winstats_mean(&recent_power));
+        double activity     = smoothed_rms;
+        if (detector == DETECTOR_SPECTRAL) {
+            onset_process(&onset, hopsamples, ANALYSIS_HOP_FRAMES);
+            activity = onset_active(&onset) ? 1.0 : 0.0;
         }
+        winstats_push(&past_activity, activity);
 
-        int clip = 0;
-
-        // compute RMS for this buffer
-        double accum = 0;
-        int frame, ch;
-        for (frame = 0; frame < FRAMES_PER_BUFFER; frame++) {
-            for (ch = 0; ch < CHANNELS; ch++) {
-                double sample = (double)samples[sample_offset + frame*CHANNELS + ch] / 32768.0;
-                accum += sample*sample;
-                if (sample > 0.99) clip++;
-            }
-        }
-        double rms = sqrt(accum / (FRAMES_PER_BUFFER * CHANNELS));
-        status.level = rms;
-
-        // warn on clipping
-        if (clip > 0) { tracef("%d frames clipped", clip); }
-        status.clipped_frames = clip;
-
-        past_rms[preroll_idx] = rms;
-
-        // compute number of loud buffers
-        int loud_bufs = 0;
+        // number of loud hops in the window, kept up to date incrementally
+        int loud_hops = winstats_loud(&past_activity);
         int idx;
-        for (idx = 0; idx < PREROLL_NBUFFERS; idx++) {
-            if (past_rms[idx] > status.base_level * NOISE_THRESHOLD) loud_bufs++;
-        }
+        stage_end(&stage_clock, STAGE_ANALYSIS);
 
         // process pending commands
         bool skip_preroll      = false;
@@ -248,20 +545,27 @@ int run(int device) {
         bool cancel_recording  = false;
 
         command_t cmd;
-        while (sizeof(cmd) == read(control_pipe_read_fd, &cmd, sizeof(cmd))) {
-            tracef("AUDIO GOT CMD %s", command_type_to_str(cmd.type));
+        while (sizeof(cmd) == read(stream->control_read_fd, &cmd, sizeof(cmd))) {
+            stream_tracef(stream, "AUDIO GOT CMD %s", command_type_to_str(cmd.type));
+            // a linked stream records when its leader does, and only then
+            if (follower && (cmd.type == COMMAND_TYPE_RECORD || cmd.type == COMMAND_TYPE_STOP ||
+                             cmd.type == COMMAND_TYPE_CANCEL)) {
+                continue;
+            }
             switch (cmd.type) {
                 case COMMAND_TYPE_AUTO: {
                     status.record_mode = RECORD_MODE_AUTO;
                 } break;
 
                 case COMMAND_TYPE_INITIALIZE: {
-                    memset(rawsamples, 0, sizeof(rawsamples));
-                    memset(samples, 0, sizeof(samples));
-                    memset(past_rms, 0, sizeof(past_rms));
+                    memset(samples, 0, preroll_bytes);
+                    winstats_clear(&past_activity);
+                    winstats_set_threshold(&past_activity, 0.0);
+                    onset_begin_calibration(&onset);
                     record_buf_idx = 0;
                     status.state = STATE_INITIALIZING;   
                     buf_idx        = 0;
+                    init_hops      = 0;
                     base_rms_accum = 0;
                     status.base_level = 0;
                     if (status.state == STATE_RECORDING || status.state == STATE_PAUSED) {
@@ -279,9 +583,9 @@ int run(int device) {
                     status.record_mode = RECORD_MODE_MANUAL;
                      if (status.state == STATE_RECORDING) {
                          status.state = STATE_PAUSED;
-                         tracef("paused");
+                         stream_tracef(stream, "paused");
                      } else {
-                         tracef("ignored pause when not recording");
+                         stream_tracef(stream, "ignored pause when not recording");
                      }
                 } break;
 
@@ -289,9 +593,9 @@ int run(int device) {
                     status.record_mode = RECORD_MODE_MANUAL;
                      if (status.state == STATE_PAUSED) {
                          status.state = STATE_RECORDING;
-                         tracef("unpaused");
+                         stream_tracef(stream, "unpaused");
                      } else {
-                         tracef("ignored unpause when not paused");
+                         stream_tracef(stream, "ignored unpause when not paused");
                      }
                 } break;
 
@@ -303,29 +607,45 @@ int run(int device) {
 
                 case COMMAND_TYPE_STOP: {
                     if (status.state == STATE_RECORDING || status.state == STATE_PAUSED) {
-                        loud_bufs = 0;
+                        loud_hops = 0;
                         status.record_mode = RECORD_MODE_MANUAL;
-                        memset(past_rms, 0, sizeof(past_rms));
+                        winstats_clear(&past_activity);
                         stop_recording = true;
                     }
                 } break;
 
                 case COMMAND_TYPE_CANCEL: {
                     if (status.state == STATE_RECORDING || status.state == STATE_PAUSED) {
-                        loud_bufs = 0;
-                        memset(past_rms, 0, sizeof(past_rms));
+                        loud_hops = 0;
+                        winstats_clear(&past_activity);
                         stop_recording   = true;
                         cancel_recording = true;
                     }
                 } break;
 
+                case COMMAND_TYPE_FOLLOW_START: {
+                    if (status.state == STATE_IDLE) {
+                        start_recording = true;
+                        skip_preroll    = cmd.skip_preroll;
+                        follow_start    = cmd.start;
+                    }
+                } break;
+
+                case COMMAND_TYPE_FOLLOW_KEEP:
+                case COMMAND_TYPE_FOLLOW_DISCARD: {
+                    if (status.state == STATE_RECORDING || status.state == STATE_PAUSED) {
+                        stop_recording   = true;
+                        cancel_recording = cmd.type == COMMAND_TYPE_FOLLOW_DISCARD;
+                    }
+                } break;
+
                 default: break;
             }
         }
 
         /*
-        tracef("in state machine state=%s start_recording=%d stop_recording=%d cancel_recording=%d loud_bufs=%d",
-                state_to_str(status.state), start_recording, stop_recording, cancel_recording, loud_bufs);
+        stream_tracef(stream, "in state machine state=%s start_recording=%d stop_recording=%d cancel_recording=%d loud_hops=%d",
+                state_to_str(status.state), start_recording, stop_recording, cancel_recording, loud_hops);
                 */
 
         // run state machine
@@ -334,13 +654,13 @@ int run(int device) {
                 break;
 
             case STATE_IDLE:
-                if (status.record_mode == RECORD_MODE_AUTO && loud_bufs > (PREROLL_NBUFFERS / 4)) {
+                if (!follower && status.record_mode == RECORD_MODE_AUTO && loud_hops > (detect_hops / 4)) {
                     start_recording = true;
                 }
                 break;
 
             case STATE_RECORDING:
-                if (status.record_mode == RECORD_MODE_AUTO && loud_bufs == 0) {
+                if (!follower && status.record_mode == RECORD_MODE_AUTO && loud_hops == 0) {
                     stop_recording  = true;
                 }
                 break;
@@ -349,158 +669,649 @@ int run(int device) {
                 break;
         }
 
+        stage_end(&stage_clock, STAGE_CONTROL);
+
         if (start_recording) {
-            status.state = STATE_RECORDING;
-            if (skip_preroll) {
-                record_buf_idx = 0;
+            long long begin_record_start = now_us();
+            if (detector == DETECTOR_SPECTRAL) {
+                stream_tracef(stream, "start recording at %.2fs (%d active hops / %d, %d harmonics at %+.1fdB, flux %.3f)",
+                        audio_seconds, loud_hops, detect_hops, onset_harmonics(&onset), onset_harmonic_db(&onset),
+                        onset_flux(&onset));
             } else {
-                record_buf_idx = PREROLL_NBUFFERS;
+                stream_tracef(stream, "start recording at %.2fs (%d loud hops / %d, mean rms %f, max rms %f)", audio_seconds,
+                        loud_hops, detect_hops, winstats_mean(&past_activity), winstats_max(&past_activity));
             }
-            long long begin_record_start = now_us();
-            tracef("start recording (%d loud bufs / %d)", loud_bufs, PREROLL_NBUFFERS);
 
+            // linked takes are named for when the leader's started, so they sort together
             struct tm start_time;
-            time_t tt = time(NULL);
+            time_t tt = follower ? follow_start : time(NULL);
             localtime_r(&tt, &start_time);
             strftime(filenamebuf, sizeof(filenamebuf), "%Y-%m-%dT%H:%M:%S%z", &start_time);
-            strftime(tmpfilenamebuf, sizeof(filenamebuf), "%Y-%m-%dT%H:%M:%S%z", &start_time);
-            strcat(tmpfilenamebuf, ".flac.tmp");
-
-            file = fopen(tmpfilenamebuf, "wb");
-            if (file == NULL) {
-                tracef("couldn't open file");
-                return 1;
-            }
-
-            encoder = FLAC__stream_encoder_new();
-            if (encoder == NULL) {
-                tracef("couldn't start flac encoder");
-                return 1;
+            if (stream->name[0] != '\0') {
+                strcat(filenamebuf, "-");
+                strcat(filenamebuf, stream->name);
             }
+            snprintf(tmpfilenamebuf, sizeof(tmpfilenamebuf), "%s.%d%s", filenamebuf, ++ntakes, ENCODER_TMP_SUFFIX);
 
-            FLAC__stream_encoder_set_channels(encoder, 2);
-            FLAC__stream_encoder_set_bits_per_sample(encoder, 16);
-            FLAC__stream_encoder_set_sample_rate(encoder, 44100);
-
-            FLAC__StreamEncoderInitStatus initstatus = FLAC__stream_encoder_init_FILE(encoder, file, NULL, NULL);
-            if (initstatus != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
-                tracef("couldn't init flac encoder");
-                return 1;
-            }
-
-            if (!skip_preroll) {
-                // encode the preroll
-                for (idx = preroll_idx + (PREROLL_NBUFFERS * 2 / 3); idx < preroll_idx + PREROLL_NBUFFERS; idx++) {
-                    int realidx           = idx     % PREROLL_NBUFFERS;
-                    if (!FLAC__stream_encoder_process_interleaved(encoder, &samples[realidx * FRAMES_PER_BUFFER * CHANNELS], FRAMES_PER_BUFFER)) {
-                        tracef("flac encoder process failed");
-                        return 1;
+            // file + encoder setup happens on the encoder thread
+            if (!encoder_begin(&stream->encoder, tmpfilenamebuf)) {
+                stream_tracef(stream, "couldn't start recording: encoder is %d buffers behind", ENCODE_RING_NBUFFERS);
+            } else {
+                status.state = STATE_RECORDING;
+                if (skip_preroll) {
+                    record_buf_idx = 0;
+                } else {
+                    record_buf_idx = PREROLL_NBUFFERS;
+
+                    // queue the preroll
+                    for (idx = preroll_idx + (PREROLL_NBUFFERS * 2 / 3); idx < preroll_idx + PREROLL_NBUFFERS; idx++) {
+                        int realidx           = idx     % PREROLL_NBUFFERS;
+                        if (!encoder_write(&stream->encoder, &samples[realidx * FRAMES_PER_BUFFER * CHANNELS], FRAMES_PER_BUFFER)) {
+                            stream_tracef(stream, "encoder overrun, dropped preroll buffer");
+                        }
                     }
                 }
+                long long begin_record_end = now_us();
+                stream_tracef(stream, "started recording in %dus", (int)(begin_record_end - begin_record_start));
+                stream_follow(stream, COMMAND_TYPE_FOLLOW_START, tt, skip_preroll);
             }
-            long long begin_record_end = now_us();
-            tracef("started recording in %dms", (int)((begin_record_end - begin_record_start) / 1000));
         }
 
         if (stop_recording) {
-            long long end_record_start = now_us();
-            tracef("stop recording (%d loud bufs / %d)", loud_bufs, PREROLL_NBUFFERS);
-            int n_seconds = (int)((long long)record_buf_idx * (long long)FRAMES_PER_BUFFER /  (long long)SAMPLE_RATE);
+            stream_tracef(stream, "stop recording at %.2fs (%d loud hops / %d)", audio_seconds, loud_hops, detect_hops);
+            end_recording(stream, &status, record_buf_idx, filenamebuf, cancel_recording) ? nkept++ : ndiscarded++;
             record_buf_idx = 0;
-            status.state = STATE_IDLE;
-            FLAC__stream_encoder_finish(encoder);
-            FLAC__stream_encoder_delete(encoder);
-            encoder = NULL;
-            file    = NULL;
-            char numbuf[128];
-            if (cancel_recording) {
-                tracef("discarding recording because user told us to");
-                unlink(tmpfilenamebuf);
-            } else if (status.record_mode == RECORD_MODE_AUTO && n_seconds < MIN_RECORDING_LENGTH_SECONDS) {
-                tracef("discarding recording because too short (%ds < %ds)", n_seconds, MIN_RECORDING_LENGTH_SECONDS);
-                unlink(tmpfilenamebuf);
-            } else {
-                snprintf(numbuf, sizeof(numbuf), ",%ds.flac", n_seconds);
-                strcat(filenamebuf, numbuf);
-                rename(tmpfilenamebuf, filenamebuf);
+        }
+
+        if (end_of_buffer) {
+            const short *rawsamples;
+            levels_t     buffer_levels;
+            capture_read_begin(capture, &rawsamples, &buffer_levels);
+            memcpy(&samples[sample_offset], rawsamples, sizeof(short) * FRAMES_PER_BUFFER * CHANNELS);
+            if (stream->index == 0) {
+                monitor_write(&monitor, rawsamples, FRAMES_PER_BUFFER, capture->captured_us - buffer_us);
             }
+            capture_read_end(capture);
 
-            long long end_record_end = now_us();
-            tracef("finalized recording in %dms", (int)((end_record_end - end_record_start) / 1000));
-        }
+            // warn on clipping, once per buffer
+            int clip = levels_clipped(&buffer_levels);
+            if (clip > 0) { stream_tracef(stream, "%d samples clipped (+%d/-%d)", clip, buffer_levels.clip_pos, buffer_levels.clip_neg); }
 
-        if (status.state == STATE_RECORDING) {
-            record_buf_idx++;
-            status.recording_time = (double)record_buf_idx * (double)FRAMES_PER_BUFFER /  (double)SAMPLE_RATE;
-            if (!FLAC__stream_encoder_process_interleaved(encoder, &samples[sample_offset], FRAMES_PER_BUFFER)) {
-                tracef("flac encoder process failed");
-                return 1;
+            if (status.state == STATE_RECORDING) {
+                record_buf_idx++;
+                if (!encoder_write(&stream->encoder, &samples[sample_offset], FRAMES_PER_BUFFER)) {
+                    stream_tracef(stream, "encoder overrun, dropped buffer (%d dropped so far)", stream->encoder.dropped_buffers);
+                }
             }
-        } else {
-            status.recording_time = (double)record_buf_idx * (double)FRAMES_PER_BUFFER /  (double)SAMPLE_RATE;
+            buf_idx++;
+            total_bufs++;
         }
+        status.recording_time = (double)record_buf_idx * (double)FRAMES_PER_BUFFER /  (double)SAMPLE_RATE;
+        stage_end(&stage_clock, STAGE_QUEUE);
 
         if (status.state == STATE_INITIALIZING) {
-            if (buf_idx < BASE_RMS_NBUFFERS) {
-                base_rms_accum += rms;
+            if (init_hops < base_hops) {
+                base_rms_accum += smoothed_rms;
             }
-            if (buf_idx == BASE_RMS_NBUFFERS) {
-                status.base_level = base_rms_accum / BASE_RMS_NBUFFERS;
-                tracef("ready to record. Baseline rms = %f", status.base_level);
+            if (init_hops == base_hops) {
+                status.base_level = base_rms_accum / base_hops;
+                if (detector == DETECTOR_SPECTRAL) {
+                    onset_end_calibration(&onset);
+                    winstats_set_threshold(&past_activity, 0.5);
+                    stream_tracef(stream, "ready to record. Baseline rms = %f, spectral flux threshold = %.3f", status.base_level,
+                           onset.flux_threshold);
+                } else {
+                    winstats_set_threshold(&past_activity, status.base_level * NOISE_THRESHOLD);
+                    stream_tracef(stream, "ready to record. Baseline rms = %f", status.base_level);
+                }
+                noisefloor_reset(&noise_floor, status.base_level);
                 status.state = STATE_IDLE;
             }
+        } else if (status.state == STATE_IDLE && smoothed_rms < noisefloor_level(&noise_floor) * NOISE_FLOOR_QUIET) {
+            // the room's noise changes (a fan comes on, the heating goes off), so the
+            // base level keeps following it between takes. never while recording: a
+            // long soft passage would pull the floor up under itself and end the take
+            // in the middle of the music.
+            noisefloor_push(&noise_floor, smoothed_rms);
+            if (detector == DETECTOR_SPECTRAL) onset_follow_floor(&onset);
+            double floor = noisefloor_level(&noise_floor);
+            if (fabs(20.0 * log10(floor / status.base_level)) >= NOISE_FLOOR_PUBLISH_DB) {
+                status.base_level = floor;
+                if (detector == DETECTOR_RMS) winstats_set_threshold(&past_activity, floor * NOISE_THRESHOLD);
+            }
         }
 
-        buf_idx++;
+        init_hops++;
+        total_hops++;
+        stage_end(&stage_clock, STAGE_ANALYSIS);
 
-        if (sizeof(status) != write(status_pipe_write_fd, &status, sizeof(status))) {
+        ssize_t status_written = write(status_pipe_write_fd, &status, sizeof(status));
+        if (status_written != sizeof(status) && !(replay_fast && status_written == -1 && errno == EAGAIN)) {
             failf("short write on status pipe. this shouldn't happen");
         }
+        stage_end(&stage_clock, STAGE_STATUS);
+        stage_publish(&stage_clock);
     }
 
-    //tracef("got frames rms=%f base=%f", rms, status.base_level);
-
+    //stream_tracef(stream, "got frames rms=%f base=%f", rms, status.base_level);
+
+    // wait for the last recording to land so the report covers all the work
+    encoder_flush(&stream->encoder);
+    capture_close(capture);
+
+    double    audio_seconds = (double)total_bufs * FRAMES_PER_BUFFER / SAMPLE_RATE;
+    double    wall_seconds  = (now_us() - run_start) / 1000000.0;
+    long long loop_cpu_us   = 0;
+    int       stage;
+    printf("%s%.1fs of audio in %.1fs: %.1fx real time, %.0f frames/s\n", stream->prefix, audio_seconds, wall_seconds,
+           audio_seconds / wall_seconds, total_bufs * FRAMES_PER_BUFFER / wall_seconds);
+    printf("%scpu:", stream->prefix);
+    for (stage = 0; stage < NSTAGES; stage++) {
+        long long cpu_us = stream->stage_cpu_us[stage] - stage_cpu_start[stage];
+        printf(" %s %.2fs,", stage_to_str(stage), cpu_us / 1000000.0);
+        loop_cpu_us += cpu_us;
+    }
+    long long encoder_cpu = encoder_cpu_us(&stream->encoder) - encoder_cpu_start;
+    long long other_cpu   = process_cpu_us() - run_cpu_start - loop_cpu_us - encoder_cpu;
+    printf(" encoder %.2fs, flac workers + other %.2fs\n", encoder_cpu / 1000000.0, other_cpu / 1000000.0);
+    printf("%srecordings: %d kept, %d discarded\n", stream->prefix, nkept, ndiscarded);
     return 0;
 }
 
-static void write_cmd(command_t *cmd) {
-    if (sizeof(*cmd) != write(control_pipe_write_fd, cmd, sizeof(*cmd))) {
-        failf("short write on command pipe");
+static int open_device(capture_t *capture, int device, capture_mode_t capture_mode) {
+    int err = capture_open(capture, device, capture_mode, CHANNELS, SAMPLE_RATE, FRAMES_PER_BUFFER,
+                           ANALYSIS_HOP_FRAMES, CALLBACK_FRAMES_PER_BUFFER, CAPTURE_RING_NBUFFERS);
+    if (err != paNoError && capture_mode == CAPTURE_MODE_CALLBACK) {
+        tracef("falling back to blocking capture");
+        err = capture_open(capture, device, CAPTURE_MODE_BLOCKING, CHANNELS, SAMPLE_RATE, FRAMES_PER_BUFFER,
+                           ANALYSIS_HOP_FRAMES, 0, 0);
     }
+    return err;
+}
+
+// commands from the network go to every stream
+static void write_cmd(command_t *cmd) {
+    int i;
+    for (i = 0; i < nstreams; i++) stream_send(&streams[i], cmd);
 }
 
+// the connection stays allocated until free_dead_conns, so whoever is
+// holding it further up the stack (lineparser, publish_status) is safe
 void ev_endconn(connection_t *conn, bool err) {
-    lineparser_destroy(&conn->lineparser);
+    if (conn->dead) return;
+    conn->dead = true;
+    if (conn->monitor_format != MONITOR_FORMAT_NONE && --monitor_listeners == 0) {
+        monitor_set_listening(&monitor, false);
+    }
+    if (conn->overview) overview_listeners--;
     shutdown(conn->sock, SHUT_RDWR);
     close(conn->sock);
-    conn->sock = 0;
+    conns[conn->sock] = NULL;
+    conn->next_dead = dead_conns;
+    dead_conns      = conn;
+    nconns--;
     if (err) {
-        tracef("closing socket due to error");
+        tracef("closing socket due to error (%d open)", nconns);
     } else {
-        tracef("closing socket due to eof");
+        tracef("closing socket due to eof (%d open)", nconns);
+    }
+}
+
+static void free_dead_conns() {
+    while (dead_conns != NULL) {
+        connection_t *conn = dead_conns;
+        dead_conns = conn->next_dead;
+        lineparser_destroy(&conn->lineparser);
+        free(conn->out);
+        free(conn);
+    }
+}
+
+// sends what the socket will take now and queues the rest for EPOLLOUT.
+// a client that lets CONN_MAX_OUTPUT pile up isn't reading and is dropped,
+// so one stalled client can't hold up the others or grow without bound.
+static void send_bytes(connection_t *conn, const char *buf, int len) {
+    if (conn->dead) return;
+    int off = 0;
+    if (conn->out_len == 0) {
+        int byteswritten = send(conn->sock, buf, len, MSG_NOSIGNAL);
+        if (byteswritten < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            ev_endconn(conn, true);
+            return;
+        }
+        if (byteswritten > 0) off = byteswritten;
+    }
+    if (off == len) return;
+
+    int need = conn->out_len + len - off;
+    if (need > CONN_MAX_OUTPUT) {
+        tracef("dropping slow client with %d bytes unsent", conn->out_len);
+        ev_endconn(conn, true);
+        return;
+    }
+    if (need > conn->out_cap) {
+        int cap = conn->out_cap > 0 ? conn->out_cap : 1024;
+        while (cap < need) cap *= 2;
+        conn->out = realloc(conn->out, cap);
+        if (conn->out == NULL) failf("out of memory queueing output");
+        conn->out_cap = cap;
     }
+    memcpy(conn->out + conn->out_len, buf + off, len - off);
+    conn->out_len = need;
 }
 
 static void send_message(connection_t *conn, const char *buf) {
-    int len = strlen(buf);
-    int i; 
-    int byteswritten = send(conn->sock, buf, len, 0);
-    if (len != byteswritten) {
-        ev_endconn(conn, byteswritten < 0);
+    send_bytes(conn, buf, strlen(buf));
+}
+
+// EPOLLOUT: the socket has room again
+static void flush_output(connection_t *conn) {
+    if (conn->out_len == 0) return;
+    int off = 0;
+    while (off < conn->out_len) {
+        int byteswritten = send(conn->sock, conn->out + off, conn->out_len - off, MSG_NOSIGNAL);
+        if (byteswritten < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ev_endconn(conn, true);
+                return;
+            }
+            break;
+        }
+        off += byteswritten;
     }
+    memmove(conn->out, conn->out + off, conn->out_len - off);
+    conn->out_len -= off;
 }
 
-static void broadcast_message(const char *buf) {
-    int i; 
-    for (i = 0; i < MAX_CONNECTIONS; i++) {
-        connection_t *conn = &connections[i];
-        if (conn->sock != 0) 
+// edge triggered, so read until the socket is empty or we'd miss the rest
+static void read_input(connection_t *conn) {
+    char buf[4096];
+    while (!conn->dead) {
+        int bytesread = recv(conn->sock, buf, sizeof(buf), 0);
+        if (bytesread < 0 && errno == EINTR) continue;
+        if (bytesread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (bytesread <= 0) {
+            ev_endconn(conn, bytesread < 0);
+            return;
+        }
+        int off = 0;
+        while (off < bytesread && !conn->dead) {
+            int bytesprocessed = lineparser_write(&conn->lineparser, buf, off, bytesread - off);
+            off += bytesprocessed;
+        }
+    }
+}
+
+// latest status from the audio loop: stream 0's, and every stream's. network thread only.
+static audio_status_t      net_status;
+static audio_status_t      stream_status[MAX_STREAMS];
+
+// appends the fields in mask to buf, either as "field value" lines or as a
+// single "status field value ..." frame
+static void format_status(char *buf, int len, int mask, int clip, double peak, bool frame) {
+    int off = 0;
+    if (frame) off += snprintf(buf + off, len - off, "status");
+
+    int field;
+    for (field = 1; field <= STATUS_FIELD_LAST && off < len; field <<= 1) {
+        if (!(mask & field)) continue;
+        char value[64];
+        switch (field) {
+            case STATUS_FIELD_LEVEL:      snprintf(value, sizeof(value), "%f", net_status.level);                        break;
+            case STATUS_FIELD_TIME:       snprintf(value, sizeof(value), "%f", net_status.recording_time);               break;
+            case STATUS_FIELD_MODE:       snprintf(value, sizeof(value), "%s", record_mode_to_str(net_status.record_mode)); break;
+            case STATUS_FIELD_STATE:      snprintf(value, sizeof(value), "%s", state_to_str(net_status.state));          break;
+            case STATUS_FIELD_BASE_LEVEL: snprintf(value, sizeof(value), "%f", net_status.base_level);                   break;
+            case STATUS_FIELD_CLIP:       snprintf(value, sizeof(value), "%d", clip);                                    break;
+            case STATUS_FIELD_PEAK:       snprintf(value, sizeof(value), "%f", peak);                                    break;
+        }
+        off += snprintf(buf + off, len - off, frame ? " %s %s" : "%s %s\n", status_field_to_str(field), value);
+    }
+    if (frame && off < len) snprintf(buf + off, len - off, "\n");
+}
+
+// sends a client its pending status if it has any and its interval is up
+static void flush_subscription(connection_t *conn, long long now) {
+    if (conn->dirty == 0 || now < conn->next_frame_us) return;
+    char buf[512];
+    format_status(buf, sizeof(buf), conn->dirty, conn->clip_accum, conn->peak_accum, conn->subscribed);
+    conn->dirty         = 0;
+    conn->clip_accum    = 0;
+    conn->peak_accum    = 0;
+    conn->next_frame_us = now + conn->interval_us;
+    send_message(conn, buf);
+}
+
+// how long epoll can sleep before some client's status is due
+static int subscription_timeout_ms(long long now) {
+    long long soonest = -1;
+    int fd;
+    for (fd = 0; fd <= conns_max_fd; fd++) {
+        connection_t *conn = conns[fd];
+        if (conn == NULL || conn->dirty == 0) continue;
+        long long wait = conn->next_frame_us - now;
+        if (wait < 0) wait = 0;
+        if (soonest < 0 || wait < soonest) soonest = wait;
+    }
+    return soonest < 0 ? -1 : (int)((soonest + 999) / 1000);
+}
+
+// takes a new status from the audio loop and adds what changed to each
+// client's next update
+static void publish_status(const audio_status_t *newstatus) {
+    int changed = 0;
+    if (newstatus->level          != net_status.level)          changed |= STATUS_FIELD_LEVEL;
+    if (newstatus->recording_time != net_status.recording_time) changed |= STATUS_FIELD_TIME;
+    if (newstatus->record_mode    != net_status.record_mode)    changed |= STATUS_FIELD_MODE;
+    if (newstatus->state          != net_status.state)          changed |= STATUS_FIELD_STATE;
+    if (newstatus->base_level     != net_status.base_level)     changed |= STATUS_FIELD_BASE_LEVEL;
+    if (newstatus->clipped_frames != 0)                         changed |= STATUS_FIELD_CLIP;
+    if (newstatus->peak           != net_status.peak)           changed |= STATUS_FIELD_PEAK;
+    net_status = *newstatus;
+    if (changed == 0) return;
+
+    long long now = now_us();
+    int fd;
+    for (fd = 0; fd <= conns_max_fd; fd++) {
+        connection_t *conn = conns[fd];
+        if (conn == NULL) continue;
+        conn->dirty |= changed & conn->fields;
+        if (changed & conn->fields & STATUS_FIELD_CLIP) conn->clip_accum += newstatus->clipped_frames;
+        if ((changed & conn->fields & STATUS_FIELD_PEAK) && newstatus->peak > conn->peak_accum) {
+            conn->peak_accum = newstatus->peak;
+        }
+        flush_subscription(conn, now);
+    }
+}
+
+#define MONITOR_HEADER_MAX (128)
+
+// hands new monitor frames to every listener, encoding each format at most
+// once per frame. a listener with more than MONITOR_MAX_BEHIND_MS of audio
+// still unsent, in our queue or the kernel's, skips the frame: a slow one
+// hears gaps instead of falling ever further behind or holding anyone up.
+static void publish_monitor() {
+    static char *bufs[MONITOR_FORMAT_ULAW + 1];
+    if (bufs[MONITOR_FORMAT_PCM] == NULL) {
+        int format;
+        for (format = MONITOR_FORMAT_PCM; format <= MONITOR_FORMAT_ULAW; format++) {
+            bufs[format] = malloc(MONITOR_HEADER_MAX + monitor.max_samples * monitor_format_bytes(format));
+            if (bufs[format] == NULL) failf("out of memory for monitor");
+        }
+    }
+
+    monitor_frame_t *frame;
+    while ((frame = monitor_read_begin(&monitor)) != NULL) {
+        int len[MONITOR_FORMAT_ULAW + 1] = {0,};
+        long long now = now_us();
+        int fd;
+        for (fd = 0; fd <= conns_max_fd && monitor_listeners > 0; fd++) {
+            connection_t *conn = conns[fd];
+            if (conn == NULL || conn->monitor_format == MONITOR_FORMAT_NONE) continue;
+            monitor_format_t format = conn->monitor_format;
+
+            int unsent = 0;
+            if (ioctl(conn->sock, SIOCOUTQ, &unsent) != 0) unsent = 0;
+            unsent += conn->out_len;
+            if (unsent > monitor.rate * monitor_format_bytes(format) * MONITOR_MAX_BEHIND_MS / 1000) {
+                conn->monitor_dropped++;
+                continue;
+            }
+
+            if (len[format] == 0) {
+                len[format] = monitor_encode(frame, format, (unsigned char*)bufs[format] + MONITOR_HEADER_MAX);
+            }
+            // the header goes right in front of the payload so it all goes in one send
+            char header[MONITOR_HEADER_MAX];
+            long long age = now - frame->captured_us;
+            int header_len = snprintf(header, sizeof(header), "audio %u at %lld age %lld dropped %d bytes %d\n",
+                                      frame->seq, frame->captured_us, age, conn->monitor_dropped, len[format]);
+            char *start = bufs[format] + MONITOR_HEADER_MAX - header_len;
+            memcpy(start, header, header_len);
+            send_bytes(conn, start, header_len + len[format]);
+            conn->monitor_dropped = 0;
+            histo_record(&monitor_latency, age);
+        }
+        monitor_read_end(&monitor);
+    }
+}
+
+#define OVERVIEW_LINE_POINTS (64)
+
+// sends each overview listener the points of the current take it hasn't had
+// yet. one that joined a long take part way through catches up a few lines
+// per status update, as its socket drains, instead of all at once.
+static void publish_overview() {
+    if (overview_listeners == 0) return;
+    int fd;
+    for (fd = 0; fd <= conns_max_fd; fd++) {
+        connection_t *conn = conns[fd];
+        if (conn == NULL || !conn->overview) continue;
+        while (!conn->dead) {
+            overview_point_t points[OVERVIEW_LINE_POINTS];
+            char buf[OVERVIEW_LINE_POINTS * 20 + 64];
+            int take;
+            int n = encoder_overview_read(&streams[conn->overview_stream].encoder, conn->overview_level, conn->overview_sent, points,
+                                          OVERVIEW_LINE_POINTS, &take);
+            if (take != conn->overview_take) {
+                if (conn->overview_take != 0) {
+                    snprintf(buf, sizeof(buf), "overview end %d\n", conn->overview_take);
+                    send_message(conn, buf);
+                }
+                conn->overview_take = take;
+                conn->overview_sent = 0;
+                if (take != 0) {
+                    snprintf(buf, sizeof(buf), "overview take %d\n", take);
+                    send_message(conn, buf);
+                }
+                continue;
+            }
+            if (n == 0 || conn->out_len > CONN_MAX_OUTPUT / 2) break;
+
+            int off = snprintf(buf, sizeof(buf), "overview %d %d", take, conn->overview_sent);
+            int i;
+            for (i = 0; i < n; i++) {
+                off += snprintf(buf + off, sizeof(buf) - off, " %d %d %d", points[i].min, points[i].max,
+                                points[i].rms);
+            }
+            snprintf(buf + off, sizeof(buf) - off, "\n");
             send_message(conn, buf);
+            conn->overview_sent += n;
+        }
+    }
+}
+
+// "overview [level|off]". no level means 0, the finest.
+static bool set_overview(connection_t *conn, char *args) {
+    char level_str[16] = "0";
+    int  stream        = 0;
+    sscanf(args, " %15s %d", level_str, &stream);
+    bool on = strcmp(level_str, "off") != 0;
+    char *end;
+    int level = on ? (int)strtol(level_str, &end, 10) : 0;
+    if (on && (*end != '\0' || level < 0 || level >= OVERVIEW_MAX_LEVELS)) return false;
+    if (stream < 0 || stream >= nstreams) return false;
+
+    if (on != conn->overview) overview_listeners += on ? 1 : -1;
+    conn->overview       = on;
+    conn->overview_level  = level;
+    conn->overview_stream = stream;
+    conn->overview_take   = 0;
+    conn->overview_sent  = 0;
+
+    char buf[128];
+    if (!on) {
+        snprintf(buf, sizeof(buf), "overview off\n");
+    } else {
+        double seconds = (double)ANALYSIS_HOP_FRAMES / SAMPLE_RATE;
+        int l;
+        for (l = 0; l < level; l++) seconds *= OVERVIEW_FACTOR;
+        snprintf(buf, sizeof(buf), "overview level %d seconds %f stream %d\n", level, seconds, stream);
+    }
+    send_message(conn, buf);
+    if (on) publish_overview();
+    return true;
+}
+
+// "monitor [pcm|ulaw|off]". no format means ulaw.
+static bool set_monitor(connection_t *conn, char *args) {
+    char format_str[16] = "ulaw";
+    sscanf(args, " %15s", format_str);
+    monitor_format_t format;
+    if (!monitor_format_parse(format_str, &format)) return false;
+
+    if (conn->monitor_format == MONITOR_FORMAT_NONE && format != MONITOR_FORMAT_NONE) {
+        if (monitor_listeners++ == 0) monitor_set_listening(&monitor, true);
+    } else if (conn->monitor_format != MONITOR_FORMAT_NONE && format == MONITOR_FORMAT_NONE) {
+        if (--monitor_listeners == 0) monitor_set_listening(&monitor, false);
+    }
+    conn->monitor_format  = format;
+    conn->monitor_dropped = 0;
+
+    char buf[128];
+    if (format == MONITOR_FORMAT_NONE) {
+        snprintf(buf, sizeof(buf), "monitor off\n");
+    } else {
+        snprintf(buf, sizeof(buf), "monitor %s rate %d channels 1\n", monitor_format_to_str(format), monitor.rate);
+    }
+    send_message(conn, buf);
+    return true;
+}
+
+// "subscribe <hz> [field ...]". 0 hz means every update; no fields means all of them.
+static bool subscribe(connection_t *conn, char *args) {
+    char *save = NULL;
+    char *tok  = strtok_r(args, " \t", &save);
+    if (tok == NULL) return false;
+    char *end;
+    double hz = strtod(tok, &end);
+    if (*end != '\0' || hz < 0) return false;
+
+    int fields = 0;
+    while ((tok = strtok_r(NULL, " \t", &save)) != NULL) {
+        int field;
+        for (field = 1; field <= STATUS_FIELD_LAST; field <<= 1) {
+            if (strcmp(tok, status_field_to_str(field)) == 0) break;
+        }
+        if (strcmp(tok, "all") == 0) {
+            field = STATUS_FIELD_ALL;
+        } else if (field > STATUS_FIELD_LAST) {
+            return false;
+        }
+        fields |= field;
+    }
+
+    conn->subscribed    = true;
+    conn->fields        = fields != 0 ? fields : STATUS_FIELD_ALL;
+    conn->interval_us   = hz > 0 ? (long long)(1000000.0 / hz) : 0;
+    conn->next_frame_us = 0;
+    conn->clip_accum    = 0;
+    conn->peak_accum    = net_status.peak;
+
+    // start the subscriber off with every field it asked for, except clip, which is an event
+    conn->dirty = conn->fields & ~STATUS_FIELD_CLIP;
+    flush_subscription(conn, now_us());
+    return true;
+}
+
+// "stream <index> <name|-> <source> state <state> mode <mode> level <rms> time <s> leader <index|->"
+// per stream, then "streams end"
+static void send_streams(connection_t *conn) {
+    char buf[MAX_STREAMS * 400 + 16];
+    int off = 0, i;
+    for (i = 0; i < nstreams; i++) {
+        const stream_t       *stream = &streams[i];
+        const audio_status_t *status = &stream_status[i];
+        char leader[16] = "-";
+        if (stream->leader != NULL) snprintf(leader, sizeof(leader), "%d", stream->leader->index);
+        off += snprintf(buf + off, sizeof(buf) - off, "stream %d %s %s state %s mode %s level %f time %f leader %s\n",
+                        i, stream->name[0] != '\0' ? stream->name : "-", stream->source,
+                        state_to_str(status->state), record_mode_to_str(status->record_mode), status->level,
+                        status->recording_time, leader);
     }
+    snprintf(buf + off, sizeof(buf) - off, "streams end\n");
+    send_message(conn, buf);
+}
+
+// one "stats <histogram>" line per histogram, then "stats end"
+static void send_stats(connection_t *conn, bool reset) {
+    histo_t *histos[(NSTAGES + 2) * MAX_STREAMS + 8];
+    int nhistos = 0, i, j;
+    for (j = 0; j < nstreams; j++) {
+        for (i = 0; i < NSTAGES; i++) histos[nhistos++] = &streams[j].stage_latency[i];
+        histos[nhistos++] = &streams[j].encoder.encode_latency;
+        histos[nhistos++] = &streams[j].encoder.finalize_latency;
+    }
+    histos[nhistos++] = &diskwriter.queue_latency;
+    histos[nhistos++] = &diskwriter.write_latency;
+    histos[nhistos++] = &diskwriter.sync_latency;
+    histos[nhistos++] = &upload_latency;
+    if (live_upload) histos[nhistos++] = &livesink.latency;
+    histos[nhistos++] = &monitor_latency;
+
+    char buf[16384];
+    int off = 0;
+    for (i = 0; i < nhistos; i++) {
+        off += snprintf(buf + off, sizeof(buf) - off, "stats ");
+        histo_format(histos[i], buf + off, sizeof(buf) - off);
+        off += strlen(buf + off);
+        off += snprintf(buf + off, sizeof(buf) - off, "\n");
+        if (reset) histo_reset(histos[i]);
+    }
+    snprintf(buf + off, sizeof(buf) - off, "stats end\n");
+    send_message(conn, buf);
+}
+
+// "list [offset [count]]": a page of the catalog, newest first
+static void send_list(connection_t *conn, const char *args) {
+    int offset = 0, count = LIST_DEFAULT_TAKES;
+    sscanf(args, "%d %d", &offset, &count);
+    if (offset < 0) offset = 0;
+    if (count < 0) count = 0;
+    if (count > LIST_MAX_TAKES) count = LIST_MAX_TAKES;
+
+    int total = catalog_count(&catalog);
+    int i;
+    for (i = 0; i < count && offset + i < total; i++) {
+        int id = total - 1 - offset - i;
+        catalog_entry_t entry;
+        if (!catalog_get(&catalog, id, &entry)) break;
+        char entrybuf[512], buf[600];
+        catalog_format(&entry, false, entrybuf, sizeof(entrybuf));
+        snprintf(buf, sizeof(buf), "list %d %s\n", id, entrybuf);
+        send_message(conn, buf);
+    }
+    char buf[64];
+    snprintf(buf, sizeof(buf), "list end %d\n", total);
+    send_message(conn, buf);
+}
+
+// "info <id|name>": everything the catalog has on one take
+static void send_info(connection_t *conn, const char *args) {
+    while (*args && isspace(*args)) args++;
+    char name[CATALOG_MAX_NAME];
+    int id = -1;
+    if (sscanf(args, "%63s", name) == 1) {
+        const char *c = name;
+        while (isdigit(*c)) c++;
+        id = *c == '\0' ? atoi(name) : catalog_find(&catalog, name);
+    }
+
+    catalog_entry_t entry;
+    char buf[1024];
+    if (id >= 0 && catalog_get(&catalog, id, &entry)) {
+        char entrybuf[768];
+        catalog_format(&entry, true, entrybuf, sizeof(entrybuf));
+        snprintf(buf, sizeof(buf), "info %d %s\n", id, entrybuf);
+    } else {
+        snprintf(buf, sizeof(buf), "info none\n");
+    }
+    send_message(conn, buf);
 }
 
 int ev_line(void *userdata, char *line, int len) {
-    //connection_t *conn = (connection_t*)userdata;
+    connection_t *conn = (connection_t*)userdata;
 
     tracef("NET GOT '%s'", line);
 
@@ -530,6 +1341,42 @@ int ev_line(void *userdata, char *line, int len) {
     } else if (strstr(line, "cancel") == line) {
         command_t cmd = { .type = COMMAND_TYPE_CANCEL };
         write_cmd(&cmd);
+    } else if (strstr(line, "subscribe") == line) {
+        if (!subscribe(conn, line + strlen("subscribe"))) {
+            tracef("bad subscription: '%s'", line);
+        }
+    } else if (strstr(line, "monitor") == line) {
+        if (!set_monitor(conn, line + strlen("monitor"))) {
+            tracef("bad monitor format: '%s'", line);
+        }
+    } else if (strstr(line, "overview") == line) {
+        if (!set_overview(conn, line + strlen("overview"))) {
+            tracef("bad overview level or stream: '%s'", line);
+        }
+    } else if (strstr(line, "streams") == line) {
+        send_streams(conn);
+    } else if (strstr(line, "stats") == line) {
+        send_stats(conn, strstr(line, "reset") != NULL);
+    } else if (strstr(line, "list") == line) {
+        send_list(conn, line + strlen("list"));
+    } else if (strstr(line, "info") == line) {
+        send_info(conn, line + strlen("info"));
+    } else if (strstr(line, "profile") == line) {
+        // the encoders take profile changes directly; the audio loops don't need to know
+        encoder_profile_t profile;
+        int level;
+        encoder_get_profile(&streams[0].encoder, &profile, &level);
+        if (encoder_profile_parse(&profile, line + strlen("profile"))) {
+            int i;
+            for (i = 0; i < nstreams; i++) encoder_set_profile(&streams[i].encoder, &profile);
+            encoder_get_profile(&streams[0].encoder, &profile, &level);
+        } else {
+            tracef("bad profile: '%s'", line);
+        }
+        char profilebuf[256], buf[512];
+        encoder_profile_format(&profile, profilebuf, sizeof(profilebuf));
+        snprintf(buf, sizeof(buf), "profile %s level %d\n", profilebuf, level);
+        send_message(conn, buf);
     } else {
         tracef("unknown command: '%s'", line);
     }
@@ -537,19 +1384,28 @@ int ev_line(void *userdata, char *line, int len) {
     return 0;
 }
 
-void ev_newconn(connection_t *conn, int conn_sock, audio_status_t *status) {
+void ev_newconn(int conn_sock) {
+    if (conn_sock >= conns_cap) {
+        int cap = conns_cap > 0 ? conns_cap : 64;
+        while (cap <= conn_sock) cap *= 2;
+        conns = realloc(conns, sizeof(*conns) * cap);
+        if (conns == NULL) failf("out of memory growing connection table");
+        memset(conns + conns_cap, 0, sizeof(*conns) * (cap - conns_cap));
+        conns_cap = cap;
+    }
+    if (conn_sock > conns_max_fd) conns_max_fd = conn_sock;
+
+    connection_t *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) failf("out of memory accepting connection");
+    conns[conn_sock] = conn;
+    nconns++;
     conn->sock = conn_sock;
     lineparser_init(&conn->lineparser, ev_line, conn);
+    conn->fields        = STATUS_FIELD_LEGACY;
+    conn->interval_us   = (long long)FRAMES_PER_BUFFER * 1000000 / SAMPLE_RATE;
+    conn->next_frame_us = now_us() + conn->interval_us;
     char buf[1024];
-    snprintf(buf, sizeof(buf), "level %f\n", status->level);
-    send_message(conn, buf);
-    snprintf(buf, sizeof(buf), "time %f\n", status->recording_time);
-    send_message(conn, buf);
-    snprintf(buf, sizeof(buf), "mode %s\n", record_mode_to_str(status->record_mode));
-    send_message(conn, buf);
-    snprintf(buf, sizeof(buf), "state %s\n", state_to_str(status->state));
-    send_message(conn, buf);
-    snprintf(buf, sizeof(buf), "base_level %f\n", status->base_level);
+    format_status(buf, sizeof(buf), STATUS_FIELD_LEGACY & ~STATUS_FIELD_CLIP, 0, 0, false);
     send_message(conn, buf);
 }
 
@@ -597,10 +1453,10 @@ void *network_thread_main(void *arg) {
         perrorf("epoll_ctl", "failed to epoll_ctl for status_pipe_read_fd");
     }
 
-    audio_status_t status = DEFAULT_AUDIO_STATUS;
+    net_status = DEFAULT_AUDIO_STATUS;
     for (;;) {
         struct epoll_event events[EPOLL_MAX_EVENTS];
-        int nfds = epoll_wait(epollfd, events, EPOLL_MAX_EVENTS, -1);
+        int nfds = epoll_wait(epollfd, events, EPOLL_MAX_EVENTS, subscription_timeout_ms(now_us()));
         if (nfds == -1) {
             perrorf("epoll_wait", "failed to epoll_wait");
         }
@@ -613,141 +1469,289 @@ void *network_thread_main(void *arg) {
                 if (bytesread != sizeof(newstatus)) {
                     failf("short read on status pipe");
                 }
-                if (newstatus.level       != status.level       ||
-                    newstatus.record_mode != status.record_mode ||
-                    newstatus.state       != status.state) {
-                    ///tracef("got status level=%f record_mode=%s state=%s", newstatus.level, record_mode_to_str(newstatus.record_mode), state_to_str(newstatus.state));
-                }
-
-                char buf[1024];
-                if (newstatus.level       != status.level) {
-                    snprintf(buf, sizeof(buf), "level %f\n", newstatus.level);
-                    broadcast_message(buf);
-                    status.level = newstatus.level;
-                }
-                if (newstatus.recording_time != status.recording_time) {
-                    snprintf(buf, sizeof(buf), "time %f\n", newstatus.recording_time);
-                    broadcast_message(buf);
-                    status.recording_time = newstatus.recording_time;
-                }
-                if (newstatus.record_mode != status.record_mode) {
-                    snprintf(buf, sizeof(buf), "mode %s\n", record_mode_to_str(newstatus.record_mode));
-                    broadcast_message(buf);
-                    status.record_mode = newstatus.record_mode;
-                }
-                if (newstatus.state != status.state) {
-                    snprintf(buf, sizeof(buf), "state %s\n", state_to_str(newstatus.state));
-                    broadcast_message(buf);
-                    status.state = newstatus.state;
-                }
-                if (newstatus.base_level != status.base_level) {
-                    snprintf(buf, sizeof(buf), "base_level %f\n", status.base_level);
-                    broadcast_message(buf);
-                    status.base_level = newstatus.base_level;
-                }
-                if (newstatus.clipped_frames != 0) {
-                    snprintf(buf, sizeof(buf), "clip %d\n", newstatus.clipped_frames);
-                    broadcast_message(buf);
-                }
+                // the status lines and the monitor are stream 0's, as they were before
+                // there could be more than one. the rest are for the streams command.
+                stream_status[newstatus.stream] = newstatus;
+                if (newstatus.stream == 0) publish_status(&newstatus);
+                publish_monitor();
+                publish_overview();
 
             } else if (events[n].data.fd == listen_sock) {
-                struct sockaddr_in local = {0,};
-                size_t addrlen = sizeof(local);
-                int conn_sock = accept(listen_sock, (struct sockaddr *)&local, &addrlen);
-                if (conn_sock == -1) {
-                    perrorf("accept", "failed to accept");
-                }
-
-                int i;
-                int found = 0;
-                for (i = 0; i < MAX_CONNECTIONS; i++) {
-                    if (connections[i].sock == 0) {
-                        if (0 != ioctl(conn_sock, FIONBIO, (void*)&one)) {
-                            perrorf("ioctl", "failed to set non-blocking");
-                        }
-                        ev.events  = EPOLLIN | EPOLLET;
-                        ev.data.fd = conn_sock;
-                        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock, &ev) == -1) {
-                            perrorf("epoll_ctl", "epoll_ctl: conn_sock");
+                // edge triggered too: take everything that is waiting
+                for (;;) {
+                    struct sockaddr_in local = {0,};
+                    socklen_t addrlen = sizeof(local);
+                    int conn_sock = accept4(listen_sock, (struct sockaddr *)&local, &addrlen, SOCK_NONBLOCK);
+                    if (conn_sock == -1) {
+                        if (errno == EINTR) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            // e.g. EMFILE. the rest stay queued in the backlog until a client leaves.
+                            tracef("failed to accept: %s", strerror(errno));
                         }
+                        break;
+                    }
 
-                        if (setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) == -1) {
-                            perrorf("setsockopt", "setsockopt nodelay failed");
-                        }
+                    ev.events  = EPOLLIN | EPOLLOUT | EPOLLET;
+                    ev.data.fd = conn_sock;
+                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn_sock, &ev) == -1) {
+                        perrorf("epoll_ctl", "epoll_ctl: conn_sock");
+                    }
 
-                        tracef("accepted new connection");
-                        found = 1;
-                        ev_newconn(&connections[i], conn_sock, &status);
-                        break;
+                    if (setsockopt(conn_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) == -1) {
+                        perrorf("setsockopt", "setsockopt nodelay failed");
                     }
-                }
 
-                if (!found) {
-                    tracef("rejecting connection because i am maxed out");
-                    shutdown(conn_sock, SHUT_RDWR);
-                    close(conn_sock);
+                    ev_newconn(conn_sock);
+                    tracef("accepted new connection (%d open)", nconns);
                 }
             } else {
-                int i;
-                for (i = 0; i < MAX_CONNECTIONS; i++) {
-                    if (connections[i].sock == events[n].data.fd) {
-                        char buf[4096];
-                        int bytesread = recv(connections[i].sock, buf, sizeof(buf), 0);
-                        if (bytesread <= 0) {
-                            ev_endconn(&connections[i], bytesread < 0);
-                        } else {
-                            int off = 0;
-                            while (off < bytesread) {
-                                int bytesprocessed = lineparser_write(&connections[i].lineparser, buf, off, bytesread - off);
-                                off += bytesprocessed;
-                            }
-                            break;
-                        }
-                    }
-                }
+                int fd = events[n].data.fd;
+                // may have been closed earlier in this batch
+                connection_t *conn = fd <= conns_max_fd ? conns[fd] : NULL;
+                if (conn == NULL) continue;
+                if (events[n].events & EPOLLOUT) flush_output(conn);
+                if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_input(conn);
             }
         }
+
+        // updates a client's rate held back come due here
+        long long now = now_us();
+        for (n = 0; n <= conns_max_fd; n++) {
+            if (conns[n] != NULL) flush_subscription(conns[n], now);
+        }
+        free_dead_conns();
     }
 }
 
-void *upload_thread_main(void *arg) {
-    // upload flac files
-top:
-    for (;;) {
-        DIR *dir = opendir(".");
-        struct dirent *ent;
-        for (ent = readdir(dir); ent; ent = readdir(dir)) {
-            const char *filename = ent->d_name;
-            if (strcmp(filename + strlen(filename) - 5, ".flac")) continue;         // only upload flacs
-            long long upload_start = now_us();
-            tracef("uploading %s to soundcloud", filename);
-            char cmdbuf[4096];
-            snprintf(cmdbuf, sizeof(cmdbuf),  "recordthepiano_upload '%s'", filename);
-            int rc = system(cmdbuf);
-            long long upload_end = now_us();
-            if (rc == 0) {
-                tracef("uploaded succeeded in %dms", (int)((upload_end - upload_start) / 1000));
-                unlink(filename);
-                closedir(dir);
-                goto top;
-            } else {
-                tracef("uploaded failed in %dms", (int)((upload_end - upload_start) / 1000));
-            }
+// upload queue worker: one file
+static bool upload_file(void *userdata, const char *filename) {
+    long long upload_start = now_us();
+    tracef("uploading %s to soundcloud", filename);
+    char permalink[1024];
+    bool ok = uploader_upload((uploader_t*)userdata, filename, permalink, sizeof(permalink));
+    long long upload_end = now_us();
+    histo_record(&upload_latency, upload_end - upload_start);
+    catalog_uploaded(&catalog, filename, ok, permalink);
+    if (ok) {
+        tracef("uploaded succeeded in %dms: %s", (int)((upload_end - upload_start) / 1000), permalink);
+        // the peak file goes with the take: the catalog keeps its levels, and nothing reads one after
+        char peaks[ENCODER_MAX_FILENAME + sizeof(OVERVIEW_SUFFIX)];
+        snprintf(peaks, sizeof(peaks), "%s%s", filename, OVERVIEW_SUFFIX);
+        if (unlink(peaks) != 0 && errno != ENOENT) tracef("couldn't remove %s: %s", peaks, strerror(errno));
+    } else {
+        tracef("uploaded failed in %dms", (int)((upload_end - upload_start) / 1000));
+    }
+    return ok;
+}
+
+// a kept take as the catalog has it
+static void catalog_take(const char *filename, const encoder_take_t *take) {
+    catalog_entry_t entry = {
+        .frames      = take->frames,
+        .sample_rate = SAMPLE_RATE,
+        .clipped     = take->clipped,
+        .peak        = take->peak,
+        .rms         = take->rms,
+        .loudness    = take->loudness,
+        .upload      = CATALOG_UPLOAD_PENDING,
+        .flags       = take->measured ? 0 : CATALOG_FLAG_RECOVERED,
+    };
+    snprintf(entry.name, sizeof(entry.name), "%s", filename);
+
+    // the name is when it started, in local time with the offset
+    struct tm tm = {0};
+    if (strptime(filename, "%Y-%m-%dT%H:%M:%S%z", &tm) != NULL) {
+        entry.start = timegm(&tm) - tm.tm_gmtoff;
+    } else {
+        entry.start = time(NULL) - take->frames / SAMPLE_RATE;
+    }
+
+    if (catalog_add(&catalog, &entry) < 0) tracef("couldn't catalog %s", filename);
+}
+
+// encoder + finalizer threads: a recording's file opened, or was kept or thrown away
+static void recording_event(void *userdata, encoder_event_t event, const char *tmpfilename, const char *filename,
+                            const encoder_take_t *take) {
+    switch (event) {
+        case ENCODER_EVENT_BEGIN:
+            if (live_upload) livesink_begin(&livesink, tmpfilename);
+            break;
+        case ENCODER_EVENT_KEEP:
+            if (live_upload) livesink_end(&livesink, tmpfilename, filename);
+            catalog_take(filename, take);
+            uploadq_add(&uploadq, filename);
+            break;
+        case ENCODER_EVENT_DISCARD:
+            if (live_upload) livesink_end(&livesink, tmpfilename, NULL);
+            break;
+    }
+}
+
+// each stream's audio loop gets a thread of its own, on a core of its own
+// when there are enough of them, so one device's work can't make another
+// miss a buffer
+static void *stream_thread_main(void *arg) {
+    stream_t *stream = (stream_t*)arg;
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (STREAM_FIRST_CPU >= 0 && ncpus > 1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((STREAM_FIRST_CPU + stream->index) % ncpus, &cpus);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc != 0) stream_tracef(stream, "couldn't pin audio thread: %s", strerror(rc));
+    }
+
+    if (geteuid() == 0) {
+        struct sched_param sparams = {0,};
+        sparams.sched_priority = STREAM_PRIORITY;
+        int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sparams);
+        if (rc != 0) {
+            stream_tracef(stream, "couldn't set FIFO scheduler: %s", strerror(rc));
+        } else {
+            stream_tracef(stream, "set FIFO scheduler");
+        }
+    }
+
+    stream->result = run(stream);
+    return NULL;
+}
+
+// "[name=]source", from -D or -i
+static void stream_add(const char *arg) {
+    if (nstreams == MAX_STREAMS) {
+        fprintf(stderr, "at most %d streams\n", MAX_STREAMS);
+        exit(1);
+    }
+    stream_t *stream = &streams[nstreams];
+    stream->index = nstreams++;
+    const char *eq = strchr(arg, '=');
+    if (eq != NULL) {
+        if (eq - arg > MAX_STREAM_NAME) {
+            fprintf(stderr, "stream names are at most %d characters: %.*s\n", MAX_STREAM_NAME, (int)(eq - arg), arg);
+            exit(1);
         }
-        closedir(dir);
-        sleep(1);
+        snprintf(stream->name, sizeof(stream->name), "%.*s", (int)(eq - arg), arg);
+        arg = eq + 1;
+    }
+    snprintf(stream->source, sizeof(stream->source), "%s", arg);
+}
+
+// everything but the capture, which main opens once it knows what kind
+static void stream_init(stream_t *stream, const encoder_profile_t *profile) {
+    // a lone stream keeps the plain names it always had
+    if (nstreams > 1 && stream->name[0] == '\0') snprintf(stream->name, sizeof(stream->name), "%d", stream->index + 1);
+    if (stream->name[0] != '\0') snprintf(stream->prefix, sizeof(stream->prefix), "%s: ", stream->name);
+
+    int pipefds[2];
+    pipe2(pipefds, O_NONBLOCK);
+    stream->control_read_fd  = pipefds[0];
+    stream->control_write_fd = pipefds[1];
+
+    // the first stream's histograms keep their old names
+    int stage;
+    for (stage = 0; stage < NSTAGES; stage++) {
+        const char *name = stage_to_str(stage);
+        if (stream->index > 0) {
+            snprintf(stream->histo_names[stage], sizeof(stream->histo_names[stage]), "%s:%s", name, stream->name);
+            name = stream->histo_names[stage];
+        }
+        histo_init(&stream->stage_latency[stage], name);
+    }
+
+    encoder_init(&stream->encoder, CHANNELS, SAMPLE_RATE, FRAMES_PER_BUFFER, ENCODE_RING_NBUFFERS,
+                 ENCODE_THREADS, profile, &diskwriter, stream->name);
+    encoder_set_overview(&stream->encoder, ANALYSIS_HOP_FRAMES);
+    if (stream->index > 0) {
+        char *encode_name   = stream->histo_names[NSTAGES];
+        char *finalize_name = stream->histo_names[NSTAGES + 1];
+        snprintf(encode_name, sizeof(stream->histo_names[0]), "%s:%s", stream->encoder.encode_latency.name, stream->name);
+        snprintf(finalize_name, sizeof(stream->histo_names[0]), "%s:%s", stream->encoder.finalize_latency.name,
+                 stream->name);
+        stream->encoder.encode_latency.name   = encode_name;
+        stream->encoder.finalize_latency.name = finalize_name;
     }
 }
 
+// runs every stream's audio loop until they've all stopped. returns the worst result.
+static int run_streams() {
+    int i, result = 0;
+    for (i = 0; i < nstreams; i++) {
+        pthread_create(&streams[i].thread, NULL, stream_thread_main, &streams[i]);
+    }
+    for (i = 0; i < nstreams; i++) {
+        pthread_join(streams[i].thread, NULL);
+        if (streams[i].result > result) result = streams[i].result;
+    }
+    return result;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: recordthepiano [-b] [-p profile] [-d detector] [-u url] [-s sink] [-D [name=]device]... [-l]\n"
+                    "                      [-i [name=]file [-f]]...\n");
+    fprintf(stderr, "    -b    capture with blocking reads instead of a portaudio callback\n");
+    fprintf(stderr, "    -D    record this device instead of '%s'. repeat to record several at once\n", DEVICE_NAME);
+    fprintf(stderr, "    -l    link the streams: the others record when the first one does, and only then\n");
+    fprintf(stderr, "    -i    replay a captured session (.wav, .flac or raw) instead of capturing, then exit. repeatable\n");
+    fprintf(stderr, "    -f    replay as fast as possible instead of in real time, without the network or uploads\n");
+    fprintf(stderr, "    -p    encoder profile, e.g. 'auto', '8' or '5 blocksize 4608 apodization tukey(0.5)'\n");
+    fprintf(stderr, "    -d    start/stop detector, 'rms' or 'spectral'\n");
+    fprintf(stderr, "    -u    where to upload recordings, instead of %s\n", UPLOAD_URL);
+    fprintf(stderr, "    -s    directory or url to also send recordings to while they're being recorded\n");
+    exit(1);
+}
+
 int main(int argc, char **argv) {
-    int err = Pa_Initialize();
-    if (err != paNoError) {
-        tracef("error initializing portaudio: %s", Pa_GetErrorText(err));
-        return 1;
+    capture_mode_t capture_mode = CAPTURE_MODE_CALLBACK;
+    const char    *profile_str  = ENCODE_PROFILE;
+    const char    *detector_str = DETECTOR;
+    const char    *upload_url   = UPLOAD_URL;
+    const char    *live_sink    = LIVE_UPLOAD_SINK;
+    bool           replay       = false;
+    bool           replay_fast  = false;
+    bool           linked       = false;
+    int            ndevices_arg = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "bp:d:i:fu:s:D:l")) != -1) {
+        switch (opt) {
+            case 'b': capture_mode = CAPTURE_MODE_BLOCKING;               break;
+            case 'p': profile_str  = optarg;                              break;
+            case 'd': detector_str = optarg;                              break;
+            case 'i': replay       = true; stream_add(optarg);            break;
+            case 'D': ndevices_arg++;      stream_add(optarg);            break;
+            case 'f': replay_fast  = true;                                break;
+            case 'u': upload_url   = optarg;                              break;
+            case 's': live_sink    = optarg;                              break;
+            case 'l': linked       = true;                                break;
+            default:  usage();
+        }
+    }
+    if (replay_fast && !replay) usage();
+    if (replay && ndevices_arg > 0) usage();
+    if (nstreams == 0) stream_add(DEVICE_NAME);
+    int i;
+    for (i = 1; linked && i < nstreams; i++) streams[i].leader = &streams[0];
+
+    encoder_profile_t profile = { .compression_level = ENCODER_LEVEL_AUTO };
+    if (!encoder_profile_parse(&profile, profile_str)) {
+        fprintf(stderr, "bad encoder profile '%s'\n", profile_str);
+        usage();
     }
 
-    // delete old tmp files
-    system("rm -f *.flac.tmp");
+    if (!detector_parse(detector_str, &detector)) {
+        fprintf(stderr, "bad detector '%s'\n", detector_str);
+        usage();
+    }
+
+    int err;
+    if (!replay) {
+        err = Pa_Initialize();
+        if (err != paNoError) {
+            tracef("error initializing portaudio: %s", Pa_GetErrorText(err));
+            return 1;
+        }
+    }
 
     int pipefds[2];
 
@@ -755,18 +1759,56 @@ int main(int argc, char **argv) {
     status_pipe_read_fd  = pipefds[0];
     status_pipe_write_fd = pipefds[1];
 
-    pipe2(pipefds, O_NONBLOCK);
-    control_pipe_read_fd  = pipefds[0];
-    control_pipe_write_fd = pipefds[1];
+    histo_init(&upload_latency, "upload");
+    histo_init(&monitor_latency, "monitor");
+    monitor_init(&monitor, CHANNELS, SAMPLE_RATE, FRAMES_PER_BUFFER, MONITOR_RING_NBUFFERS);
 
-    pthread_t upload_thread;
-    pthread_create(&upload_thread, NULL, upload_thread_main, NULL);
+    diskwriter_init(&diskwriter, WRITE_NBUFFERS, WRITE_BUFFER_KB * 1024, WRITE_DIRECT);
+    for (i = 0; i < nstreams; i++) stream_init(&streams[i], &profile);
+
+    setlinebuf(stderr);
+
+    // replayed sessions are for testing, so their recordings are never uploaded,
+    // and whatever a crashed live session left is saved for the next one
+    if (replay) {
+        for (i = 0; i < nstreams; i++) {
+            if (capture_open_replay(&streams[i].capture, streams[i].source, !replay_fast, CHANNELS, SAMPLE_RATE,
+                                    FRAMES_PER_BUFFER, ANALYSIS_HOP_FRAMES) != paNoError) {
+                return 1;
+            }
+            if (replay_fast) encoder_set_wait(&streams[i].encoder, true);
+        }
+        if (!replay_fast) {
+            pthread_t network_thread;
+            pthread_create(&network_thread, NULL, network_thread_main, NULL);
+        }
+        return run_streams();
+    }
+
+    const char *home = getenv("HOME") != NULL ? getenv("HOME") : ".";
+    char login_path[1024], token_path[1024];
+    snprintf(login_path, sizeof(login_path), "%s/%s", home, UPLOAD_LOGIN);
+    snprintf(token_path, sizeof(token_path), "%s/%s", home, UPLOAD_TOKEN);
+    catalog_init(&catalog, CATALOG_PATH);
+    uploader_init(&uploader, upload_url, login_path, token_path, UPLOAD_ARTWORK);
+    uploadq_init(&uploadq, ".", UPLOAD_WORKERS, UPLOAD_RETRY_INITIAL_SECONDS, UPLOAD_RETRY_MAX_SECONDS,
+                 upload_file, &uploader);
+    live_upload = live_sink[0] != '\0';
+    if (live_upload) {
+        livesink_init(&livesink, live_sink, LIVE_UPLOAD_INTERVAL_MS);
+        livesink_start(&livesink);
+    }
+    for (i = 0; i < nstreams; i++) {
+        encoder_set_event_cb(&streams[i].encoder, recording_event, NULL);
+        encoder_set_checkpoint(&streams[i].encoder, CHECKPOINT_SECONDS);
+    }
+    // recovery goes by filename, so it finds every stream's leftovers
+    encoder_recover(&streams[0].encoder);
+    uploadq_start(&uploadq);
 
     pthread_t network_thread;
     pthread_create(&network_thread, NULL, network_thread_main, NULL);
 
-    setlinebuf(stderr);
-
     int ndevices = Pa_GetDeviceCount();
     int device;
     /*
@@ -781,14 +1823,19 @@ int main(int argc, char **argv) {
     }
     */
 
-    for (device = 0; device < ndevices; device++) {
-        const PaDeviceInfo *info = Pa_GetDeviceInfo(device);
-        if (!strcmp(info->name, DEVICE_NAME)) {
-            return run(device);
+    for (i = 0; i < nstreams; i++) {
+        for (device = 0; device < ndevices; device++) {
+            const PaDeviceInfo *info = Pa_GetDeviceInfo(device);
+            if (!strcmp(info->name, streams[i].source)) break;
+        }
+        if (device == ndevices) {
+            printf("Device '%s' not found. Exiting", streams[i].source);
+            return 1;
+        }
+        if (open_device(&streams[i].capture, device, capture_mode) != paNoError) {
+            return 1;
         }
     }
-    printf("Device '%s' not found. Exiting", DEVICE_NAME);
-
-    return 1;
+    return run_streams();
 }
 
@@ -0,0 +1,203 @@
+#include "replay.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static bool replay_has_suffix(const char *path, const char *suffix) {
+    size_t len = strlen(path), slen = strlen(suffix);
+    return len >= slen && strcasecmp(path + len - slen, suffix) == 0;
+}
+
+static unsigned replay_le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static unsigned replay_le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24); }
+
+// walks the RIFF chunks up to "data", checking "fmt " on the way
+static bool replay_open_wav(replay_t *self, const char *path, int sample_rate) {
+    uint8_t hdr[12];
+    if (fread(hdr, 1, 12, self->file) != 12 || memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0) {
+        tracef("%s is not a wav file", path);
+        return false;
+    }
+
+    bool have_fmt = false;
+    for (;;) {
+        uint8_t chunk[8];
+        if (fread(chunk, 1, 8, self->file) != 8) {
+            tracef("%s has no data chunk", path);
+            return false;
+        }
+        unsigned len = replay_le32(chunk + 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t fmt[16];
+            if (len < 16 || fread(fmt, 1, 16, self->file) != 16) {
+                tracef("%s has a bad fmt chunk", path);
+                return false;
+            }
+            unsigned format   = replay_le16(fmt);
+            unsigned channels = replay_le16(fmt + 2);
+            unsigned rate     = replay_le32(fmt + 4);
+            unsigned bits     = replay_le16(fmt + 14);
+            // 0xfffe is WAVE_FORMAT_EXTENSIBLE, which is still plain PCM at 16 bits
+            if ((format != 1 && format != 0xfffe) || bits != 16 || channels != (unsigned)self->channels ||
+                    rate != (unsigned)sample_rate) {
+                tracef("%s is format %u, %u bit, %u channels, %uHz; need 16 bit PCM, %d channels, %dHz",
+                        path, format, bits, channels, rate, self->channels, sample_rate);
+                return false;
+            }
+            have_fmt = true;
+            len -= 16;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                tracef("%s has data before fmt", path);
+                return false;
+            }
+            self->data_left = len;
+            return true;
+        }
+
+        // chunks are padded to an even length
+        if (fseek(self->file, len + (len & 1), SEEK_CUR) != 0) {
+            tracef("%s is truncated", path);
+            return false;
+        }
+    }
+}
+
+static FLAC__StreamDecoderWriteStatus replay_flac_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+                                                        const FLAC__int32 * const buffer[], void *client_data) {
+    replay_t *self = (replay_t*)client_data;
+    if (frame->header.channels != (unsigned)self->channels || frame->header.sample_rate != (unsigned)self->sample_rate) {
+        tracef("flac has %u channels at %uHz, need %d at %dHz", frame->header.channels, frame->header.sample_rate,
+                self->channels, self->sample_rate);
+        self->failed = true;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
+    int nframes = (int)frame->header.blocksize;
+    if (nframes > self->pending_cap) {
+        self->pending     = realloc(self->pending, sizeof(short) * nframes * self->channels);
+        self->pending_cap = nframes;
+        if (self->pending == NULL) failf("out of memory decoding flac");
+    }
+
+    // anything other than 16 bit is scaled to it
+    int shift = (int)frame->header.bits_per_sample - 16;
+    int i, ch;
+    for (i = 0; i < nframes; i++) {
+        for (ch = 0; ch < self->channels; ch++) {
+            FLAC__int32 s = buffer[ch][i];
+            self->pending[i * self->channels + ch] = (short)(shift >= 0 ? s >> shift : s << -shift);
+        }
+    }
+    self->pending_frames = nframes;
+    self->pending_off    = 0;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void replay_flac_metadata(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata,
+                                 void *client_data) {
+    replay_t *self = (replay_t*)client_data;
+    if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO) return;
+    self->flac_channels = metadata->data.stream_info.channels;
+    self->flac_rate     = metadata->data.stream_info.sample_rate;
+}
+
+static void replay_flac_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+    tracef("flac decode error %d", (int)status);
+}
+
+bool replay_open(replay_t *self, const char *path, int channels, int sample_rate) {
+    memset(self, 0, sizeof(*self));
+    self->channels    = channels;
+    self->sample_rate = sample_rate;
+
+    if (replay_has_suffix(path, ".flac")) {
+        self->format = REPLAY_FORMAT_FLAC;
+        self->flac   = FLAC__stream_decoder_new();
+        if (self->flac == NULL) failf("couldn't start flac decoder");
+        if (FLAC__stream_decoder_init_file(self->flac, path, replay_flac_write, replay_flac_metadata, replay_flac_error,
+                                           self) != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+            tracef("couldn't open %s", path);
+            FLAC__stream_decoder_delete(self->flac);
+            self->flac = NULL;
+            return false;
+        }
+        // the STREAMINFO comes first, so a file in the wrong format is turned away before any audio
+        if (!FLAC__stream_decoder_process_until_end_of_metadata(self->flac) || self->flac_rate == 0) {
+            tracef("%s is not a flac file", path);
+            replay_close(self);
+            return false;
+        }
+        if (self->flac_channels != (unsigned)channels || self->flac_rate != (unsigned)sample_rate) {
+            tracef("%s is %u channels, %uHz; need %d channels, %dHz", path, self->flac_channels, self->flac_rate,
+                    channels, sample_rate);
+            replay_close(self);
+            return false;
+        }
+        return true;
+    }
+
+    self->file = fopen(path, "rb");
+    if (self->file == NULL) {
+        tracef("couldn't open %s", path);
+        return false;
+    }
+    if (replay_has_suffix(path, ".wav")) {
+        self->format = REPLAY_FORMAT_WAV;
+        if (!replay_open_wav(self, path, sample_rate)) {
+            replay_close(self);
+            return false;
+        }
+    } else {
+        self->format = REPLAY_FORMAT_RAW;
+    }
+    return true;
+}
+
+void replay_close(replay_t *self) {
+    if (self->flac != NULL) {
+        FLAC__stream_decoder_finish(self->flac);
+        FLAC__stream_decoder_delete(self->flac);
+        self->flac = NULL;
+    }
+    if (self->file != NULL) {
+        fclose(self->file);
+        self->file = NULL;
+    }
+    free(self->pending);
+    self->pending = NULL;
+}
+
+int replay_read(replay_t *self, short *samples, int nframes) {
+    int frame_bytes = sizeof(short) * self->channels;
+
+    if (self->format != REPLAY_FORMAT_FLAC) {
+        size_t want = nframes;
+        if (self->format == REPLAY_FORMAT_WAV && (long long)want * frame_bytes > self->data_left) {
+            want = self->data_left / frame_bytes;
+        }
+        // sample data is little endian, like everything this runs on
+        size_t got = fread(samples, frame_bytes, want, self->file);
+        self->data_left -= (long long)got * frame_bytes;
+        return (int)got;
+    }
+
+    int done = 0;
+    while (done < nframes) {
+        if (self->pending_off == self->pending_frames) {
+            if (self->failed || FLAC__stream_decoder_get_state(self->flac) == FLAC__STREAM_DECODER_END_OF_STREAM) break;
+            if (!FLAC__stream_decoder_process_single(self->flac)) break;
+            continue;
+        }
+        int n = self->pending_frames - self->pending_off;
+        if (n > nframes - done) n = nframes - done;
+        memcpy(samples + done * self->channels, self->pending + self->pending_off * self->channels, n * frame_bytes);
+        self->pending_off += n;
+        done += n;
+    }
+    return done;
+}
@@ -0,0 +1,50 @@
+#ifndef INCLUDED_REPLAY_H
+#define INCLUDED_REPLAY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include <FLAC/all.h>
+
+typedef struct replay replay_t;
+
+/* reads a captured session back as interleaved 16 bit audio, so it can be
+ * fed through the recorder in place of the live device.
+ *
+ * .wav (16 bit PCM) and .flac files must match channels and sample_rate.
+ * anything else is taken to be headerless little endian 16 bit PCM in that
+ * format, e.g. from
+ *     arecord -f cd -t raw session.raw
+ */
+bool replay_open(replay_t *self, const char *path, int channels, int sample_rate);
+void replay_close(replay_t *self);
+
+/* reads up to nframes. returns how many were read; 0 means the end of the file. */
+int  replay_read(replay_t *self, short *samples, int nframes);
+
+typedef enum {
+    REPLAY_FORMAT_RAW,
+    REPLAY_FORMAT_WAV,
+    REPLAY_FORMAT_FLAC,
+} replay_format_t;
+
+struct replay
+{
+    replay_format_t      format;
+    int                  channels;
+    int                  sample_rate;
+    FILE                *file;
+    long long            data_left;     // wav: bytes of sample data left
+
+    // flac: the decoder hands over a whole frame at a time
+    FLAC__StreamDecoder *flac;
+    unsigned             flac_channels; // from the STREAMINFO, 0 until it's been read
+    unsigned             flac_rate;
+    short               *pending;
+    int                  pending_cap;   // frames
+    int                  pending_frames;
+    int                  pending_off;
+    bool                 failed;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#include "ringbuf.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void ringbuf_init(ringbuf_t *self, int slot_size, int nslots) {
+    int n = 1;
+    while (n < nslots) n <<= 1;
+
+    self->slot_size  = slot_size;
+    self->nslots     = n;
+    self->mask       = (unsigned)n - 1;
+    self->high_water = 0;
+    self->head       = 0;
+    self->tail       = 0;
+    self->slots      = malloc((size_t)slot_size * n);
+    if (self->slots == NULL) {
+        failf("couldn't allocate %d byte ring buffer", slot_size * n);
+    }
+
+    // touch every page now so the first trip around the ring doesn't fault
+    memset(self->slots, 0, (size_t)slot_size * n);
+}
+
+void ringbuf_destroy(ringbuf_t *self) {
+    free(self->slots);
+    self->slots = NULL;
+}
+
+void *ringbuf_write_begin(ringbuf_t *self) {
+    unsigned head = self->head;
+    unsigned tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= (unsigned)self->nslots) return NULL;
+    return self->slots + (size_t)(head & self->mask) * self->slot_size;
+}
+
+void ringbuf_write_end(ringbuf_t *self) {
+    unsigned head = self->head + 1;
+    unsigned tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+    int used = (int)(head - tail);
+    if (used > self->high_water) __atomic_store_n(&self->high_water, used, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->head, head, __ATOMIC_RELEASE);
+}
+
+void *ringbuf_read_begin(ringbuf_t *self) {
+    unsigned tail = self->tail;
+    unsigned head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return NULL;
+    return self->slots + (size_t)(tail & self->mask) * self->slot_size;
+}
+
+void *ringbuf_read_peek(ringbuf_t *self) {
+    return self->slots + (size_t)(self->tail & self->mask) * self->slot_size;
+}
+
+void ringbuf_read_end(ringbuf_t *self) {
+    __atomic_store_n(&self->tail, self->tail + 1, __ATOMIC_RELEASE);
+}
+
+int ringbuf_count(ringbuf_t *self) {
+    unsigned head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+    unsigned tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
+    return (int)(head - tail);
+}
+
+int ringbuf_free(ringbuf_t *self) {
+    return self->nslots - ringbuf_count(self);
+}
+
+int ringbuf_high_water(ringbuf_t *self) {
+    return __atomic_load_n(&self->high_water, __ATOMIC_RELAXED);
+}
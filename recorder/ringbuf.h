@@ -0,0 +1,57 @@
+#ifndef INCLUDED_RINGBUF_H
+#define INCLUDED_RINGBUF_H
+
+typedef struct ringbuf ringbuf_t;
+
+/* lock-free single-producer/single-consumer ring of fixed size slots.
+ *
+ * all memory is allocated up front by ringbuf_init, so neither side ever
+ * allocates or takes a lock. exactly one thread may call the write functions
+ * and exactly one (other) thread may call the read functions.
+ *
+ * nslots is rounded up to a power of two.
+ */
+void ringbuf_init(ringbuf_t *self, int slot_size, int nslots);
+void ringbuf_destroy(ringbuf_t *self);
+
+/* returns a pointer to the next free slot, or NULL if the ring is full.
+ * the slot becomes visible to the reader once ringbuf_write_end is called.
+ */
+void *ringbuf_write_begin(ringbuf_t *self);
+void  ringbuf_write_end(ringbuf_t *self);
+
+/* returns a pointer to the oldest filled slot, or NULL if the ring is empty.
+ * the slot is handed back to the writer once ringbuf_read_end is called.
+ */
+void *ringbuf_read_begin(ringbuf_t *self);
+void  ringbuf_read_end(ringbuf_t *self);
+
+/* the slot ringbuf_read_begin will return next, even while the writer is
+ * still filling it in. only safe when the two sides agree some other way
+ * on how much of it is done (see capture.c).
+ */
+void *ringbuf_read_peek(ringbuf_t *self);
+
+int ringbuf_count(ringbuf_t *self);
+int ringbuf_free(ringbuf_t *self);
+
+/* the largest number of slots that have ever been in use at once */
+int ringbuf_high_water(ringbuf_t *self);
+
+#define RINGBUF_CACHE_LINE 64
+
+struct ringbuf
+{
+    char             *slots;
+    int               slot_size;
+    int               nslots;
+    unsigned          mask;
+    int               high_water;
+
+    // head is only written by the producer and tail only by the consumer,
+    // so keep them on separate cache lines to avoid false sharing.
+    unsigned          head __attribute__((aligned(RINGBUF_CACHE_LINE)));
+    unsigned          tail __attribute__((aligned(RINGBUF_CACHE_LINE)));
+};
+
+#endif
@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include "tracelog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// the ring is a bounded queue with a sequence number per slot: a slot is
+// free for the producer that claims position pos when its seq is pos, and
+// ready for the consumer once that producer sets it to pos + 1. producers
+// claim positions with a CAS on head; the consumer, holding drain_lock,
+// frees them again by setting seq to pos + TRACELOG_RING_SLOTS.
+static tracelog_slot_t  ring[TRACELOG_RING_SLOTS];
+static unsigned         head;
+static unsigned         tail;
+static int              dropped;
+static tracelog_site_t  sites[TRACELOG_MAX_SITES];
+
+static pthread_once_t   once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool             threaded;
+
+typedef enum {
+    TRACELOG_ARG_NONE,          // %% or something it doesn't know: no argument
+    TRACELOG_ARG_INT,
+    TRACELOG_ARG_LONG,
+    TRACELOG_ARG_LLONG,
+    TRACELOG_ARG_UINT,
+    TRACELOG_ARG_ULONG,
+    TRACELOG_ARG_ULLONG,
+    TRACELOG_ARG_SIZE,
+    TRACELOG_ARG_DOUBLE,
+    TRACELOG_ARG_LDOUBLE,
+    TRACELOG_ARG_STRING,
+    TRACELOG_ARG_POINTER,
+    TRACELOG_ARG_IGNORED,       // %n: takes a pointer, prints nothing
+} tracelog_kind_t;
+
+// one conversion of a format
+typedef struct {
+    const char     *end;            // just past it
+    int             stars;          // * width and/or precision: an int argument each, before the value
+    int             precision;      // when it's written out, else -1
+    bool            star_precision;
+    tracelog_kind_t kind;
+} tracelog_spec_t;
+
+// parses the conversion that starts with the '%' at p
+static void tracelog_parse(const char *p, tracelog_spec_t *spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->precision = -1;
+    p++;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) p++;
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    } else {
+        while (isdigit((unsigned char)*p)) p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            spec->star_precision = true;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (isdigit((unsigned char)*p)) spec->precision = spec->precision * 10 + *p++ - '0';
+        }
+    }
+
+    int  longs   = 0;
+    bool size    = false;
+    bool ldouble = false;
+    for (;; p++) {
+        if (*p == 'l')                  longs++;
+        else if (*p == 'j' || *p == 'q') longs = 2;
+        else if (*p == 'z' || *p == 't') size = true;
+        else if (*p == 'L')             ldouble = true;
+        else if (*p != 'h')             break;
+    }
+    spec->end = *p != '\0' ? p + 1 : p;
+
+    switch (*p) {
+        case 'd': case 'i':
+            spec->kind = size ? TRACELOG_ARG_SIZE : longs == 0 ? TRACELOG_ARG_INT
+                       : longs == 1 ? TRACELOG_ARG_LONG : TRACELOG_ARG_LLONG;
+            break;
+        case 'u': case 'x': case 'X': case 'o':
+            spec->kind = size ? TRACELOG_ARG_SIZE : longs == 0 ? TRACELOG_ARG_UINT
+                       : longs == 1 ? TRACELOG_ARG_ULONG : TRACELOG_ARG_ULLONG;
+            break;
+        case 'c':
+            spec->kind = TRACELOG_ARG_INT;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->kind = ldouble ? TRACELOG_ARG_LDOUBLE : TRACELOG_ARG_DOUBLE;
+            break;
+        case 's': spec->kind = TRACELOG_ARG_STRING;  break;
+        case 'p': spec->kind = TRACELOG_ARG_POINTER; break;
+        case 'n': spec->kind = TRACELOG_ARG_IGNORED; break;
+        default:  spec->kind = TRACELOG_ARG_NONE;    break;
+    }
+}
+
+// copies the arguments fmt takes into the slot. strings are copied, up to
+// what's left of the slot's room for them.
+static void tracelog_capture(tracelog_slot_t *slot, const char *fmt, va_list ap) {
+    int strings = 0;
+    slot->fmt   = fmt;
+    slot->nargs = 0;
+    slot->strings[TRACELOG_STRING_BYTES - 1] = '\0';
+
+    const char *p;
+    for (p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%')) {
+        tracelog_spec_t spec;
+        tracelog_parse(p, &spec);
+        p = spec.end;
+        if (spec.kind == TRACELOG_ARG_NONE) continue;
+        if (slot->nargs + spec.stars + 1 > TRACELOG_MAX_ARGS) break;
+
+        tracelog_arg_t *args = slot->args;
+        int s;
+        for (s = 0; s < spec.stars; s++) args[slot->nargs++].i = va_arg(ap, int);
+        if (spec.star_precision) spec.precision = (int)args[slot->nargs - 1].i;
+
+        tracelog_arg_t *arg = &args[slot->nargs++];
+        switch (spec.kind) {
+            case TRACELOG_ARG_INT:     arg->i = va_arg(ap, int);                            break;
+            case TRACELOG_ARG_LONG:    arg->i = va_arg(ap, long);                           break;
+            case TRACELOG_ARG_LLONG:   arg->i = va_arg(ap, long long);                      break;
+            case TRACELOG_ARG_UINT:    arg->i = va_arg(ap, unsigned);                       break;
+            case TRACELOG_ARG_ULONG:   arg->i = (long long)va_arg(ap, unsigned long);       break;
+            case TRACELOG_ARG_ULLONG:  arg->i = (long long)va_arg(ap, unsigned long long);  break;
+            case TRACELOG_ARG_SIZE:    arg->i = (long long)va_arg(ap, size_t);              break;
+            case TRACELOG_ARG_DOUBLE:  arg->d = va_arg(ap, double);                         break;
+            case TRACELOG_ARG_LDOUBLE: arg->d = (double)va_arg(ap, long double);            break;
+            case TRACELOG_ARG_POINTER:
+            case TRACELOG_ARG_IGNORED: arg->p = va_arg(ap, void*);                          break;
+            case TRACELOG_ARG_STRING: {
+                const char *str  = va_arg(ap, const char*);
+                int         room = TRACELOG_STRING_BYTES - 1 - strings;
+                if (str == NULL) str = "(null)";
+                if (spec.precision >= 0 && spec.precision < room) room = spec.precision;
+                if (room <= 0) {
+                    arg->s = TRACELOG_STRING_BYTES - 1;     // out of room: ""
+                    break;
+                }
+                int len = strnlen(str, room);
+                memcpy(slot->strings + strings, str, len);
+                slot->strings[strings + len] = '\0';
+                arg->s   = strings;
+                strings += len + 1;
+            } break;
+            default: break;
+        }
+    }
+}
+
+#define TRACELOG_PRINT(value) \
+    (spec.stars == 0 ? snprintf(buf + off, len - off, specbuf, value) : \
+     spec.stars == 1 ? snprintf(buf + off, len - off, specbuf, star[0], value) : \
+                       snprintf(buf + off, len - off, specbuf, star[0], star[1], value))
+
+// snprintf's return is what it would have written; off never passes the end
+#define TRACELOG_ADVANCE(written) do { \
+    int written_ = (written); \
+    if (written_ > 0) off += written_; \
+    if (off > len - 1) off = len - 1; \
+} while (0)
+
+// formats a trace into buf as the line it's written as. returns its length.
+static int tracelog_format(const tracelog_slot_t *slot, char *buf, int len) {
+    int off = 0;
+    int n   = 0;
+    TRACELOG_ADVANCE(snprintf(buf, len, "%s", TRACELOG_PREFIX));
+    const char *p = slot->fmt;
+    while (*p != '\0' && off < len - 1) {
+        const char *pct = strchr(p, '%');
+        int literal = pct != NULL ? (int)(pct - p) : (int)strlen(p);
+        TRACELOG_ADVANCE(snprintf(buf + off, len - off, "%.*s", literal, p));
+        if (pct == NULL || off >= len - 1) break;
+
+        tracelog_spec_t spec;
+        tracelog_parse(pct, &spec);
+        p = spec.end;
+        int speclen = (int)(spec.end - pct);
+        int need    = spec.kind == TRACELOG_ARG_NONE ? 0 : spec.stars + 1;
+        char specbuf[32];
+        if (n + need > slot->nargs || speclen >= (int)sizeof(specbuf)) {
+            // arguments past TRACELOG_MAX_ARGS weren't kept: the rest goes out as it is
+            TRACELOG_ADVANCE(snprintf(buf + off, len - off, "%s", pct));
+            break;
+        }
+        if (spec.kind == TRACELOG_ARG_NONE) {
+            TRACELOG_ADVANCE(snprintf(buf + off, len - off, "%s", pct[1] == '%' ? "%" : ""));
+            continue;
+        }
+        memcpy(specbuf, pct, speclen);
+        specbuf[speclen] = '\0';
+
+        int star[2] = {0, 0}, s;
+        for (s = 0; s < spec.stars; s++) star[s] = (int)slot->args[n++].i;
+        const tracelog_arg_t *arg = &slot->args[n++];
+        switch (spec.kind) {
+            case TRACELOG_ARG_INT:     TRACELOG_ADVANCE(TRACELOG_PRINT((int)arg->i));                 break;
+            case TRACELOG_ARG_LONG:    TRACELOG_ADVANCE(TRACELOG_PRINT((long)arg->i));                break;
+            case TRACELOG_ARG_LLONG:   TRACELOG_ADVANCE(TRACELOG_PRINT(arg->i));                      break;
+            case TRACELOG_ARG_UINT:    TRACELOG_ADVANCE(TRACELOG_PRINT((unsigned)arg->i));            break;
+            case TRACELOG_ARG_ULONG:   TRACELOG_ADVANCE(TRACELOG_PRINT((unsigned long)arg->i));       break;
+            case TRACELOG_ARG_ULLONG:  TRACELOG_ADVANCE(TRACELOG_PRINT((unsigned long long)arg->i));  break;
+            case TRACELOG_ARG_SIZE:    TRACELOG_ADVANCE(TRACELOG_PRINT((size_t)arg->i));              break;
+            case TRACELOG_ARG_DOUBLE:  TRACELOG_ADVANCE(TRACELOG_PRINT(arg->d));                      break;
+            case TRACELOG_ARG_LDOUBLE: TRACELOG_ADVANCE(TRACELOG_PRINT((long double)arg->d));         break;
+            case TRACELOG_ARG_STRING:  TRACELOG_ADVANCE(TRACELOG_PRINT(slot->strings + arg->s));      break;
+            case TRACELOG_ARG_POINTER: TRACELOG_ADVANCE(TRACELOG_PRINT(arg->p));                      break;
+            default: break;
+        }
+    }
+
+    if (slot->suppressed > 0) {
+        char note[64];
+        snprintf(note, sizeof(note), " (%d more like this suppressed)", slot->suppressed);
+        TRACELOG_ADVANCE(snprintf(buf + off, len - off, "%s", note));
+    }
+    if (off < len - 1) buf[off++] = '\n';
+    buf[off] = '\0';
+    return off;
+}
+
+// the site fmt is traced from, or NULL if there's no room for another
+static tracelog_site_t *tracelog_site(const char *fmt) {
+    unsigned hash = (unsigned)(((uintptr_t)fmt >> 3) * 2654435761u) % TRACELOG_MAX_SITES;
+    int i;
+    for (i = 0; i < TRACELOG_MAX_SITES; i++) {
+        tracelog_site_t *site = &sites[(hash + i) % TRACELOG_MAX_SITES];
+        const char *cur = __atomic_load_n(&site->fmt, __ATOMIC_ACQUIRE);
+        if (cur == NULL && __atomic_compare_exchange_n(&site->fmt, &cur, fmt, false, __ATOMIC_ACQ_REL,
+                                                       __ATOMIC_ACQUIRE)) {
+            return site;
+        }
+        if (cur == fmt) return site;
+    }
+    return NULL;
+}
+
+// whether a trace from site gets through. if it does, takes the count of
+// the ones suppressed before it.
+static bool tracelog_allow(tracelog_site_t *site, long long now, int *suppressed) {
+    long long start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+    if (now - start >= TRACELOG_WINDOW_US &&
+        __atomic_compare_exchange_n(&site->window_start, &start, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > TRACELOG_BURST) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+// the vdso's coarse clock: no syscall, and a tick is plenty for rate limiting
+static long long tracelog_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void tracelog_drain(bool final);
+
+static void *tracelog_thread_main(void *arg) {
+    for (;;) {
+        tracelog_drain(false);
+        usleep(TRACELOG_POLL_MS * 1000);
+    }
+    return NULL;
+}
+
+static void tracelog_start() {
+    unsigned pos;
+    for (pos = 0; pos < TRACELOG_RING_SLOTS; pos++) ring[pos].seq = pos;
+    atexit(tracelog_flush);
+
+    // whoever traces first may be an audio thread; the tracelog thread
+    // shouldn't get its real-time priority
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    threaded = pthread_create(&thread, &attr, tracelog_thread_main, NULL) == 0;
+    pthread_attr_destroy(&attr);
+    if (!threaded) fprintf(stderr, TRACELOG_PREFIX "couldn't start trace thread, tracing synchronously\n");
+}
+
+void tracelog_write(const char *fmt, va_list ap) {
+    pthread_once(&once, tracelog_start);
+
+    int suppressed = 0;
+    tracelog_site_t *site = tracelog_site(fmt);
+    if (site != NULL && !tracelog_allow(site, tracelog_now_us(), &suppressed)) return;
+
+    unsigned pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    tracelog_slot_t *slot;
+    for (;;) {
+        slot = &ring[pos % TRACELOG_RING_SLOTS];
+        int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            // full: the consumer hasn't freed this slot from the last time round
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            if (site != NULL && suppressed > 0) __atomic_add_fetch(&site->suppressed, suppressed, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    tracelog_capture(slot, fmt, ap);
+    slot->suppressed = suppressed;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (!threaded) tracelog_drain(false);
+}
+
+// makes room in out for another line, writing out what's there if it has to
+static void tracelog_room(char *out, int size, int *off) {
+    if (size - *off < TRACELOG_LINE_BYTES) {
+        fwrite(out, 1, *off, stderr);
+        *off = 0;
+    }
+}
+
+// writes out the ring. final says what was suppressed even if its window
+// isn't over yet, since there won't be another chance.
+static void tracelog_drain(bool final) {
+    char out[16384];
+    int  off = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (;;) {
+        tracelog_slot_t *slot = &ring[tail % TRACELOG_RING_SLOTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) break;
+        tracelog_room(out, sizeof(out), &off);
+        off += tracelog_format(slot, out + off, TRACELOG_LINE_BYTES);
+        __atomic_store_n(&slot->seq, tail + TRACELOG_RING_SLOTS, __ATOMIC_RELEASE);
+        tail++;
+    }
+
+    int ndropped = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (ndropped > 0) {
+        tracelog_room(out, sizeof(out), &off);
+        off += snprintf(out + off, TRACELOG_LINE_BYTES, TRACELOG_PREFIX "dropped %d traces: the trace ring was full\n",
+                        ndropped);
+    }
+
+    // sites that went quiet while suppressed: say how much was left out
+    long long now = tracelog_now_us();
+    int i;
+    for (i = 0; i < TRACELOG_MAX_SITES; i++) {
+        tracelog_site_t *site = &sites[i];
+        const char *fmt = __atomic_load_n(&site->fmt, __ATOMIC_ACQUIRE);
+        if (fmt == NULL || __atomic_load_n(&site->suppressed, __ATOMIC_RELAXED) == 0) continue;
+        if (!final && now - __atomic_load_n(&site->window_start, __ATOMIC_RELAXED) < TRACELOG_WINDOW_US) continue;
+        int n = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+        if (n == 0) continue;
+        tracelog_room(out, sizeof(out), &off);
+        int written = snprintf(out + off, TRACELOG_LINE_BYTES, TRACELOG_PREFIX "%d more like \"%s\" suppressed\n", n, fmt);
+        if (written >= TRACELOG_LINE_BYTES) {
+            written = TRACELOG_LINE_BYTES - 1;
+            out[off + written - 1] = '\n';
+        }
+        off += written;
+    }
+
+    if (off > 0) {
+        fwrite(out, 1, off, stderr);
+        fflush(stderr);
+    }
+    pthread_mutex_unlock(&drain_lock);
+}
+
+void tracelog_flush() {
+    tracelog_drain(true);
+}
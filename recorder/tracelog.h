@@ -0,0 +1,65 @@
+#ifndef INCLUDED_TRACELOG_H
+#define INCLUDED_TRACELOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+/* where tracef's traces go: a lock-free ring, and a thread of its own that
+ * formats them and writes them to stderr, in the order they were traced.
+ *
+ * tracelog_write never blocks, takes a lock or formats anything, so the
+ * audio threads can trace while a slow or stuck log file holds up nobody
+ * but the tracelog thread. it copies the format (which has to live for the
+ * life of the process, as tracef's string literals do) and the arguments
+ * into a slot; strings are copied too, up to TRACELOG_STRING_BYTES per trace.
+ *
+ * a call site (a format) that traces more than TRACELOG_BURST times in
+ * TRACELOG_WINDOW_US is quiet for the rest of the window, so something that
+ * traces every buffer can't flood the ring. the next trace from it that
+ * gets through says how many were suppressed, or a summary line does if
+ * none does. traces that find the ring full are dropped and counted, and
+ * the count is written once there's room.
+ *
+ * the thread starts with the first trace. safe to call from any thread.
+ */
+void tracelog_write(const char *fmt, va_list ap);
+
+/* writes out everything traced so far, from the calling thread. for fatal
+ * errors, so the traces leading up to one come out before it, and at exit.
+ */
+void tracelog_flush();
+
+#define TRACELOG_RING_SLOTS     (256)           // a power of 2
+#define TRACELOG_MAX_ARGS       (12)            // arguments past this are left out, with the rest of the format
+#define TRACELOG_STRING_BYTES   (384)           // for every %s of a trace together
+#define TRACELOG_BURST          (5)
+#define TRACELOG_WINDOW_US      (1000000)
+#define TRACELOG_MAX_SITES      (512)           // call sites rate limited; any more aren't
+#define TRACELOG_POLL_MS        (20)            // how often the thread looks for traces
+#define TRACELOG_LINE_BYTES     (1024)          // longest line written; longer ones are cut short
+#define TRACELOG_PREFIX         "[recordthepiano] "
+
+typedef union {
+    long long       i;
+    double          d;
+    const void     *p;
+    int             s;                          // where a %s's copy starts in strings
+} tracelog_arg_t;
+
+typedef struct {
+    unsigned        seq;                        // whose turn the slot is, see tracelog.c
+    const char     *fmt;
+    int             nargs;
+    int             suppressed;                 // traces from this site suppressed before it
+    tracelog_arg_t  args[TRACELOG_MAX_ARGS];
+    char            strings[TRACELOG_STRING_BYTES];
+} tracelog_slot_t;
+
+typedef struct {
+    const char     *fmt;                        // NULL while unused
+    long long       window_start;               // us
+    int             count;                      // traces in this window
+    int             suppressed;                 // since the last one that got through
+} tracelog_site_t;
+
+#endif
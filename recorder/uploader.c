@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+
+#include "uploader.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct {
+    char    data[UPLOADER_MAX_RESPONSE];
+    int     len;
+} uploader_response_t;
+
+// keeps as much of the body as fits; the fields we want come early
+static size_t uploader_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    uploader_response_t *response = (uploader_response_t*)userdata;
+    int n    = size * nmemb;
+    int room = sizeof(response->data) - 1 - response->len;
+    memcpy(response->data + response->len, ptr, n < room ? n : room);
+    response->len += n < room ? n : room;
+    response->data[response->len] = 0;
+    return n;
+}
+
+// the string value of "key" in a flat json object. good enough for the two
+// replies we read; \/ is the only escape soundcloud puts in them.
+static bool json_string(const char *json, const char *key, char *out, int len) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *p = strstr(json, quoted);
+    if (p == NULL) return false;
+    p += strlen(quoted);
+    while (isspace(*p) || *p == ':') p++;
+    if (*p++ != '"') return false;
+    int n = 0;
+    while (*p && *p != '"' && n < len - 1) {
+        if (*p == '\\' && p[1]) p++;
+        out[n++] = *p++;
+    }
+    out[n] = 0;
+    return *p == '"';
+}
+
+static long long json_number(const char *json, const char *key) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *p = strstr(json, quoted);
+    if (p == NULL) return 0;
+    p += strlen(quoted);
+    while (isspace(*p) || *p == ':') p++;
+    return atoll(p);
+}
+
+static void uploader_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userdata) {
+    pthread_mutex_lock(&((uploader_t*)userdata)->share_locks[data]);
+}
+
+static void uploader_unlock(CURL *handle, curl_lock_data data, void *userdata) {
+    pthread_mutex_unlock(&((uploader_t*)userdata)->share_locks[data]);
+}
+
+void uploader_init(uploader_t *self, const char *url, const char *login_path, const char *token_path,
+                   const char *artwork_path) {
+    memset(self, 0, sizeof(*self));
+    snprintf(self->url,          sizeof(self->url),          "%s", url);
+    snprintf(self->login_path,   sizeof(self->login_path),   "%s", login_path);
+    snprintf(self->token_path,   sizeof(self->token_path),   "%s", token_path);
+    snprintf(self->artwork_path, sizeof(self->artwork_path), "%s", artwork_path);
+    int len = strlen(self->url);
+    while (len > 0 && self->url[len - 1] == '/') self->url[--len] = 0;
+
+    // not thread safe, so before any upload thread exists
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) failf("couldn't initialize libcurl");
+    self->share = curl_share_init();
+    if (self->share == NULL) failf("couldn't allocate curl share");
+    int i;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&self->share_locks[i], NULL);
+    curl_share_setopt(self->share, CURLSHOPT_LOCKFUNC,   uploader_lock);
+    curl_share_setopt(self->share, CURLSHOPT_UNLOCKFUNC, uploader_unlock);
+    curl_share_setopt(self->share, CURLSHOPT_USERDATA,   self);
+    curl_share_setopt(self->share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(self->share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_DNS);
+    curl_share_setopt(self->share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_SSL_SESSION);
+
+    pthread_mutex_init(&self->token_lock, NULL);
+    FILE *f = fopen(self->token_path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%255s %lld", self->token, &self->token_expires) != 2) self->token[0] = 0;
+        fclose(f);
+    }
+}
+
+static CURL *uploader_easy(uploader_t *self, const char *path, uploader_response_t *response) {
+    char url[2048];
+    snprintf(url, sizeof(url), "%s%s", self->url, path);
+    CURL *curl = curl_easy_init();
+    if (curl == NULL) return NULL;
+    response->len     = 0;
+    response->data[0] = 0;
+    curl_easy_setopt(curl, CURLOPT_URL,             url);
+    curl_easy_setopt(curl, CURLOPT_SHARE,           self->share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL,        1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,  (long)UPLOADER_CONNECT_TIMEOUT_S);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)UPLOADER_STALL_BYTES);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,  (long)UPLOADER_STALL_S);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,   uploader_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA,       response);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT,       "recordthepiano");
+    return curl;
+}
+
+// the response code, or 0 if the request didn't get one
+static long uploader_perform(CURL *curl, const char *what) {
+    CURLcode rc = curl_easy_perform(curl);
+    if (rc != CURLE_OK) {
+        tracef("%s failed: %s", what, curl_easy_strerror(rc));
+        return 0;
+    }
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    return code;
+}
+
+static bool uploader_read_login(uploader_t *self, char *username, char *password, int len) {
+    FILE *f = fopen(self->login_path, "r");
+    if (f == NULL) {
+        tracef("make sure that %s exists with username/password on two separate lines", self->login_path);
+        return false;
+    }
+    char line[512];
+    int  nlines = 0;
+    while (nlines < 2 && fgets(line, sizeof(line), f) != NULL) {
+        int n = strlen(line);
+        while (n > 0 && isspace(line[n - 1])) line[--n] = 0;
+        if (n == 0) continue;
+        snprintf(nlines == 0 ? username : password, len, "%s", line);
+        nlines++;
+    }
+    fclose(f);
+    if (nlines < 2) tracef("%s needs a username and a password on two separate lines", self->login_path);
+    return nlines == 2;
+}
+
+// called with token_lock held
+static bool uploader_login(uploader_t *self) {
+    char username[256], password[256];
+    if (!uploader_read_login(self, username, password, sizeof(username))) return false;
+
+    uploader_response_t *response = malloc(sizeof(uploader_response_t));
+    CURL *curl = response != NULL ? uploader_easy(self, "/oauth2/token", response) : NULL;
+    if (curl == NULL) {
+        free(response);
+        return false;
+    }
+    char *user = curl_easy_escape(curl, username, 0);
+    char *pass = curl_easy_escape(curl, password, 0);
+    char  form[1024];
+    snprintf(form, sizeof(form), "grant_type=password&client_id=%s&client_secret=%s&username=%s&password=%s",
+             UPLOADER_CLIENT_ID, UPLOADER_CLIENT_SECRET, user, pass);
+    curl_free(user);
+    curl_free(pass);
+    curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, form);
+
+    long code = uploader_perform(curl, "login");
+    bool ok   = code == 200 && json_string(response->data, "access_token", self->token, sizeof(self->token));
+    if (ok) {
+        long long expires_in = json_number(response->data, "expires_in");
+        self->token_expires  = expires_in > 0 ? time(NULL) + expires_in : 0;
+        tracef("logged in to %s as %s", self->url, username);
+
+        FILE *f = fopen(self->token_path, "w");
+        if (f != NULL) {
+            fchmod(fileno(f), 0600);
+            fprintf(f, "%s %lld\n", self->token, self->token_expires);
+            fclose(f);
+        }
+    } else {
+        self->token[0] = 0;
+        if (code != 0) tracef("login failed with %ld: %.200s", code, response->data);
+    }
+    curl_easy_cleanup(curl);
+    free(response);
+    return ok;
+}
+
+// a token to use, logging in first if there isn't a good one (or stale
+// is the one the server just turned down)
+static bool uploader_token(uploader_t *self, const char *stale, char *token) {
+    pthread_mutex_lock(&self->token_lock);
+    bool expired = self->token_expires != 0 && self->token_expires - UPLOADER_TOKEN_SLACK_S < time(NULL);
+    bool ok      = true;
+    if (self->token[0] == 0 || expired || (stale != NULL && strcmp(stale, self->token) == 0)) {
+        ok = uploader_login(self);
+    }
+    strcpy(token, self->token);
+    pthread_mutex_unlock(&self->token_lock);
+    return ok;
+}
+
+// recordings are named for when they started, which is a better title than
+// when they happened to get uploaded. a stream's name follows the time when
+// there's more than one: "<time>-<name>,<n>s.flac"
+static void uploader_title(const char *filename, char *title, int len) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(filename, "%Y-%m-%dT%H:%M:%S%z", &tm);
+    if (end == NULL) {
+        time_t now = time(NULL);
+        localtime_r(&now, &tm);
+    }
+    int off = strftime(title, len, "%a, %e %b %Y %l:%M:%S %p", &tm);
+    if (end != NULL && *end == '-') {
+        snprintf(title + off, len - off, " (%.*s)", (int)strcspn(end + 1, ",."), end + 1);
+    }
+}
+
+bool uploader_upload(uploader_t *self, const char *filename, char *permalink, int len) {
+    char title[128];
+    uploader_title(filename, title, sizeof(title));
+    struct stat st;
+    bool artwork = self->artwork_path[0] && stat(self->artwork_path, &st) == 0;
+
+    uploader_response_t *response = malloc(sizeof(uploader_response_t));
+    if (response == NULL) return false;
+    char token[UPLOADER_MAX_TOKEN] = "";
+    bool ok = false;
+    int  attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (!uploader_token(self, attempt > 0 ? token : NULL, token)) break;
+        CURL *curl = uploader_easy(self, "/tracks", response);
+        if (curl == NULL) break;
+
+        // the parts are read from disk as they're sent
+        curl_mime *mime = curl_mime_init(curl);
+        curl_mimepart *part;
+        part = curl_mime_addpart(mime);
+        curl_mime_name(part, "track[title]");
+        curl_mime_data(part, title, CURL_ZERO_TERMINATED);
+        part = curl_mime_addpart(mime);
+        curl_mime_name(part, "track[sharing]");
+        curl_mime_data(part, "public", CURL_ZERO_TERMINATED);
+        part = curl_mime_addpart(mime);
+        curl_mime_name(part, "track[downloadable]");
+        curl_mime_data(part, "true", CURL_ZERO_TERMINATED);
+        part = curl_mime_addpart(mime);
+        curl_mime_name(part, "track[asset_data]");
+        curl_mime_filedata(part, filename);
+        curl_mime_type(part, "audio/flac");
+        if (artwork) {
+            part = curl_mime_addpart(mime);
+            curl_mime_name(part, "track[artwork_data]");
+            curl_mime_filedata(part, self->artwork_path);
+            curl_mime_type(part, "image/png");
+        }
+        curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+
+        char auth[UPLOADER_MAX_TOKEN + 32];
+        snprintf(auth, sizeof(auth), "Authorization: OAuth %s", token);
+        struct curl_slist *headers = curl_slist_append(NULL, auth);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+        long code  = uploader_perform(curl, "upload");
+        bool retry = false;
+        if (code >= 200 && code < 300) {
+            ok = true;
+            if (permalink != NULL && !json_string(response->data, "permalink_url", permalink, len)) permalink[0] = 0;
+        } else if (code == 401 && attempt == 0) {
+            tracef("upload token was turned down, logging in again");
+            retry = true;
+        } else if (code != 0) {
+            tracef("upload failed with %ld: %.200s", code, response->data);
+        }
+        curl_slist_free_all(headers);
+        curl_mime_free(mime);
+        curl_easy_cleanup(curl);
+        if (!retry) break;
+    }
+    free(response);
+    return ok;
+}
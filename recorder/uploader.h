@@ -0,0 +1,59 @@
+#ifndef INCLUDED_UPLOADER_H
+#define INCLUDED_UPLOADER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+typedef struct uploader uploader_t;
+
+/* uploads recordings to soundcloud (or anything that speaks the same API at
+ * url, e.g. a stand-in server for testing) from inside the recorder.
+ *
+ * the file is streamed from disk as a multipart POST to url/tracks, so it
+ * never has to fit in memory. connections, DNS and TLS sessions are shared
+ * by every upload through one curl share, so after the first upload the
+ * next one usually goes out on an open connection.
+ *
+ * logging in (url/oauth2/token, with the username + password on two lines of
+ * login_path) happens once; the token is kept in memory and in token_path
+ * until it expires or the server turns it down, at which point the upload
+ * logs in again and tries once more.
+ *
+ * artwork_path is attached to every track if it exists.
+ *
+ * uploader_upload may be called from several threads at once.
+ */
+void uploader_init(uploader_t *self, const char *url, const char *login_path, const char *token_path,
+                   const char *artwork_path);
+
+/* returns true if the track was created. permalink gets its url, if the
+ * server sent one.
+ */
+bool uploader_upload(uploader_t *self, const char *filename, char *permalink, int len);
+
+#define UPLOADER_CLIENT_ID          "ec8a506faf1c8b5e9fbf1c0269115399"
+#define UPLOADER_CLIENT_SECRET      "c0368b39183e663ad6d48a24c7fb7343"
+#define UPLOADER_CONNECT_TIMEOUT_S  (30)
+#define UPLOADER_STALL_BYTES        (1024)      // an upload slower than this per second...
+#define UPLOADER_STALL_S            (60)        // ...for this long is given up on
+#define UPLOADER_TOKEN_SLACK_S      (300)       // a token this close to expiring isn't used
+#define UPLOADER_MAX_RESPONSE       (16 * 1024)
+#define UPLOADER_MAX_TOKEN          (256)
+
+struct uploader
+{
+    char                url[1024];
+    char                login_path[1024];
+    char                token_path[1024];
+    char                artwork_path[1024];
+    CURLSH             *share;
+    pthread_mutex_t     share_locks[CURL_LOCK_DATA_LAST];
+
+    pthread_mutex_t     token_lock;
+    char                token[UPLOADER_MAX_TOKEN];     // "" until logged in
+    long long           token_expires;                 // unix seconds, 0 for never
+};
+
+#endif
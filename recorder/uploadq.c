@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include "uploadq.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+static bool uploadq_wanted(const char *filename) {
+    int len    = strlen(filename);
+    int suffix = strlen(UPLOADQ_SUFFIX);
+    return len > suffix && len < UPLOADQ_MAX_FILENAME && strcmp(filename + len - suffix, UPLOADQ_SUFFIX) == 0 &&
+           strchr(filename, '/') == NULL && strchr(filename, '\n') == NULL;
+}
+
+static void uploadq_path(uploadq_t *self, const char *filename, char *buf, int len) {
+    snprintf(buf, len, "%s/%s", self->dir, filename);
+}
+
+static bool uploadq_exists(uploadq_t *self, const char *filename) {
+    char path[2048];
+    struct stat st;
+    uploadq_path(self, filename, path, sizeof(path));
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static uploadq_entry_t *uploadq_find(uploadq_t *self, const char *filename) {
+    int i;
+    for (i = 0; i < self->nentries; i++) {
+        if (strcmp(self->entries[i].filename, filename) == 0) return &self->entries[i];
+    }
+    return NULL;
+}
+
+static uploadq_entry_t *uploadq_append(uploadq_t *self, const char *filename) {
+    if (self->nentries == self->capacity) {
+        int capacity = self->capacity ? self->capacity * 2 : 16;
+        uploadq_entry_t *entries = realloc(self->entries, sizeof(uploadq_entry_t) * capacity);
+        if (entries == NULL) failf("couldn't grow upload queue to %d files", capacity);
+        self->entries  = entries;
+        self->capacity = capacity;
+    }
+    uploadq_entry_t *e = &self->entries[self->nentries++];
+    memset(e, 0, sizeof(*e));
+    strcpy(e->filename, filename);
+    return e;
+}
+
+static void uploadq_remove(uploadq_t *self, uploadq_entry_t *e) {
+    int i = e - self->entries;
+    memmove(e, e + 1, sizeof(uploadq_entry_t) * (self->nentries - i - 1));
+    self->nentries--;
+}
+
+static long long uploadq_backoff(uploadq_t *self, int failures) {
+    long long us = self->retry_initial_us;
+    while (--failures > 0 && us < self->retry_max_us) us *= 2;
+    return us < self->retry_max_us ? us : self->retry_max_us;
+}
+
+// a line is small enough that O_APPEND writes it in one piece. the sync
+// is what lets a restart trust the journal instead of rescanning.
+static void uploadq_journal(uploadq_t *self, const char *fmt, ...) {
+    if (self->journal_fd < 0) return;
+    char line[UPLOADQ_MAX_FILENAME + 64];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (write(self->journal_fd, line, len) != len || fdatasync(self->journal_fd) != 0) {
+        tracef("couldn't append to upload journal: %s", strerror(errno));
+    }
+}
+
+// "add <file>", "fail <failures> <file>", "done <file>", oldest first
+static bool uploadq_load(uploadq_t *self, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        if (errno != ENOENT) tracef("couldn't read upload journal %s: %s", path, strerror(errno));
+        return false;
+    }
+    char line[UPLOADQ_MAX_FILENAME + 64];
+    char filename[UPLOADQ_MAX_FILENAME];
+    int  failures;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        uploadq_entry_t *e;
+        if (sscanf(line, "add %255s", filename) == 1) {
+            if (uploadq_wanted(filename) && uploadq_find(self, filename) == NULL) uploadq_append(self, filename);
+        } else if (sscanf(line, "fail %d %255s", &failures, filename) == 2) {
+            if ((e = uploadq_find(self, filename)) != NULL) e->failures = failures;
+        } else if (sscanf(line, "done %255s", filename) == 1) {
+            if ((e = uploadq_find(self, filename)) != NULL) uploadq_remove(self, e);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static int uploadq_compare(const void *a, const void *b) {
+    return strcmp(((const uploadq_entry_t*)a)->filename, ((const uploadq_entry_t*)b)->filename);
+}
+
+// only the first run after an upgrade (or a lost journal) gets here.
+// recordings are named by when they started, so by name is oldest first.
+static void uploadq_scan(uploadq_t *self) {
+    DIR *dir = opendir(self->dir);
+    if (dir == NULL) {
+        tracef("couldn't scan %s for uploads: %s", self->dir, strerror(errno));
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (uploadq_wanted(ent->d_name) && uploadq_find(self, ent->d_name) == NULL) {
+            uploadq_append(self, ent->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(self->entries, self->nentries, sizeof(uploadq_entry_t), uploadq_compare);
+}
+
+// rewrites the journal as just the pending files, then keeps it open for appending
+static void uploadq_compact(uploadq_t *self, const char *path) {
+    char tmppath[2048 + 8];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    FILE *f = fopen(tmppath, "w");
+    if (f == NULL) {
+        tracef("couldn't write upload journal %s: %s. the queue won't survive a restart", tmppath, strerror(errno));
+        return;
+    }
+    int i;
+    for (i = 0; i < self->nentries; i++) {
+        fprintf(f, "add %s\n", self->entries[i].filename);
+        if (self->entries[i].failures > 0) {
+            fprintf(f, "fail %d %s\n", self->entries[i].failures, self->entries[i].filename);
+        }
+    }
+    if (fflush(f) != 0 || fdatasync(fileno(f)) != 0 || fclose(f) != 0 || rename(tmppath, path) != 0) {
+        tracef("couldn't replace upload journal %s: %s. the queue won't survive a restart", path, strerror(errno));
+        return;
+    }
+    self->journal_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (self->journal_fd < 0) tracef("couldn't open upload journal %s: %s", path, strerror(errno));
+}
+
+void uploadq_init(uploadq_t *self, const char *dir, int nworkers, int retry_initial_s, int retry_max_s,
+                  uploadq_upload_cb_t upload, void *userdata) {
+    memset(self, 0, sizeof(*self));
+    snprintf(self->dir, sizeof(self->dir), "%s", dir);
+    self->nworkers         = nworkers < 1 ? 1 : nworkers > UPLOADQ_MAX_WORKERS ? UPLOADQ_MAX_WORKERS : nworkers;
+    self->retry_initial_us = (long long)retry_initial_s * 1000000;
+    self->retry_max_us     = (long long)retry_max_s * 1000000;
+    self->upload           = upload;
+    self->userdata         = userdata;
+    self->journal_fd       = -1;
+    self->inotify_fd       = -1;
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wakeup, NULL);
+
+    char path[2048];
+    uploadq_path(self, UPLOADQ_JOURNAL, path, sizeof(path));
+    if (!uploadq_load(self, path)) {
+        tracef("no upload journal, scanning %s", self->dir);
+        uploadq_scan(self);
+    }
+
+    // anything deleted by hand while we weren't running is gone for good
+    long long now = now_us();
+    int i, n = 0;
+    for (i = 0; i < self->nentries; i++) {
+        uploadq_entry_t *e = &self->entries[i];
+        if (!uploadq_exists(self, e->filename)) continue;
+        e->due_us = e->failures > 0 ? now + uploadq_backoff(self, e->failures) : 0;
+        self->entries[n++] = *e;
+    }
+    self->nentries = n;
+    uploadq_compact(self, path);
+    tracef("upload queue has %d files", self->nentries);
+}
+
+void uploadq_add(uploadq_t *self, const char *filename) {
+    if (!uploadq_wanted(filename)) return;
+    pthread_mutex_lock(&self->lock);
+    // inotify can report a file after a worker has already uploaded it
+    if (uploadq_find(self, filename) == NULL && uploadq_exists(self, filename)) {
+        uploadq_append(self, filename);
+        uploadq_journal(self, "add %s\n", filename);
+        pthread_cond_signal(&self->wakeup);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+int uploadq_pending(uploadq_t *self) {
+    pthread_mutex_lock(&self->lock);
+    int n = self->nentries;
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+// the oldest file that's due, or NULL and when the next one will be
+static uploadq_entry_t *uploadq_next(uploadq_t *self, long long now, long long *next_due_us) {
+    int i;
+    *next_due_us = 0;
+    for (i = 0; i < self->nentries; i++) {
+        uploadq_entry_t *e = &self->entries[i];
+        if (e->busy) continue;
+        if (e->due_us <= now) return e;
+        if (*next_due_us == 0 || e->due_us < *next_due_us) *next_due_us = e->due_us;
+    }
+    return NULL;
+}
+
+static void *uploadq_worker_main(void *arg) {
+    uploadq_t *self = (uploadq_t*)arg;
+    char filename[UPLOADQ_MAX_FILENAME];
+    char path[2048];
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        long long next_due_us;
+        uploadq_entry_t *e = uploadq_next(self, now_us(), &next_due_us);
+        if (e == NULL) {
+            if (next_due_us == 0) {
+                pthread_cond_wait(&self->wakeup, &self->lock);
+            } else {
+                struct timespec ts = { next_due_us / 1000000, (next_due_us % 1000000) * 1000 };
+                pthread_cond_timedwait(&self->wakeup, &self->lock, &ts);
+            }
+            continue;
+        }
+        e->busy = true;
+        strcpy(filename, e->filename);
+        pthread_mutex_unlock(&self->lock);
+
+        bool ok = self->upload(self->userdata, filename);
+
+        // entries move as others finish, so look it up again
+        pthread_mutex_lock(&self->lock);
+        e = uploadq_find(self, filename);
+        if (ok) {
+            uploadq_journal(self, "done %s\n", filename);
+            uploadq_path(self, filename, path, sizeof(path));
+            unlink(path);
+            uploadq_remove(self, e);
+        } else {
+            e->busy   = false;
+            e->failures++;
+            long long backoff = uploadq_backoff(self, e->failures);
+            e->due_us = now_us() + backoff;
+            uploadq_journal(self, "fail %d %s\n", e->failures, filename);
+            tracef("will retry %s in %ds (%d failures)", filename, (int)(backoff / 1000000), e->failures);
+        }
+    }
+    return NULL;
+}
+
+static void *uploadq_watch_main(void *arg) {
+    uploadq_t *self = (uploadq_t*)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        int n = read(self->inotify_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            tracef("upload queue lost its inotify watch: %s. only recordings will be queued", strerror(errno));
+            return NULL;
+        }
+        int off = 0;
+        while (off < n) {
+            struct inotify_event *ev = (struct inotify_event*)(buf + off);
+            if (ev->mask & IN_Q_OVERFLOW) tracef("upload queue missed inotify events");
+            if (ev->len > 0 && (ev->mask & (IN_MOVED_TO | IN_CLOSE_WRITE))) uploadq_add(self, ev->name);
+            off += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+void uploadq_start(uploadq_t *self) {
+    self->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (self->inotify_fd < 0 || inotify_add_watch(self->inotify_fd, self->dir, IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+        tracef("couldn't watch %s: %s. only recordings will be queued", self->dir, strerror(errno));
+    } else {
+        pthread_create(&self->watch_thread, NULL, uploadq_watch_main, self);
+    }
+    int i;
+    for (i = 0; i < self->nworkers; i++) {
+        pthread_create(&self->workers[i], NULL, uploadq_worker_main, self);
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef INCLUDED_UPLOADQ_H
+#define INCLUDED_UPLOADQ_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct uploadq uploadq_t;
+
+/* uploads one file. returns true if it made it. called on a worker thread,
+ * with up to nworkers calls in flight at once.
+ */
+typedef bool (*uploadq_upload_cb_t)(void *userdata, const char *filename);
+
+/* queue of finished recordings waiting to be uploaded.
+ *
+ * files come in two ways: the recorder hands each one over with uploadq_add
+ * as soon as it's renamed into place, and an inotify watch on dir picks up
+ * any .flac moved or written there by anything else. adding a file that's
+ * already queued does nothing, so both seeing the same one is harmless.
+ *
+ * nworkers threads take the oldest file that's due and call upload on it.
+ * a file that uploads is deleted; one that fails is retried after
+ * retry_initial_s, doubling each time up to retry_max_s, while the rest of
+ * the queue carries on.
+ *
+ * every add, failure and completion is appended to UPLOADQ_JOURNAL in dir,
+ * so a restart picks up the queue (and each file's backoff) from there
+ * instead of rescanning the directory, and doesn't upload a finished file
+ * again. the journal is compacted to just the pending files at startup.
+ * with no journal yet, dir is scanned once to seed it.
+ */
+void uploadq_init(uploadq_t *self, const char *dir, int nworkers, int retry_initial_s, int retry_max_s,
+                  uploadq_upload_cb_t upload, void *userdata);
+
+/* starts the workers and the watch */
+void uploadq_start(uploadq_t *self);
+
+/* queues filename (relative to dir). safe to call from any thread. */
+void uploadq_add(uploadq_t *self, const char *filename);
+
+/* files queued, including the ones being uploaded */
+int  uploadq_pending(uploadq_t *self);
+
+#define UPLOADQ_JOURNAL       "upload.journal"
+#define UPLOADQ_SUFFIX        ".flac"
+#define UPLOADQ_MAX_FILENAME  (256)
+#define UPLOADQ_MAX_WORKERS   (16)
+
+typedef struct {
+    char        filename[UPLOADQ_MAX_FILENAME];
+    int         failures;
+    long long   due_us;         // not tried again before this
+    bool        busy;           // a worker has it
+} uploadq_entry_t;
+
+struct uploadq
+{
+    char                 dir[1024];
+    int                  nworkers;
+    long long            retry_initial_us;
+    long long            retry_max_us;
+    uploadq_upload_cb_t  upload;
+    void                *userdata;
+
+    pthread_mutex_t      lock;
+    pthread_cond_t       wakeup;
+    uploadq_entry_t     *entries;       // in the order they were added
+    int                  nentries;
+    int                  capacity;
+    int                  journal_fd;    // appended to under lock
+
+    int                  inotify_fd;
+    pthread_t            watch_thread;
+    pthread_t            workers[UPLOADQ_MAX_WORKERS];
+};
+
+#endif
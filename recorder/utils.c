@@ -1,9 +1,12 @@
 #include "utils.h"
+#include "tracelog.h"
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
 
 void lineparser_init(lineparser_t *self, lineparser_cb_t cb, void *userdata) {
@@ -37,7 +40,11 @@ int lineparser_write(lineparser_t *self, const void *buf, int off, int len)
     return ret;
 }
 
+// the fatal ones write synchronously, after whatever was traced before them
 void perrorf(const char *s, const char *fmt, ...) {
+    int err = errno;    // flushing writes to stderr, which can clobber it
+    tracelog_flush();
+    errno = err;
     perror(s);
     va_list ap;
     va_start(ap, fmt); 
@@ -48,6 +55,7 @@ void perrorf(const char *s, const char *fmt, ...) {
 }
 
 void failf(const char *fmt, ...) {
+    tracelog_flush();
     va_list ap;
     va_start(ap, fmt); 
     fprintf(stderr, "[recordthepiano] ");
@@ -58,10 +66,9 @@ void failf(const char *fmt, ...) {
 
 void tracef(const char *fmt, ...) {
     va_list ap;
-    va_start(ap, fmt); 
-    fprintf(stderr, "[recordthepiano] ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    va_start(ap, fmt);
+    tracelog_write(fmt, ap);
+    va_end(ap);
 }
 
 long long now_us() {
@@ -70,3 +77,17 @@ long long now_us() {
     return (long long)tv.tv_sec * 1000000 + (long long)tv.tv_usec;
 }
 
+static long long clock_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000 + (long long)ts.tv_nsec / 1000;
+}
+
+long long thread_cpu_us() {
+    return clock_us(CLOCK_THREAD_CPUTIME_ID);
+}
+
+long long process_cpu_us() {
+    return clock_us(CLOCK_PROCESS_CPUTIME_ID);
+}
+
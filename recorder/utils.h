@@ -28,7 +28,9 @@ struct lineparser
 
 void perrorf(const char *s, const char *fmt, ...);
 void failf(const char *fmt, ...);
-void tracef(const char *fmt, ...);
+void tracef(const char *fmt, ...);    // fmt must be a string literal, see tracelog.h
 long long now_us();
+long long thread_cpu_us();      // cpu time used by the calling thread
+long long process_cpu_us();     // cpu time used by every thread
 
 #endif
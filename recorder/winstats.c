@@ -0,0 +1,106 @@
+#include "winstats.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void winstats_init(winstats_t *self, int window, double threshold) {
+    memset(self, 0, sizeof(*self));
+    self->window    = window;
+    self->threshold = threshold;
+    self->values    = calloc(window, sizeof(double));
+    self->maxq      = calloc(window, sizeof(long long));
+    if (self->values == NULL || self->maxq == NULL) {
+        failf("couldn't allocate %d entry window", window);
+    }
+}
+
+void winstats_destroy(winstats_t *self) {
+    free(self->values);
+    free(self->maxq);
+    self->values = NULL;
+    self->maxq   = NULL;
+}
+
+static double winstats_value_at(const winstats_t *self, long long idx) {
+    return self->values[idx % self->window];
+}
+
+// recomputes the running sum from scratch every `window` pushes so
+// floating point error from add/subtract can't build up
+static void winstats_resum(winstats_t *self) {
+    double sum = 0;
+    long long idx;
+    for (idx = self->pushed - self->filled; idx < self->pushed; idx++) {
+        sum += winstats_value_at(self, idx);
+    }
+    self->sum = sum;
+}
+
+void winstats_push(winstats_t *self, double value) {
+    int pos = (int)(self->pushed % self->window);
+
+    // evict the oldest value if it is still part of the window
+    if (self->filled == self->window) {
+        double old = self->values[pos];
+        self->sum -= old;
+        if (old > self->threshold) self->loud--;
+    } else {
+        self->filled++;
+    }
+
+    self->values[pos] = value;
+    self->sum += value;
+    if (value > self->threshold) self->loud++;
+
+    // drop the max candidate that just left the window
+    if (self->maxq_len > 0 && self->maxq[self->maxq_head] <= self->pushed - self->window) {
+        self->maxq_head = (self->maxq_head + 1) % self->window;
+        self->maxq_len--;
+    }
+    // and every candidate that the new value dominates
+    while (self->maxq_len > 0) {
+        int tail = (self->maxq_head + self->maxq_len - 1) % self->window;
+        if (winstats_value_at(self, self->maxq[tail]) > value) break;
+        self->maxq_len--;
+    }
+    self->maxq[(self->maxq_head + self->maxq_len) % self->window] = self->pushed;
+    self->maxq_len++;
+
+    self->pushed++;
+    if (self->pushed % self->window == 0) winstats_resum(self);
+}
+
+void winstats_clear(winstats_t *self) {
+    self->filled   = 0;
+    self->loud     = 0;
+    self->sum      = 0;
+    self->maxq_len = 0;
+}
+
+void winstats_set_threshold(winstats_t *self, double threshold) {
+    self->threshold = threshold;
+    self->loud      = 0;
+    long long idx;
+    for (idx = self->pushed - self->filled; idx < self->pushed; idx++) {
+        if (winstats_value_at(self, idx) > threshold) self->loud++;
+    }
+}
+
+int winstats_loud(const winstats_t *self) {
+    return self->loud;
+}
+
+double winstats_mean(const winstats_t *self) {
+    return self->sum / self->window;
+}
+
+double winstats_max(const winstats_t *self) {
+    if (self->maxq_len == 0) return 0.0;
+    double max = winstats_value_at(self, self->maxq[self->maxq_head]);
+    return max > 0.0 ? max : 0.0;
+}
+
+int winstats_window(const winstats_t *self) {
+    return self->window;
+}
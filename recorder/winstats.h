@@ -0,0 +1,47 @@
+#ifndef INCLUDED_WINSTATS_H
+#define INCLUDED_WINSTATS_H
+
+typedef struct winstats winstats_t;
+
+/* sliding window statistics over the last `window` values pushed.
+ *
+ * keeps the number of values above a threshold, the mean and the max up to
+ * date in O(1) per push (amortized), so the cost doesn't grow with the
+ * window length. slots that haven't been pushed since init or the last
+ * winstats_clear count as 0.
+ */
+void winstats_init(winstats_t *self, int window, double threshold);
+void winstats_destroy(winstats_t *self);
+
+void winstats_push(winstats_t *self, double value);
+
+/* forget every value in O(1), as if the window were full of zeros */
+void winstats_clear(winstats_t *self);
+
+/* changes the loudness threshold. this recounts the window, so it is
+ * O(window) and meant for occasional recalibration, not every push.
+ */
+void winstats_set_threshold(winstats_t *self, double threshold);
+
+int    winstats_loud(const winstats_t *self);       // values > threshold
+double winstats_mean(const winstats_t *self);
+double winstats_max(const winstats_t *self);
+int    winstats_window(const winstats_t *self);
+
+struct winstats
+{
+    int         window;
+    double      threshold;
+    double     *values;     // ring of the last `window` values
+    long long   pushed;     // total values pushed; the next one goes at pushed % window
+    int         filled;     // how many slots hold values pushed since the last clear
+    int         loud;
+    double      sum;
+
+    // monotonic deque of push indices with decreasing values, for the max
+    long long  *maxq;
+    int         maxq_head;
+    int         maxq_len;
+};
+
+#endif